@@ -168,12 +168,6 @@ IXION_DLLPUBLIC std::ostream& operator<<(std::ostream& os, const address_t& addr
 IXION_DLLPUBLIC std::ostream& operator<<(std::ostream& os, const abs_range_t& range);
 IXION_DLLPUBLIC std::ostream& operator<<(std::ostream& os, const range_t& range);
 
-/**
- * Collection of formula cells that have been modified or formula cells that
- * reference other modified cells either directly or indirectly.
- */
-typedef std::unordered_set<abs_address_t, abs_address_t::hash> dirty_formula_cells_t;
-
 /**
  * Collection of cells that have been modified.
  */
@@ -0,0 +1,203 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef __IXION_ADDRESS_SET_HPP__
+#define __IXION_ADDRESS_SET_HPP__
+
+#include "ixion/global.hpp"
+#include "ixion/address.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+namespace ixion {
+
+/**
+ * Set of absolute cell addresses, organized by sheet and column.  The rows
+ * of each column are stored in a bitmap, which is split into chunks of
+ * fixed size, and only the chunks containing any rows get allocated.  Only
+ * the columns containing any rows are stored in each sheet, sorted by
+ * their positions, so a set holding a few cells far right in a sheet stays
+ * small.  The addresses are iterated in order of sheet, column and row,
+ * which is the order in which the cells are laid out in the model.
+ */
+class IXION_DLLPUBLIC abs_address_set
+{
+    typedef uint64_t word_type;
+
+    /** row chunks of a column, which are NULL when they have no rows. */
+    typedef std::vector<word_type*> column_type;
+
+    /** columns of a sheet sorted by their positions. */
+    typedef std::vector<std::pair<col_t, column_type>> sheet_type;
+
+public:
+    typedef abs_address_t value_type;
+    typedef size_t size_type;
+
+    /**
+     * Iterator over the addresses in order of sheet, column and row.  It
+     * gets invalidated when the set is modified.
+     */
+    class IXION_DLLPUBLIC const_iterator
+    {
+        friend class abs_address_set;
+
+        const abs_address_set* mp_set;
+        abs_address_t m_pos;
+
+        const_iterator(const abs_address_set* p, const abs_address_t& pos);
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef abs_address_t value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const abs_address_t* pointer;
+        typedef const abs_address_t& reference;
+
+        const_iterator();
+
+        const abs_address_t& operator*() const { return m_pos; }
+        const abs_address_t* operator->() const { return &m_pos; }
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+
+        bool operator== (const const_iterator& r) const;
+        bool operator!= (const const_iterator& r) const;
+    };
+
+    typedef const_iterator iterator;
+
+    abs_address_set();
+    abs_address_set(const abs_address_set& r);
+    abs_address_set(abs_address_set&& r);
+
+    template<typename _Iter>
+    abs_address_set(_Iter it, _Iter it_end) : m_size(0)
+    {
+        insert(it, it_end);
+    }
+
+    ~abs_address_set();
+
+    abs_address_set& operator= (abs_address_set r);
+
+    /**
+     * Insert an address.  The sheet, row and column of the address must
+     * not be negative, or else a general_error gets thrown.
+     *
+     * @param addr address to insert.
+     *
+     * @return true if the address has been inserted, or false if it was
+     *         already in the set.
+     */
+    bool insert(const abs_address_t& addr);
+
+    template<typename _Iter>
+    void insert(_Iter it, _Iter it_end)
+    {
+        for (; it != it_end; ++it)
+            insert(*it);
+    }
+
+    /**
+     * Insert all addresses of another set.  It merges the bitmaps of the two
+     * sets rather than inserting the addresses one at a time.
+     *
+     * @param r set whose addresses to insert.
+     */
+    void insert(const abs_address_set& r);
+
+    /**
+     * @return number of addresses erased, which is either 0 or 1.
+     */
+    size_t erase(const abs_address_t& addr);
+
+    /**
+     * @return 1 if the address is in the set, 0 otherwise.
+     */
+    size_t count(const abs_address_t& addr) const;
+
+    /**
+     * Get all addresses within a range, in order of sheet, column and row.
+     *
+     * @param range range to look up.
+     * @param addrs addresses within the range are appended to this
+     *              container.
+     */
+    void get_addresses(const abs_range_t& range, std::vector<abs_address_t>& addrs) const;
+
+    /**
+     * @return true if any address in the set is within a range, false
+     *         otherwise.
+     */
+    bool intersects(const abs_range_t& range) const;
+
+    size_t size() const;
+    bool empty() const;
+    void clear();
+    void swap(abs_address_set& r);
+
+    const_iterator begin() const;
+    const_iterator end() const;
+
+    bool operator== (const abs_address_set& r) const;
+    bool operator!= (const abs_address_set& r) const;
+
+private:
+    /**
+     * Find the first address in the set that comes at or after a position.
+     *
+     * @param pos position to start looking from, which receives the address
+     *            found.
+     *
+     * @return true if an address has been found, false otherwise.
+     */
+    bool find_next(abs_address_t& pos) const;
+
+    /**
+     * Find the first row of a column in the set that comes at or after a
+     * row.
+     *
+     * @param column column to look up.
+     * @param start row to start looking from.
+     * @param row row found.
+     *
+     * @return true if a row has been found, false otherwise.
+     */
+    static bool find_row(const column_type& column, row_t start, row_t& row);
+
+    /**
+     * @return iterator to the first column of a sheet at or after a column
+     *         position.
+     */
+    static sheet_type::const_iterator lower_bound(const sheet_type& sheet, col_t col);
+    static sheet_type::iterator lower_bound(sheet_type& sheet, col_t col);
+
+    /**
+     * @return row chunks of a column, or NULL if the column has no rows.
+     */
+    const column_type* get_column(const abs_address_t& addr) const;
+
+    std::vector<sheet_type> m_sheets;
+    size_t m_size;
+};
+
+/**
+ * Collection of formula cells that have been modified or formula cells that
+ * reference other modified cells either directly or indirectly.
+ */
+typedef abs_address_set dirty_formula_cells_t;
+
+}
+
+#endif
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
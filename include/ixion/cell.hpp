@@ -12,8 +12,8 @@
 #include "ixion/address.hpp"
 #include "ixion/types.hpp"
 
-#include <boost/thread/condition_variable.hpp>
-#include <boost/thread/mutex.hpp>
+#include <atomic>
+#include <cstdint>
 
 namespace ixion {
 
@@ -23,27 +23,38 @@ class formula_cell;
 namespace iface {
 
 class formula_model_access;
+class session_handler;
 
 }
 
 class formula_cell
 {
-    struct interpret_status
+    /**
+     * Calculation state of the cell.  The lower bits store one of these
+     * values, which also tells which member of the result is valid, and the
+     * highest bit is set while any thread is blocked waiting for the result.
+     * The pending bit is set while the cell is dirty and waits for lazy
+     * calculation, in which case nobody computes it until it's asked for
+     * with the model.
+     */
+    enum state_type : uint8_t
     {
-        interpret_status(const interpret_status&) = delete;
-        interpret_status& operator=(const interpret_status&) = delete;
-
-        ::boost::mutex mtx;
-        ::boost::condition_variable cond;
-
-        formula_result* result;
-
-        interpret_status();
-        ~interpret_status();
+        /** result is not available. */
+        state_dirty     = 0x00,
+        /** the cell is being interpreted. */
+        state_computing = 0x01,
+        /** result is available, and it's a numeric value. */
+        state_value     = 0x02,
+        /** result is available, and it's a string. */
+        state_string    = 0x03,
+        /** result is available, and it's an error. */
+        state_error     = 0x04,
+
+        state_mask      = 0x07,
+        state_pending   = 0x40,
+        state_waiting   = 0x80
     };
 
-    void reset_flag();
-
     formula_cell(const formula_cell&) = delete;
 public:
     IXION_DLLPUBLIC formula_cell();
@@ -53,54 +64,180 @@ public:
     IXION_DLLPUBLIC size_t get_identifier() const;
     void set_identifier(size_t identifier);
 
+    /**
+     * Get the value of this cell, blocking until another thread finishes
+     * interpreting it if needed.  A cell left dirty for lazy calculation
+     * doesn't get interpreted by anyone, so this throws a formula_error of
+     * fe_ref_result_not_available instead of blocking; use the overload
+     * taking the model to have it calculated first.
+     *
+     * @return value of this cell.
+     */
     IXION_DLLPUBLIC double get_value() const;
+
+    /**
+     * Get the value of this cell.  When the lazy_calc parameter of the
+     * model's config is set, and the cell has been marked dirty for lazy
+     * calculation, it gets calculated first along with the dirty cells it
+     * depends on.
+     *
+     * @param context model context.
+     * @param pos address of this cell.
+     *
+     * @return value of this cell.
+     */
+    IXION_DLLPUBLIC double get_value(iface::formula_model_access& context, const abs_address_t& pos) const;
+
     IXION_DLLPUBLIC double get_value_nowait() const;
     IXION_DLLPUBLIC void interpret(iface::formula_model_access& context, const abs_address_t& pos);
 
     /**
-     * Determine if this cell contains circular reference by walking through
-     * all its reference tokens.
+     * Interpret this cell, reporting the progress to the specified session
+     * handler instead of the one provided by the model context.
+     *
+     * @param context model context.
+     * @param pos address of this cell.
+     * @param handler session handler, or NULL to not report anything.
+     */
+    IXION_DLLPUBLIC void interpret(
+        iface::formula_model_access& context, const abs_address_t& pos, iface::session_handler* handler);
+
+    /**
+     * Mark this cell as part of a circular reference.  It sets the result
+     * to a reference error, and the cell won't be interpreted until it gets
+     * reset.
+     */
+    void set_circular();
+
+    /**
+     * Prepare this cell for iterative calculation of the circular reference
+     * that it's part of, by setting its result to 0.  The other cells of
+     * the circular reference read this value until the cell gets
+     * interpreted in the first iteration.
      */
-    void check_circular(const iface::formula_model_access& cxt, const abs_address_t& pos);
+    void start_iteration();
+
+    /**
+     * Interpret this cell once as part of the iterative calculation of a
+     * circular reference.  Unlike interpret(), it interprets the cell even
+     * though it already has a result, which stays readable until the new
+     * result replaces it.
+     *
+     * @param context model context.
+     * @param pos address of this cell.
+     *
+     * @return absolute change of the value from the previous result, or
+     *         infinity if the type of the result has changed, or if either
+     *         result is a string or an error that differs from the other.
+     */
+    double interpret_iteration(iface::formula_model_access& context, const abs_address_t& pos);
 
     /**
      * Reset cell's internal state.
      */
     IXION_DLLPUBLIC void reset();
 
+    /**
+     * Reset cell's internal state like reset(), and mark it as waiting for
+     * lazy calculation.  The mark gets cleared once the cell is interpreted
+     * or reset again.
+     */
+    void reset_pending();
+
+    /**
+     * Reset cell's internal state like reset(), but hand the result of the
+     * last interpretation over to the caller.
+     *
+     * @param result receives the result of the last interpretation, if the
+     *               cell has one.
+     *
+     * @return true if the cell had a result, false otherwise.
+     */
+    bool release_result(formula_result& result);
+
+    /**
+     * Put back a result released by release_result() without interpreting
+     * the cell, when none of the cells it references has changed since.
+     *
+     * @param result result to put back.
+     */
+    void restore_result(const formula_result& result);
+
     IXION_DLLPUBLIC void get_ref_tokens(
         const iface::formula_model_access& cxt, const abs_address_t& pos, std::vector<const formula_token_base*>& tokens);
 
-    IXION_DLLPUBLIC const formula_result* get_result_cache() const;
+    /**
+     * @return true if the result of the last interpretation is available,
+     *         false otherwise.
+     */
+    IXION_DLLPUBLIC bool has_result() const;
+
+    /**
+     * Get the result of the last interpretation, without blocking.
+     *
+     * @param result receives the result, if available.
+     *
+     * @return true if the result is available, false otherwise.
+     */
+    IXION_DLLPUBLIC bool get_result_cache(formula_result& result) const;
 
     IXION_DLLPUBLIC bool is_shared() const;
     IXION_DLLPUBLIC void set_shared(bool b);
 
+    /**
+     * Get the time it took to interpret this cell the last time it was
+     * interpreted.  The value is kept across resets, so that it can be used
+     * to estimate the cost of the next calculation.
+     *
+     * @return interpretation time in nanoseconds, or 0 if the cell has never
+     *         been interpreted.
+     */
+    IXION_DLLPUBLIC uint32_t get_eval_cost() const;
+
 private:
     /**
-     * Block until the result becomes available.
+     * Block until the result becomes available.  This call doesn't block if
+     * the result is already available.
      *
-     * @param lock mutex lock associated with the result cache data.
+     * @return state_value, state_string or state_error.
      */
-    void wait_for_interpreted_result(::boost::mutex::scoped_lock& lock) const;
+    uint8_t wait_for_interpreted_result() const;
 
     /**
-     * Check if this cell contains a circular reference.
+     * Store the result, and wake up all threads waiting for it.
      *
-     * @return true if this cell contains no circular reference, hence
-     *         considered "safe", false otherwise.
+     * @param result result to store.
      */
-    bool is_circular_safe() const;
+    void publish_result(const formula_result& result);
 
-    bool check_ref_for_circular_safety(const formula_cell& ref, const abs_address_t& pos);
+    /**
+     * Copy the stored result.
+     *
+     * @param state state of the cell, which must say the result is
+     *              available.
+     * @param result receives the result.
+     */
+    void fetch_result(uint8_t state, formula_result& result) const;
 
     double fetch_value_from_result() const;
 
 private:
-    mutable interpret_status m_interpret_status;
-    size_t m_identifier;
+    /**
+     * Result of the last interpretation, stored in place.  The state tells
+     * which member is valid.  It's only accessed once the state says the
+     * result is available, which also makes it visible to the reading
+     * thread.
+     */
+    union
+    {
+        double m_value;
+        string_id_t m_str_identifier;
+        formula_error_t m_error;
+    };
+    uint32_t m_identifier;
+    uint32_t m_eval_cost;
+    mutable std::atomic<uint8_t> m_state;
     bool m_shared_token:1;
-    bool m_circular_safe:1;
 };
 
 }
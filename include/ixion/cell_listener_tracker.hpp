@@ -10,8 +10,11 @@
 
 #include "ixion/global.hpp"
 #include "ixion/address.hpp"
+#include "ixion/address_set.hpp"
 
 #include <unordered_set>
+#include <utility>
+#include <vector>
 
 namespace ixion {
 
@@ -25,7 +28,10 @@ class formula_model_access;
 
 /**
  * Track all single and range references being listened to by individual
- * cells.
+ * cells.  It also keeps the references of each cell that listens to them,
+ * so that together they form a persistent graph of precedent and dependent
+ * cells, which is maintained as formula cells get registered and
+ * unregistered.
  */
 class IXION_DLLPUBLIC cell_listener_tracker
 {
@@ -41,6 +47,31 @@ public:
 
     typedef std::unordered_set<abs_address_t, abs_address_t::hash> address_set_type;
 
+    /** reference from a cell (first) to a single cell (second). */
+    typedef std::pair<abs_address_t, abs_address_t> cell_reference_type;
+
+    /** reference from a cell (first) to a range (second). */
+    typedef std::pair<abs_address_t, abs_range_t> range_reference_type;
+
+    /**
+     * Single cells and ranges referenced by a cell.
+     */
+    struct precedents_type
+    {
+        std::vector<abs_address_t> cells;
+        std::vector<abs_range_t> ranges;
+    };
+
+    /**
+     * Single cell and range references of a shared formula, relative to the
+     * position of each cell using the formula.
+     */
+    struct shared_references_type
+    {
+        std::vector<address_t> cells;
+        std::vector<range_t> ranges;
+    };
+
     ~cell_listener_tracker();
 
     /**
@@ -61,6 +92,18 @@ public:
      */
     void add(const abs_address_t& cell, const abs_range_t& range);
 
+    /**
+     * Add many reference relationships at once.  The references are grouped
+     * by the cells and ranges being referenced first, so that the listener
+     * container of each referenced cell or range only gets looked up once,
+     * and the new ranges get inserted into the range lookup before it gets
+     * built.  Duplicates are silently ignored.
+     *
+     * @param cell_refs references to single cells.  This call sorts them.
+     * @param range_refs references to ranges.  This call sorts them.
+     */
+    void add(std::vector<cell_reference_type>& cell_refs, std::vector<range_reference_type>& range_refs);
+
     void remove(const abs_address_t& src, const abs_address_t& dest);
 
     /**
@@ -72,21 +115,142 @@ public:
      */
     void remove(const abs_address_t& cell, const abs_range_t& range);
 
+    /**
+     * Add the references of cells using a shared formula.  The cells form
+     * a block that stores the references only once, and the cells of the
+     * block that listen to a modified cell are worked out from the
+     * references arithmetically.  Cells adjacent to a block of the same
+     * shared formula are merged into that block where the block stays
+     * rectangular.  The cells are not recorded in the individual references
+     * of each cell.
+     *
+     * @param cells cells using the shared formula.  They must all be on the
+     *              same sheet.
+     * @param identifier identifier of the shared formula tokens.
+     * @param refs references of the shared formula.
+     */
+    void add_shared(const abs_range_t& cells, size_t identifier, const shared_references_type& refs);
+
+    /**
+     * Remove the references of a cell using a shared formula.  The block
+     * containing the cell gets split around it.  If the cell doesn't belong
+     * to any block of the shared formula, it does nothing.
+     *
+     * @param cell cell using the shared formula.
+     * @param identifier identifier of the shared formula tokens.
+     */
+    void remove_shared(const abs_address_t& cell, size_t identifier);
+
     void add_volatile(const abs_address_t& pos);
     void remove_volatile(const abs_address_t& pos);
     const address_set_type& get_volatile_cells() const;
 
+    /**
+     * Get the single cells and ranges referenced by a cell, as recorded when
+     * the cell got registered.
+     *
+     * @param cell address of the cell that references other cells.
+     *
+     * @return pointer to the references of the cell, or NULL if the cell
+     *         doesn't reference anything, or has only been added as part
+     *         of a shared formula block.
+     */
+    const precedents_type* get_precedents(const abs_address_t& cell) const;
+
+    /**
+     * Given a modified cell (target), get all formula cells that need to be
+     * re-calculated, starting from the cells that directly reference the
+     * target cell, and following both the single cell and range references
+     * from there on.
+     *
+     * @param target address of the modified cell.
+     * @param listeners all formula cells that need to be re-calculated are
+     *                  inserted into this container.
+     */
     void get_all_cell_listeners(const abs_address_t& target, dirty_formula_cells_t& listeners) const;
 
     /**
      * Given a modified cell (target), get all formula cells that need to be
-     * re-calculated based on the range-to-cells listener relationships.
+     * re-calculated, starting from the cells that reference a range
+     * containing the target cell, and following both the single cell and
+     * range references from there on.
      *
-     * @param target
-     * @param listeners
+     * @param target address of the modified cell.
+     * @param listeners all formula cells that need to be re-calculated are
+     *                  inserted into this container.
      */
     void get_all_range_listeners(const abs_address_t& target, dirty_formula_cells_t& listeners) const;
 
+    /**
+     * Get the formula cells that reference a cell, either directly or
+     * through a range containing it.  Unlike the other lookups, it doesn't
+     * follow the references any further.
+     *
+     * @param target address of the referenced cell.
+     * @param listeners formula cells referencing the target cell are
+     *                  appended to this container, each only once.
+     */
+    void get_direct_listeners(const abs_address_t& target, std::vector<abs_address_t>& listeners) const;
+
+    /**
+     * Given modified cells (targets), get all formula cells that need to be
+     * re-calculated, starting from the cells that reference either the
+     * target cells directly or ranges containing them.  It gives the same
+     * cells as calling both get_all_cell_listeners() and
+     * get_all_range_listeners() for each target cell, but walks the
+     * listeners of all target cells at once, so that each listener cell
+     * only gets visited once.
+     *
+     * With more than one thread, the target cells are divided among the
+     * threads, and each thread walks the listeners of its own target cells
+     * with its own set of visited cells.  A listener cell reachable from
+     * targets of different threads then gets visited once per thread.  No
+     * references may be added or removed during the call.
+     *
+     * @param targets addresses of the modified cells.
+     * @param listeners all formula cells that need to be re-calculated are
+     *                  inserted into this container.
+     * @param thread_count number of threads to walk the listeners with,
+     *                     including the calling thread.  Passing 0 or 1
+     *                     walks them on the calling thread only.
+     */
+    void get_all_listeners(
+        const std::vector<abs_address_t>& targets, dirty_formula_cells_t& listeners,
+        size_t thread_count = 0) const;
+
+    /**
+     * Same as get_all_listeners(), except that the listeners of each target
+     * cell are cached, and the cached listeners are used when the same
+     * target cell gets looked up again.  The cache gets cleared whenever any
+     * reference gets added or removed.  Each cached target holds a copy of
+     * all its listeners, so the cache keeps at most max_targets targets,
+     * and drops the least recently looked up target first.  It's safe to
+     * call this method from multiple threads at once.
+     *
+     * @param targets addresses of the modified cells.
+     * @param listeners all formula cells that need to be re-calculated are
+     *                  inserted into this container.
+     * @param max_targets maximum number of target cells to keep in the
+     *                    cache.
+     */
+    void get_all_cached_listeners(
+        const std::vector<abs_address_t>& targets, dirty_formula_cells_t& listeners,
+        size_t max_targets) const;
+
+    /**
+     * @return number of target cells whose listeners are currently cached.
+     */
+    size_t get_cached_target_count() const;
+
+    /**
+     * Get the approximate amount of memory used to store the listeners and
+     * the references of all cells.  It doesn't include the memory used by
+     * the range lookup, or the overhead of the memory allocator.
+     *
+     * @return memory size in bytes.
+     */
+    size_t get_memory_size() const;
+
     void print_cell_listeners(const abs_address_t& target, const formula_name_resolver& resolver) const;
 };
 
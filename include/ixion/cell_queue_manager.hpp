@@ -9,12 +9,16 @@
 #define __IXION_CELL_QUEUE_MANAGER_HPP__
 
 #include "ixion/global.hpp"
+#include "ixion/address.hpp"
 
+#include <atomic>
 #include <cstdlib>
+#include <memory>
+#include <vector>
 
 namespace ixion {
 
-struct abs_address_t;
+class early_cutoff;
 
 namespace iface {
 
@@ -23,37 +27,157 @@ class formula_model_access;
 }
 
 /**
- * This class manages parallel cell interpretation using threads.  This
- * class should never be instantiated.
+ * Cells to be interpreted, along with the dependency relationships among
+ * them.  Each cell is referred to by its position in the cell array.
+ *
+ * <p>The cells are grouped into dependency levels, where the cells in each
+ * level only depend on the cells in the levels below it.  The cell array
+ * is sorted by level first, then by sheet, column and row.  This order is
+ * therefore both an order of dependency, and an order that only depends on
+ * the cells and their dependency relationships.</p>
  */
-class cell_queue_manager
+struct cell_dependency_graph
 {
+    /** cells sorted by level, then by sheet, column and row. */
+    std::vector<abs_address_t> cells;
+
+    /**
+     * offsets into the cell array where each level starts, plus one extra
+     * entry marking the end.
+     */
+    std::vector<size_t> level_offsets;
+
+    /** number of precedent cells that each cell waits for. */
+    std::vector<size_t> precedent_counts;
+
+    /**
+     * offsets into the dependent position array, one for each cell plus one
+     * extra entry marking the end.
+     */
+    std::vector<size_t> dependent_offsets;
+
+    /** positions of dependent cells, grouped by the cell they depend on. */
+    std::vector<size_t> dependents;
+
+    /**
+     * previous results of the cells by their positions, which the cells
+     * keep when none of their precedent cells has changed.  When NULL, all
+     * cells get interpreted.
+     */
+    early_cutoff* cutoff;
+
+    cell_dependency_graph() : cutoff(nullptr) {}
+};
+
+/**
+ * Progress and cancellation state of a calculation, shared between the
+ * thread that requested the calculation and the threads performing it.
+ */
+struct IXION_DLLPUBLIC calc_status
+{
+    /** total number of cells to calculate. */
+    std::atomic<size_t> cell_count;
+
+    /** number of cells calculated so far. */
+    std::atomic<size_t> calculated_count;
+
+    /**
+     * number of cells that have kept their previous results instead of
+     * being interpreted, as none of their precedent cells has changed.
+     * They are included in calculated_count.
+     */
+    std::atomic<size_t> skipped_count;
+
+    /**
+     * When set to true, the calculation stops before interpreting the next
+     * cell.
+     */
+    std::atomic<bool> cancelled;
+
+    calc_status();
+};
+
+/**
+ * This class manages parallel cell interpretation using a pool of worker
+ * threads.  The worker threads are created when the instance is
+ * constructed, are reused across calculations, and are terminated when the
+ * instance is destroyed.
+ *
+ * <p>How the cells get scheduled depends on the calc mode set in the
+ * model's config.  In the calc_mode_t::dependency_queue mode, a cell only
+ * gets queued once all of its precedent cells have been interpreted, which
+ * ensures that no worker thread ever has to block waiting for the result of
+ * another cell.  Each worker thread keeps its own queue, and steals cells
+ * from other workers when its own queue runs dry.  In the
+ * calc_mode_t::wavefront mode, the cells are calculated one dependency
+ * level at a time, with the worker threads calculating batches of
+ * contiguous cells within each level in parallel.  The
+ * calc_mode_t::deterministic mode works the same way, except that the cells
+ * that may modify the model are interpreted by the calling thread, and the
+ * session events are reported in the order of the cell array, so that the
+ * outcome does not depend on the number of threads.</p>
+ *
+ * <p>When the config enables column locality, the cells near each other in
+ * the same column tend to be calculated by the same worker thread.  The
+ * worker threads may also be pinned to their own CPU cores, which is
+ * decided when the instance is constructed.</p>
+ *
+ * <p>All calculation states are local to each instance, so separate
+ * instances may run calculations on different models at the same
+ * time.</p>
+ */
+class IXION_DLLPUBLIC cell_queue_manager
+{
+    struct impl;
+    std::unique_ptr<impl> mp_impl;
+
+    cell_queue_manager() = delete;
+    cell_queue_manager(const cell_queue_manager&) = delete;
+    cell_queue_manager& operator=(const cell_queue_manager&) = delete;
+
 public:
     /**
-     * Initialize queue manager thread, with specified number of worker
-     * threads.
+     * Constructor.  It spawns the specified number of worker threads, which
+     * stay idle until cells are given to interpret.
      *
-     * @param thread_count desired number of worker threads.
+     * @param thread_count desired number of worker threads.  It must be
+     *                     greater than 0.
+     * @param pin_threads when true, each worker thread gets pinned to its
+     *                    own CPU core, on platforms that support it.  When
+     *                    there are more worker threads than CPU cores, the
+     *                    cores get shared.
      */
-    static void init(size_t thread_count, iface::formula_model_access& context);
+    explicit cell_queue_manager(size_t thread_count, bool pin_threads = false);
 
     /**
-     * Add new cell to queue to interpret.
-     *
-     * @param cell pointer to cell instance to interpret.
+     * Destructor.  It terminates and joins all worker threads.
      */
-    static void add_cell(const abs_address_t& cell);
+    ~cell_queue_manager();
 
     /**
-     * Terminate the queue manager thread, along with all spawned worker
-     * threads.
+     * @return number of worker threads managed by this instance.
      */
-    static void terminate();
+    size_t get_thread_count() const;
 
-private:
-    cell_queue_manager();
-    cell_queue_manager(const cell_queue_manager& r);
-    ~cell_queue_manager();
+    /**
+     * @return true if the worker threads have been requested to be pinned
+     *         to CPU cores, false otherwise.
+     */
+    bool is_pinned() const;
+
+    /**
+     * Interpret all cells in the dependency graph using the worker threads.
+     * This call blocks until all cells have been interpreted.  Calls from
+     * multiple threads are serialized.
+     *
+     * @param context model context.
+     * @param graph cells to interpret and their dependency relationships.
+     * @param status optional progress and cancellation state.  When the
+     *               calculation gets cancelled, the cells not yet
+     *               interpreted by then are left without results.
+     */
+    void run(iface::formula_model_access& context, const cell_dependency_graph& graph,
+             calc_status* status = nullptr);
 };
 
 }
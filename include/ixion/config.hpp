@@ -9,6 +9,7 @@
 #define __IXION_CONFIG_HPP__
 
 #include "ixion/env.hpp"
+#include "ixion/types.hpp"
 
 namespace ixion {
 
@@ -23,6 +24,78 @@ struct IXION_DLLPUBLIC config
      */
     char sep_function_arg;
 
+    /**
+     * Scheduling strategy for threaded calculations.  By default it's
+     * calc_mode_t::dependency_queue.
+     */
+    calc_mode_t calc_mode;
+
+    /**
+     * When true, each calculation worker thread gets pinned to its own CPU
+     * core on platforms that support it.  By default it's false.
+     */
+    bool pin_threads;
+
+    /**
+     * When true, cells that are close to each other in the same column of
+     * the same sheet are preferably calculated by the same worker thread,
+     * so that their storage stays in the cache of the same CPU core.  By
+     * default it's true.
+     */
+    bool column_locality;
+
+    /**
+     * When true, the cells that depend on each modified cell are cached
+     * when they are looked up, and reused by the following lookups until
+     * any formula cell gets registered or unregistered.  This speeds up
+     * repeated modifications of the same cells, at the expense of the
+     * memory used to store the cache.  By default it's false.
+     */
+    bool cache_dirty_cells;
+
+    /**
+     * Maximum number of modified cells whose dependent cells are kept in
+     * the cache when cache_dirty_cells is true.  Each cached cell holds a
+     * copy of all the cells that depend on it, directly or indirectly, so
+     * the cache may take up to this many times the memory of the largest
+     * set of dirty cells.  The least recently looked up cell gets dropped
+     * first.  By default it's 256.
+     */
+    size_t dirty_cell_cache_size;
+
+    /**
+     * When true, circular references are calculated iteratively instead of
+     * being marked as errors.  The cells of each circular reference are
+     * interpreted repeatedly, starting from 0, until no value changes by
+     * more than iteration_epsilon in one iteration, or until max_iterations
+     * iterations have been made.  A cell referencing itself is still an
+     * error.  A calculation involving any circular reference runs on the
+     * calling thread.  By default it's false.
+     */
+    bool iterative_calc;
+
+    /**
+     * Maximum number of iterations for each circular reference in
+     * iterative calculation.  By default it's 100.
+     */
+    size_t max_iterations;
+
+    /**
+     * Largest change of any value in one iteration at which a circular
+     * reference is considered converged in iterative calculation.  By
+     * default it's 0.001.
+     */
+    double iteration_epsilon;
+
+    /**
+     * When true, dirty cells marked with mark_cells_dirty() are calculated
+     * on demand, when their values are read through
+     * model_context::get_numeric_value() or formula_cell::get_value().
+     * Only the cell being read and the dirty cells it depends on get
+     * calculated.  By default it's false.
+     */
+    bool lazy_calc;
+
     config();
     config(const config& r);
 };
@@ -8,17 +8,28 @@
 #ifndef INCLUDED_IXION_DEPTH_FIRST_SEARCH_HPP
 #define INCLUDED_IXION_DEPTH_FIRST_SEARCH_HPP
 
-#include "ixion/exceptions.hpp"
-
+#include <algorithm>
+#include <cstdlib>
+#include <utility>
 #include <vector>
-#include <set>
-#include <map>
-#include <exception>
-#include <iostream>
 #include <unordered_map>
 
 namespace ixion {
 
+/**
+ * Topological sort of cells based on their dependency relationships.  The
+ * cells are given dense integer ids in the order they are passed in, and
+ * the dependency relationships are stored in a compressed sparse row (CSR)
+ * layout, where the precedent cells of each cell are stored contiguously in
+ * a single array.  The graph is traversed using an explicit stack, so an
+ * arbitrarily long chain of dependencies does not overflow the call stack.
+ *
+ * <p>Each cell is passed to the cell handler after all of its precedent
+ * cells have been passed, except for those that are part of a circular
+ * dependency.  The circular dependencies are found by the same traversal,
+ * as the strongly connected components of the graph, so the sort runs in
+ * time linear in the number of cells and dependency relationships.</p>
+ */
 template<typename _ValueType, typename _CellHandlerType, typename _ValueHashType>
 class depth_first_search
 {
@@ -30,179 +41,258 @@ public:
 private:
     typedef std::unordered_map<value_type, size_t, value_hash_type> cell_index_map_type;
 
-    enum cell_color_type { white, gray, black };
-
-    class dfs_error : public general_error
-    {
-    public:
-        dfs_error(const std::string& msg) : general_error(msg) {}
-    };
-
-    struct node_data
-    {
-        cell_color_type color;
-        value_type      node;
-        size_t          time_visited;
-        size_t          time_finished;
-
-        node_data() : color(white), time_visited(0), time_finished(0) {}
-    };
-
 public:
-    typedef std::set<value_type> precedent_cells_type;
-    typedef std::map<value_type, precedent_cells_type> precedent_map_type;
-
+    /**
+     * Collection of dependency relationships, stored as a flat array of
+     * pairs of a cell and one of its precedent cells.  Duplicate pairs are
+     * allowed.
+     */
     class precedent_set
     {
     public:
+        typedef std::pair<value_type, value_type> edge_type;
+        typedef std::vector<edge_type> edges_type;
+
         void insert(value_type cell, value_type dep)
         {
-            typename precedent_map_type::iterator itr = m_map.find(cell);
-            if (itr == m_map.end())
-            {
-                // First dependent for this cell.
-                std::pair<typename precedent_map_type::iterator, bool> r =
-                    m_map.insert(
-                        typename precedent_map_type::value_type(cell, precedent_cells_type()));
-
-                if (!r.second)
-                    throw dfs_error("failed to insert a new set instance");
-
-                itr = r.first;
-            }
-
-            itr->second.insert(dep);
+            m_edges.push_back(edge_type(cell, dep));
         }
 
-        const precedent_map_type& get() const { return m_map; }
+        const edges_type& get() const { return m_edges; }
 
     private:
-        precedent_map_type m_map;
+        edges_type m_edges;
     };
 
+    /**
+     * Constructor.  It builds the dependency graph of the cells.
+     * Dependency relationships involving cells not in the cell list are
+     * ignored.
+     *
+     * @param cells all cells to sort.  They must be unique.
+     * @param precedents dependency relationships among the cells.
+     * @param handler handler to receive the cells in sorted order.
+     */
     depth_first_search(
         const ::std::vector<value_type>& cells,
-        const precedent_map_type& precedent_map, cell_handler_type& handler);
+        const precedent_set& precedents, cell_handler_type& handler);
 
-    void init();
+    /**
+     * Sort the cells, and pass them to the cell handler in sorted order.
+     */
     void run();
 
-private:
-    void visit(size_t cell_index);
-    size_t get_cell_index(value_type p) const;
-    const precedent_cells_type* get_precedent_cells(value_type cell);
+    /**
+     * @return number of cells.
+     */
+    size_t size() const { return m_cells.size(); }
+
+    /**
+     * @return cell associated with an id.
+     */
+    const value_type& get_cell(size_t index) const { return m_cells[index]; }
+
+    /**
+     * @return ids of the cells in sorted order.  It's only available after
+     *         {@link run} is called.
+     */
+    const ::std::vector<size_t>& get_sorted_indices() const { return m_sorted; }
+
+    /**
+     * @return true if the cell associated with an id is part of a circular
+     *         dependency, either with other cells or with itself.  It's only
+     *         available after {@link run} is called.
+     */
+    bool is_circular(size_t index) const { return m_circular[index]; }
+
+    /**
+     * @return id of the strongly connected component that the cell
+     *         associated with an id belongs to.  The cells of each component
+     *         are contiguous in the sorted order.  It's only available after
+     *         {@link run} is called.
+     */
+    size_t get_component(size_t index) const { return m_components[index]; }
+
+    /**
+     * @return offsets into the precedent id array for each cell id, plus
+     *         one extra entry marking the end.
+     */
+    const ::std::vector<size_t>& get_precedent_offsets() const { return m_precedent_offsets; }
+
+    /**
+     * @return ids of the precedent cells, grouped by the cell that depends
+     *         on them.  Each group contains no duplicates.
+     */
+    const ::std::vector<size_t>& get_precedents() const { return m_precedents; }
 
 private:
-    const precedent_map_type&  m_precedent_map;
     cell_handler_type&      m_handler;
-    size_t                  m_cell_count;
-    cell_index_map_type     m_cell_indices;
-
-    size_t                  m_time_stamp;
-    ::std::vector<node_data> m_cells;
+    ::std::vector<value_type> m_cells;
+    ::std::vector<size_t>   m_precedent_offsets;
+    ::std::vector<size_t>   m_precedents;
+    ::std::vector<size_t>   m_sorted;
+    ::std::vector<bool>     m_circular;
+    ::std::vector<size_t>   m_components;
 };
 
 template<typename _ValueType, typename _CellHandlerType, typename _ValueHashType>
 depth_first_search<_ValueType,_CellHandlerType,_ValueHashType>::depth_first_search(
     const ::std::vector<value_type>& cells,
-    const precedent_map_type& precedent_map, cell_handler_type& handler) :
-    m_precedent_map(precedent_map),
+    const precedent_set& precedents, cell_handler_type& handler) :
     m_handler(handler),
-    m_cell_count(cells.size()),
-    m_time_stamp(0),
-    m_cells(m_cell_count)
+    m_cells(cells),
+    m_precedent_offsets(cells.size()+1, 0)
 {
-    typename ::std::vector<value_type>::const_iterator
-        itr = cells.begin(), itr_end = cells.end();
+    size_t n = m_cells.size();
 
     // Construct cell node to index mapping.
-    for (size_t index = 0; itr != itr_end; ++itr, ++index)
-        m_cell_indices.insert(
-            typename cell_index_map_type::value_type(*itr, index));
-}
-
-template<typename _ValueType, typename _CellHandlerType, typename _ValueHashType>
-void depth_first_search<_ValueType,_CellHandlerType,_ValueHashType>::init()
-{
-    ::std::vector<node_data> cells(m_cell_count);
-    typename cell_index_map_type::const_iterator
-        itr = m_cell_indices.begin(), itr_end = m_cell_indices.end();
-
-    // Now, construct index to cell node mapping.
-    for (; itr != itr_end; ++itr)
-        cells[itr->second].node = itr->first;
-    m_cells.swap(cells);
-    m_time_stamp = 0;
-}
-
-template<typename _ValueType, typename _CellHandlerType, typename _ValueHashType>
-void depth_first_search<_ValueType,_CellHandlerType,_ValueHashType>::run()
-{
-    init();
-    try
+    cell_index_map_type cell_indices;
+    cell_indices.reserve(n);
+    for (size_t index = 0; index < n; ++index)
+        cell_indices.insert(typename cell_index_map_type::value_type(m_cells[index], index));
+
+    // Convert the dependency relationships into pairs of ids, and count the
+    // precedents of each cell.
+    const typename precedent_set::edges_type& edges = precedents.get();
+    ::std::vector<std::pair<size_t, size_t>> id_edges;
+    id_edges.reserve(edges.size());
+    typename precedent_set::edges_type::const_iterator it = edges.begin(), it_end = edges.end();
+    for (; it != it_end; ++it)
     {
-        for (size_t i = 0; i < m_cell_count; ++i)
-            if (m_cells[i].color == white)
-                visit(i);
+        typename cell_index_map_type::const_iterator it_cell = cell_indices.find(it->first);
+        typename cell_index_map_type::const_iterator it_dep = cell_indices.find(it->second);
+        if (it_cell == cell_indices.end() || it_dep == cell_indices.end())
+            continue;
+
+        id_edges.push_back(std::pair<size_t, size_t>(it_cell->second, it_dep->second));
+        ++m_precedent_offsets[it_cell->second+1];
     }
-    catch(const dfs_error& e)
+
+    for (size_t i = 0; i < n; ++i)
+        m_precedent_offsets[i+1] += m_precedent_offsets[i];
+
+    m_precedents.resize(id_edges.size());
+    ::std::vector<size_t> filled(m_precedent_offsets.begin(), m_precedent_offsets.end()-1);
+    for (size_t i = 0, ie = id_edges.size(); i < ie; ++i)
+        m_precedents[filled[id_edges[i].first]++] = id_edges[i].second;
+
+    // Remove duplicate precedents within each cell, by marking each
+    // precedent with the last cell that has it.
+    ::std::vector<size_t>& last_cell = filled;
+    ::std::fill(last_cell.begin(), last_cell.end(), n);
+    size_t write_pos = 0;
+    for (size_t i = 0; i < n; ++i)
     {
-        using namespace std;
-        cout << "dfs error: " << e.what() << endl;
+        size_t begin = m_precedent_offsets[i], end = m_precedent_offsets[i+1];
+        m_precedent_offsets[i] = write_pos;
+        for (size_t j = begin; j < end; ++j)
+        {
+            size_t dep = m_precedents[j];
+            if (last_cell[dep] == i)
+                continue;
+
+            last_cell[dep] = i;
+            m_precedents[write_pos++] = dep;
+        }
     }
+    m_precedent_offsets[n] = write_pos;
+    m_precedents.resize(write_pos);
 }
 
 template<typename _ValueType, typename _CellHandlerType, typename _ValueHashType>
-void depth_first_search<_ValueType,_CellHandlerType,_ValueHashType>::visit(size_t cell_index)
+void depth_first_search<_ValueType,_CellHandlerType,_ValueHashType>::run()
 {
-    value_type p = m_cells[cell_index].node;
-    m_cells[cell_index].color = gray;
-    m_cells[cell_index].time_visited = ++m_time_stamp;
-
-    do
+    // Tarjan's strongly connected components algorithm.  Each component is
+    // complete once its first visited cell (the root) has all its
+    // precedents visited, at which point all precedent components have
+    // been completed already.
+    const size_t unvisited = static_cast<size_t>(-1);
+    size_t n = m_cells.size();
+    ::std::vector<size_t> indices(n, unvisited);
+    ::std::vector<size_t> lowlinks(n, 0);
+    ::std::vector<bool> on_stack(n, false);
+    m_circular.assign(n, false);
+    m_components.assign(n, 0);
+    m_sorted.clear();
+    m_sorted.reserve(n);
+
+    // Cells visited but whose component is not complete yet.
+    ::std::vector<size_t> component;
+
+    // Each stack entry stores a cell id and the position of its next
+    // precedent to visit.
+    ::std::vector<std::pair<size_t, size_t>> stack;
+    size_t next_index = 0;
+    size_t component_count = 0;
+
+    for (size_t i = 0; i < n; ++i)
     {
-        const precedent_cells_type* depends = get_precedent_cells(p);
-        if (!depends)
-            // No dependent cells.
-            break;
-
-        typename precedent_cells_type::const_iterator itr = depends->begin(), itr_end = depends->end();
-        for (; itr != itr_end; ++itr)
+        if (indices[i] != unvisited)
+            continue;
+
+        indices[i] = lowlinks[i] = next_index++;
+        component.push_back(i);
+        on_stack[i] = true;
+        stack.push_back(std::pair<size_t, size_t>(i, m_precedent_offsets[i]));
+        while (!stack.empty())
         {
-            value_type dcell = *itr;
-            size_t dcell_id = get_cell_index(dcell);
-            if (m_cells[dcell_id].color == white)
+            size_t cell = stack.back().first;
+            size_t pos = stack.back().second;
+            if (pos < m_precedent_offsets[cell+1])
             {
-                visit(dcell_id);
+                size_t dep = m_precedents[pos];
+                ++stack.back().second;
+                if (indices[dep] == unvisited)
+                {
+                    indices[dep] = lowlinks[dep] = next_index++;
+                    component.push_back(dep);
+                    on_stack[dep] = true;
+                    stack.push_back(std::pair<size_t, size_t>(dep, m_precedent_offsets[dep]));
+                }
+                else if (on_stack[dep])
+                {
+                    lowlinks[cell] = std::min(lowlinks[cell], indices[dep]);
+                    if (dep == cell)
+                        // The cell references itself.
+                        m_circular[cell] = true;
+                }
+                continue;
             }
-        }
-    }
-    while (false);
 
-    m_cells[cell_index].color = black;
-    m_cells[cell_index].time_finished = ++m_time_stamp;
-    m_handler(m_cells[cell_index].node);
-}
+            // All precedents of this cell have been visited.
+            stack.pop_back();
+            if (!stack.empty())
+            {
+                size_t parent = stack.back().first;
+                lowlinks[parent] = std::min(lowlinks[parent], lowlinks[cell]);
+            }
 
-template<typename _ValueType, typename _CellHandlerType, typename _ValueHashType>
-size_t depth_first_search<_ValueType,_CellHandlerType,_ValueHashType>::get_cell_index(value_type p) const
-{
-    typename cell_index_map_type::const_iterator itr = m_cell_indices.find(p);
-    if (itr == m_cell_indices.end())
-        throw dfs_error("cell ptr to index mapping failed.");
-    return itr->second;
-}
+            if (lowlinks[cell] != indices[cell])
+                // Not the root of its component.
+                continue;
 
-template<typename _ValueType, typename _CellHandlerType, typename _ValueHashType>
-const typename depth_first_search<_ValueType,_CellHandlerType,_ValueHashType>::precedent_cells_type*
-depth_first_search<_ValueType,_CellHandlerType,_ValueHashType>::get_precedent_cells(value_type cell)
-{
-    typename precedent_map_type::const_iterator itr = m_precedent_map.find(cell);
-    if (itr == m_precedent_map.end())
-        // This cell has no dependent cells.
-        return NULL;
+            // Pass all cells of the completed component to the handler.  A
+            // component of more than one cell is a circular dependency.
+            bool circular = component.back() != cell;
+            size_t member;
+            do
+            {
+                member = component.back();
+                component.pop_back();
+                on_stack[member] = false;
+                if (circular)
+                    m_circular[member] = true;
+
+                m_components[member] = component_count;
+
+                m_sorted.push_back(member);
+                m_handler(m_cells[member]);
+            }
+            while (member != cell);
 
-    return &itr->second;
+            ++component_count;
+        }
+    }
 }
 
 }
@@ -8,11 +8,14 @@
 #ifndef __IXION_FORMULA_HPP__
 #define __IXION_FORMULA_HPP__
 
+#include "ixion/address_set.hpp"
 #include "ixion/formula_tokens.hpp"
 #include "ixion/interface/formula_model_access.hpp"
 #include "ixion/env.hpp"
 
+#include <memory>
 #include <string>
+#include <vector>
 
 namespace ixion {
 
@@ -48,7 +51,10 @@ void IXION_DLLPUBLIC print_formula_tokens(
     std::string& str);
 
 /**
- * Regisiter a formula cell with cell dependency tracker.
+ * Regisiter a formula cell with cell dependency tracker.  The tracker keeps
+ * the references of the cell until it gets unregistered, so that the
+ * calculations don't have to collect them from the formula tokens again.
+ * The cell must therefore get unregistered before its formula changes.
  *
  * @param cxt model context.
  * @param pos address of the cell being registered.
@@ -56,6 +62,29 @@ void IXION_DLLPUBLIC print_formula_tokens(
 void IXION_DLLPUBLIC register_formula_cell(
     iface::formula_model_access& cxt, const abs_address_t& pos);
 
+/**
+ * Register many formula cells with cell dependency tracker at once.  This
+ * has the same effect as registering each cell individually, but it groups
+ * the references of all the cells before storing them, which is faster
+ * when registering a large number of cells.  Positions that don't store
+ * formula cells are skipped.
+ *
+ * @param cxt model context.
+ * @param cells addresses of the cells being registered.
+ */
+void IXION_DLLPUBLIC register_formula_cells(
+    iface::formula_model_access& cxt, const std::vector<abs_address_t>& cells);
+
+/**
+ * Register all formula cells in a range with cell dependency tracker at
+ * once.
+ *
+ * @param cxt model context.
+ * @param range range containing the cells being registered.
+ */
+void IXION_DLLPUBLIC register_formula_cells(
+    iface::formula_model_access& cxt, const abs_range_t& range);
+
 /**
  * Unregister a formula cell with cell dependency tracker if a formula cell
  * exists at specified cell address.  If there is no existing cell at the
@@ -68,9 +97,32 @@ void IXION_DLLPUBLIC register_formula_cell(
 void IXION_DLLPUBLIC unregister_formula_cell(
     iface::formula_model_access& cxt, const abs_address_t& pos);
 
+/**
+ * Start a new calculation epoch of the model, taking the current time as
+ * the time returned by all volatile functions until the next epoch starts.
+ * The volatile cells become dirty again at the first lookup of dirty cells
+ * in the new epoch.  It does nothing if the model doesn't keep an epoch.
+ *
+ * <p>Each calculation of dirty cells starts a new epoch by itself, unless
+ * it follows a start of an epoch or a lookup of dirty cells, in which case
+ * it stays in the epoch of those.</p>
+ *
+ * @param cxt model context.
+ */
+void IXION_DLLPUBLIC start_calc_epoch(iface::formula_model_access& cxt);
+
 /**
  * Get all cells that directly or indirectly depend on known modified cells.
- * We call such cells "dirty cells".
+ * We call such cells "dirty cells".  When the cache_dirty_cells parameter
+ * of the model's config is set, the dirty cells of each modified cell are
+ * cached until any formula cell gets registered or unregistered.
+ *
+ * <p>By default, each lookup starts a new calculation epoch, and all
+ * volatile cells are dirty along with the cells depending on them.  When
+ * skip_volatile is true, the lookup stays in the current epoch, and the
+ * volatile cells are only dirty if they haven't been dirty in it yet, or
+ * if they depend on the modified cells.  This keeps the cells depending on
+ * the volatile cells out of partial recalculations.</p>
  *
  * @param cxt model context
  * @param addrs list of addresses of cells that have been modified.  Note
@@ -78,9 +130,17 @@ void IXION_DLLPUBLIC unregister_formula_cell(
  *              presence of volatile cells.
  * @param cells all dirty cells are inserted into this container when this
  *              function returns.
+ * @param thread_count number of threads to look up the dirty cells with,
+ *                     including the calling thread.  Passing 0 or 1 looks
+ *                     them up on the calling thread only.  The cached
+ *                     lookup always runs on the calling thread.
+ * @param skip_volatile when true, stay in the current calculation epoch,
+ *                      and leave out the volatile cells already dirty in
+ *                      it.
  */
 void IXION_DLLPUBLIC get_all_dirty_cells(
-    iface::formula_model_access& cxt, modified_cells_t& addrs, dirty_formula_cells_t& cells);
+    iface::formula_model_access& cxt, modified_cells_t& addrs, dirty_formula_cells_t& cells,
+    size_t thread_count = 0, bool skip_volatile = false);
 
 /**
  * Calculate all dirty cells in order of dependency.
@@ -91,12 +151,159 @@ void IXION_DLLPUBLIC get_all_dirty_cells(
  *                     passing 0 will make the process use the main thread
  *                     only, while passing any number greater than 0 will
  *                     make the process spawn specified number of
- *                     calculation threads plus one additional thread to
- *                     manage the calculation threads.
+ *                     calculation threads while the main thread waits for
+ *                     them to finish.  When the model context provides its
+ *                     own cell queue manager, its worker threads are
+ *                     reused across calls.
  */
 void IXION_DLLPUBLIC calculate_cells(
     iface::formula_model_access& cxt, dirty_formula_cells_t& cells, size_t thread_count);
 
+/**
+ * Calculate all dirty cells in order of dependency, like the above, except
+ * that each dirty cell keeps its previous result instead of getting
+ * interpreted when none of the cells it references has changed.  A dirty
+ * cell always gets interpreted when it has no previous result, when it
+ * references any of the modified cells, or when it references another
+ * dirty cell whose result has come out different from its previous one.
+ *
+ * @param cxt model context.
+ * @param modified_cells cells modified since the last calculation, as
+ *                       passed to get_all_dirty_cells().
+ * @param cells all dirty cells to be calculated.
+ * @param thread_count number of calculation threads to use.
+ *
+ * @return number of dirty cells that have kept their previous results.
+ */
+size_t IXION_DLLPUBLIC calculate_cells(
+    iface::formula_model_access& cxt, const modified_cells_t& modified_cells,
+    dirty_formula_cells_t& cells, size_t thread_count);
+
+/**
+ * Mark dirty cells for lazy calculation instead of calculating them.  Their
+ * results get discarded, and each of them gets calculated on demand the
+ * first time its value is read, along with only those dirty cells that it
+ * depends on.  This requires the lazy_calc parameter of the model's config
+ * to be set.
+ *
+ * @param cxt model context.  It must provide the set of pending cells via
+ *            get_pending_cells(), and the mutex guarding them via
+ *            get_lazy_calc_mutex().
+ * @param cells all dirty cells, as returned from get_all_dirty_cells().
+ */
+void IXION_DLLPUBLIC mark_cells_dirty(
+    iface::formula_model_access& cxt, const dirty_formula_cells_t& cells);
+
+/**
+ * Calculate a cell marked for lazy calculation, along with all cells marked
+ * for lazy calculation that it depends on either directly or indirectly,
+ * on the calling thread.  It does nothing if the cell is not pending
+ * calculation.  Lazy calculations of each model are serialized through
+ * its lazy calculation mutex, so that a thread reading a cell being
+ * calculated by another thread waits for its result.
+ *
+ * @param cxt model context.
+ * @param pos address of the cell to calculate.
+ *
+ * @return number of cells calculated.
+ */
+size_t IXION_DLLPUBLIC calculate_cell(iface::formula_model_access& cxt, const abs_address_t& pos);
+
+/**
+ * Handle to a calculation running in the background, returned from
+ * {@link calculate_cells_async}.  It allows the caller to monitor the
+ * progress of the calculation, and to cancel it.
+ *
+ * <p>When the calculation gets cancelled, the cells that have not been
+ * interpreted by then are left without cached results, just like freshly
+ * reset dirty cells.  They can be retrieved via {@link get_pending_cells}
+ * and passed to another calculation to complete them.  Their values must
+ * not be queried until then.</p>
+ */
+class IXION_DLLPUBLIC calc_handle
+{
+    struct impl;
+    std::unique_ptr<impl> mp_impl;
+
+    calc_handle() = delete;
+    calc_handle(const calc_handle&) = delete;
+    calc_handle& operator=(const calc_handle&) = delete;
+
+public:
+    /**
+     * Constructor.  It starts calculating the cells in a new thread, and
+     * returns immediately.
+     *
+     * @param cxt model context.
+     * @param cells all dirty cells to be calculated.  The handle keeps its
+     *              own copy of them.
+     * @param thread_count number of calculation threads to use, in addition
+     *                     to the thread that runs the calculation.
+     */
+    calc_handle(iface::formula_model_access& cxt, const dirty_formula_cells_t& cells, size_t thread_count);
+
+    /**
+     * Destructor.  It waits for the calculation to finish, or to stop if
+     * it's been cancelled.
+     */
+    ~calc_handle();
+
+    /**
+     * Block until the calculation finishes.  If the calculation ended with
+     * an exception, it gets rethrown from this call.
+     */
+    void wait();
+
+    /**
+     * @return true if the calculation has finished, either by completion or
+     *         by cancellation, false otherwise.
+     */
+    bool is_done() const;
+
+    /**
+     * @return percentage of cells that have been calculated so far, ranging
+     *         from 0 to 100.
+     */
+    double get_progress() const;
+
+    /**
+     * Request cancellation of the calculation.  The calculation threads stop
+     * before interpreting their next cells.  Call {@link wait} to wait for
+     * them to stop.
+     */
+    void cancel();
+
+    /**
+     * @return true if cancellation has been requested, false otherwise.
+     */
+    bool is_cancelled() const;
+
+    /**
+     * Get all cells that have not been calculated.  This call waits for the
+     * calculation to finish first.  The returned set is empty unless the
+     * calculation has been cancelled.
+     *
+     * @param cells all cells that have not been calculated are inserted
+     *              into this container.
+     */
+    void get_pending_cells(dirty_formula_cells_t& cells);
+};
+
+/**
+ * Calculate all dirty cells in a background thread, and return immediately.
+ * The model must not be modified until the calculation finishes.
+ *
+ * @param cxt model context.
+ * @param cells all dirty cells to be calculated.
+ * @param thread_count number of calculation threads to use.  Passing 0 will
+ *                     make the background thread perform all the
+ *                     calculations by itself.
+ *
+ * @return handle to the calculation running in the background.
+ */
+std::unique_ptr<calc_handle> IXION_DLLPUBLIC calculate_cells_async(
+    iface::formula_model_access& cxt, const dirty_formula_cells_t& cells, size_t thread_count);
+
 }
 
 #endif
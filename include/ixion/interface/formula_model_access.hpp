@@ -14,13 +14,24 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+
+namespace boost {
+
+class recursive_mutex;
+
+}
 
 namespace ixion {
 
+class abs_address_set;
 class formula_cell;
 class formula_name_resolver;
 class cell_listener_tracker;
+class cell_queue_manager;
+class dependency_graph;
 class matrix;
+struct calc_epoch;
 struct abs_address_t;
 struct abs_range_t;
 struct config;
@@ -55,7 +66,9 @@ public:
      * Get a numeric representation of the cell value at specified position.
      * If the cell at the specified position is a formula cell and its result
      * has not yet been computed, it will block until the result becomes
-     * available.  Call this only during formula (re-)calculation.
+     * available.  Call this only during formula (re-)calculation, or in
+     * lazy calculation, in which case a formula cell marked dirty gets
+     * calculated first.
      *
      * @param addr position of the cell.
      *
@@ -109,6 +122,70 @@ public:
 
     virtual const table_handler* get_table_handler() const;
 
+    /**
+     * Cell queue manager owns the worker threads used for threaded
+     * calculations.  A model implementation may keep one instance alive
+     * across calculations to avoid spawning new threads for each
+     * calculation.  This is optional.  The model shares the ownership with
+     * the calculation, so that the worker threads stay alive until the
+     * calculation finishes.
+     *
+     * @param thread_count number of worker threads requested for the
+     *                     calculation.
+     *
+     * @return cell queue manager owned by the model with the requested
+     *         number of worker threads, or an empty pointer if the model
+     *         doesn't provide one, in which case a temporary instance gets
+     *         created for the calculation.
+     */
+    virtual std::shared_ptr<cell_queue_manager> get_cell_queue_manager(size_t thread_count);
+
+    /**
+     * Dirty cells marked for lazy calculation are kept in this set until
+     * they get calculated on demand.  This is optional; lazy calculation is
+     * not available when the model doesn't provide the set.
+     *
+     * @return non-NULL pointer to the set of dirty cells pending lazy
+     *         calculation, or NULL if the model doesn't support lazy
+     *         calculation.
+     */
+    virtual abs_address_set* get_pending_cells();
+
+    /**
+     * Lazy calculations of the model are serialized by this mutex, which
+     * guards the set of pending cells.  It must be provided along with the
+     * set of pending cells; lazy calculation is not available otherwise.
+     * Each model has its own, so that lazy calculations of independent
+     * models can run concurrently.
+     *
+     * @return non-NULL pointer to the mutex guarding lazy calculations, or
+     *         NULL if the model doesn't support lazy calculation.
+     */
+    virtual boost::recursive_mutex* get_lazy_calc_mutex();
+
+    /**
+     * Calculation epoch determines the time seen by the volatile functions,
+     * and whether the volatile cells need to be calculated again.  This is
+     * optional; volatile functions read the current time when the model
+     * doesn't provide an epoch.
+     *
+     * @return non-NULL pointer to the calculation epoch of the model, or
+     *         NULL if the model doesn't keep one.
+     */
+    virtual calc_epoch* get_calc_epoch();
+
+    /**
+     * Dependency graph of all registered formula cells, kept up to date as
+     * the cells get registered and unregistered, so that calculations take
+     * the dirty cells in the order kept there rather than sorting them each
+     * time.  This is optional; the dirty cells get sorted on each
+     * calculation when the model doesn't keep a graph.
+     *
+     * @return non-NULL pointer to the dependency graph of the model, or
+     *         NULL if the model doesn't keep one.
+     */
+    virtual dependency_graph* get_dependency_graph();
+
     virtual const formula_tokens_t* get_formula_tokens(sheet_t sheet, size_t identifier) const = 0;
     virtual const formula_tokens_t* get_shared_formula_tokens(sheet_t sheet, size_t identifier) const = 0;
     virtual abs_range_t get_shared_formula_range(sheet_t sheet, size_t identifier) const = 0;
@@ -8,6 +8,7 @@
 #ifndef __IXION_MODEL_CONTEXT_HPP__
 #define __IXION_MODEL_CONTEXT_HPP__
 
+#include "ixion/address_set.hpp"
 #include "ixion/column_store_type.hpp"
 #include "ixion/mem_str_buf.hpp"
 #include "ixion/interface/formula_model_access.hpp"
@@ -68,6 +69,63 @@ public:
     virtual iface::session_handler* get_session_handler();
     virtual iface::table_handler* get_table_handler();
     virtual const iface::table_handler* get_table_handler() const;
+
+    /**
+     * The worker threads set up via set_thread_pool_size() are used for
+     * threaded calculations requesting the same number of threads.  This
+     * call doesn't create or destroy any threads.
+     *
+     * @param thread_count number of worker threads.
+     *
+     * @return cell queue manager owned by this model context, or an empty
+     *         pointer if the model doesn't keep worker threads of the
+     *         requested number, or with the pinning requested by the
+     *         current config.
+     */
+    virtual std::shared_ptr<cell_queue_manager> get_cell_queue_manager(size_t thread_count);
+
+    /**
+     * Set the number of worker threads that the model context keeps alive
+     * between threaded calculations.  The worker threads get re-created
+     * only when the number of threads or the pin_threads parameter of the
+     * config has changed since they were created.  Threaded calculations
+     * requesting a different number of threads use their own temporary
+     * worker threads instead.
+     *
+     * @param thread_count number of worker threads to keep.  Passing 0 shuts
+     *                     down the worker threads, same as
+     *                     shutdown_thread_pool().
+     */
+    void set_thread_pool_size(size_t thread_count);
+
+    /**
+     * Shut down the worker threads kept by this model context.  A
+     * calculation still running on them keeps them alive until it
+     * finishes.  The worker threads are also shut down when the model
+     * context is destroyed.
+     */
+    void shutdown_thread_pool();
+
+    /**
+     * @return set of dirty cells pending lazy calculation.
+     */
+    virtual abs_address_set* get_pending_cells();
+
+    /**
+     * @return mutex guarding lazy calculations of this model.
+     */
+    virtual boost::recursive_mutex* get_lazy_calc_mutex();
+
+    /**
+     * @return calculation epoch of this model.
+     */
+    virtual calc_epoch* get_calc_epoch();
+
+    /**
+     * @return dependency graph of all registered formula cells of this
+     *         model.
+     */
+    virtual dependency_graph* get_dependency_graph();
     virtual const formula_tokens_t* get_formula_tokens(sheet_t sheet, size_t identifier) const;
     virtual const formula_tokens_t* get_shared_formula_tokens(sheet_t sheet, size_t identifier) const;
     virtual abs_range_t get_shared_formula_range(sheet_t sheet, size_t identifier) const;
@@ -137,6 +195,13 @@ public:
 
     void set_table_handler(iface::table_handler* handler);
 
+    /**
+     * Replace the current configuration of the model context.
+     *
+     * @param cfg new configuration.
+     */
+    void set_config(const config& cfg);
+
     size_t get_string_count() const;
 
     void dump_strings() const;
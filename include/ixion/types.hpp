@@ -78,6 +78,62 @@ enum class formula_name_resolver_t
     odff       = 4
 };
 
+/**
+ * Scheduling strategy used for threaded cell calculations.
+ */
+enum class calc_mode_t
+{
+    /**
+     * Each cell gets queued as soon as all of its precedent cells have been
+     * interpreted, and the worker threads pick cells from the queues.
+     */
+    dependency_queue = 0,
+
+    /**
+     * Cells are grouped into dependency levels where each level only depends
+     * on the levels below it.  The levels are calculated one at a time, and
+     * the cells in each level are split into batches of contiguous cells
+     * which the worker threads calculate in parallel.
+     */
+    wavefront = 1,
+
+    /**
+     * Same as the wavefront mode, except that the outcome of a calculation
+     * never depends on the number of threads.  The cells are interpreted in
+     * a canonical order determined solely by their addresses and dependency
+     * relationships, the cells that may modify the model (e.g. by adding
+     * new strings) are interpreted one at a time in that order, and all
+     * session events are reported in that order.
+     */
+    deterministic = 2
+};
+
+/**
+ * Calculation epoch of a model.  All volatile functions interpreted within
+ * the same epoch see the same time, which is taken when the epoch starts,
+ * and the volatile cells only need to be calculated once in each epoch.
+ */
+struct IXION_DLLPUBLIC calc_epoch
+{
+    /** sequence number of the epoch, which stays 0 until the first epoch. */
+    size_t id;
+
+    /** time at which the epoch started, in seconds since epoch. */
+    double timestamp;
+
+    /** sequence number of the last epoch that the volatile cells got dirty in. */
+    size_t volatile_id;
+
+    /**
+     * whether the next calculation stays in this epoch.  It gets set when the
+     * epoch starts and by each lookup of dirty cells, and cleared by the
+     * calculation.  Otherwise each calculation starts a new epoch.
+     */
+    bool keep;
+
+    calc_epoch();
+};
+
 }
 
 #endif
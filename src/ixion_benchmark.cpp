@@ -0,0 +1,513 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "ixion/address.hpp"
+#include "ixion/cell_listener_tracker.hpp"
+#include "ixion/config.hpp"
+#include "ixion/formula.hpp"
+#include "ixion/formula_name_resolver.hpp"
+#include "ixion/global.hpp"
+#include "ixion/macros.hpp"
+#include "ixion/model_context.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/program_options.hpp>
+
+using namespace std;
+using namespace ixion;
+
+namespace {
+
+struct benchmark_params
+{
+    size_t sheet_count;
+    size_t row_count;
+    size_t column_count;
+    size_t recalc_count;
+    config cfg;
+};
+
+/**
+ * Parse a comma-separated list of thread counts.
+ */
+bool parse_thread_counts(const string& s, vector<size_t>& thread_counts)
+{
+    istringstream is(s);
+    string token;
+    while (getline(is, token, ','))
+    {
+        char* end = nullptr;
+        unsigned long n = strtoul(token.c_str(), &end, 10);
+        if (token.empty() || *end)
+            return false;
+        thread_counts.push_back(n);
+    }
+    return !thread_counts.empty();
+}
+
+/**
+ * Build a model where column A of each sheet stores values, and each cell
+ * in the other columns references the cells to its left and above-left.
+ * Each formula column therefore forms one dependency level.
+ */
+void build_model(model_context& cxt, const benchmark_params& params)
+{
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+
+    for (size_t i = 0; i < params.sheet_count; ++i)
+    {
+        ostringstream os;
+        os << "Sheet" << i + 1;
+        string name = os.str();
+        cxt.append_sheet(name.data(), name.size(), params.row_count, params.column_count + 1);
+    }
+
+    for (sheet_t sheet = 0; sheet < sheet_t(params.sheet_count); ++sheet)
+    {
+        for (row_t row = 0; row < row_t(params.row_count); ++row)
+            cxt.set_numeric_cell(abs_address_t(sheet,row,0), row);
+
+        for (col_t col = 1; col <= col_t(params.column_count); ++col)
+        {
+            for (row_t row = 0; row < row_t(params.row_count); ++row)
+            {
+                abs_address_t pos(sheet, row, col);
+                address_t left(0, 0, -1, false, false, false);
+
+                ostringstream os;
+                os << resolver->get_name(left, pos, false);
+                if (row > 0)
+                {
+                    address_t above_left(0, -1, -1, false, false, false);
+                    os << '+' << resolver->get_name(above_left, pos, false);
+                }
+                else
+                    os << "*2";
+
+                string formula = os.str();
+                cxt.set_formula_cell(pos, formula.data(), formula.size(), *resolver);
+            }
+        }
+
+        abs_range_t range;
+        range.first = abs_address_t(sheet, 0, 1);
+        range.last = abs_address_t(sheet, params.row_count-1, params.column_count);
+        register_formula_cells(cxt, range);
+    }
+}
+
+/**
+ * Build a model where column A of each sheet stores values, and each cell
+ * in the other columns sums a range in column A starting at its own row.
+ * The ranges get longer toward the right, so that each cell in column A is
+ * referenced by many ranges on the same sheet, and by none on the other
+ * sheets.
+ */
+void build_range_model(model_context& cxt, const benchmark_params& params)
+{
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+
+    for (size_t i = 0; i < params.sheet_count; ++i)
+    {
+        ostringstream os;
+        os << "Sheet" << i + 1;
+        string name = os.str();
+        cxt.append_sheet(name.data(), name.size(), params.row_count, params.column_count + 1);
+    }
+
+    for (sheet_t sheet = 0; sheet < sheet_t(params.sheet_count); ++sheet)
+    {
+        for (row_t row = 0; row < row_t(params.row_count); ++row)
+            cxt.set_numeric_cell(abs_address_t(sheet,row,0), row);
+
+        for (col_t col = 1; col <= col_t(params.column_count); ++col)
+        {
+            for (row_t row = 0; row < row_t(params.row_count); ++row)
+            {
+                abs_address_t pos(sheet, row, col);
+                row_t length = std::min<row_t>(col, params.row_count - 1 - row);
+                range_t range(
+                    address_t(0, 0, -col, false, false, false),
+                    address_t(0, length, -col, false, false, false));
+
+                ostringstream os;
+                os << "SUM(" << resolver->get_name(range, pos, false) << ")";
+                string formula = os.str();
+                cxt.set_formula_cell(pos, formula.data(), formula.size(), *resolver);
+            }
+        }
+
+        abs_range_t range;
+        range.first = abs_address_t(sheet, 0, 1);
+        range.last = abs_address_t(sheet, params.row_count-1, params.column_count);
+        register_formula_cells(cxt, range);
+    }
+}
+
+/**
+ * Look up the range listeners of every cell in column A of all sheets
+ * repeatedly.
+ *
+ * @param listener_count total number of listeners found in each round is
+ *                       stored here.
+ *
+ * @return number of lookups per second.
+ */
+double run_listener_lookups(model_context& cxt, const benchmark_params& params, size_t& listener_count)
+{
+    const cell_listener_tracker& tracker = cxt.get_cell_listener_tracker();
+
+    double start_time = global::get_current_time();
+    for (size_t i = 0; i < params.recalc_count; ++i)
+    {
+        listener_count = 0;
+        for (sheet_t sheet = 0; sheet < sheet_t(params.sheet_count); ++sheet)
+        {
+            for (row_t row = 0; row < row_t(params.row_count); ++row)
+            {
+                dirty_formula_cells_t listeners;
+                tracker.get_all_range_listeners(abs_address_t(sheet,row,0), listeners);
+                listener_count += listeners.size();
+            }
+        }
+    }
+    double duration = global::get_current_time() - start_time;
+
+    return params.recalc_count * params.sheet_count * params.row_count / duration;
+}
+
+/**
+ * Modify all values in column A and recalculate the model repeatedly.
+ *
+ * @return number of recalculations per second.
+ */
+double run_recalcs(model_context& cxt, const benchmark_params& params, size_t thread_count)
+{
+    // Keep the worker threads alive across the recalculations.
+    cxt.set_thread_pool_size(thread_count);
+
+    modified_cells_t modified_cells;
+    for (sheet_t sheet = 0; sheet < sheet_t(params.sheet_count); ++sheet)
+    {
+        for (row_t row = 0; row < row_t(params.row_count); ++row)
+            modified_cells.push_back(abs_address_t(sheet,row,0));
+    }
+
+    double start_time = global::get_current_time();
+    for (size_t i = 0; i < params.recalc_count; ++i)
+    {
+        for (const abs_address_t& pos : modified_cells)
+            cxt.set_numeric_cell(pos, pos.row + i);
+
+        modified_cells_t addrs = modified_cells;
+        dirty_formula_cells_t dirty_cells;
+        get_all_dirty_cells(cxt, addrs, dirty_cells);
+        calculate_cells(cxt, dirty_cells, thread_count);
+    }
+    double duration = global::get_current_time() - start_time;
+
+    // Release the worker threads before moving on to the next thread count.
+    cxt.shutdown_thread_pool();
+
+    return params.recalc_count / duration;
+}
+
+/**
+ * Look up the dirty cells of increasing numbers of modified cells in column
+ * A with each number of threads, and report the time each lookup takes.
+ */
+void run_discoveries(model_context& cxt, const benchmark_params& params, const vector<size_t>& thread_counts)
+{
+    modified_cells_t all_cells;
+    for (row_t row = 0; row < row_t(params.row_count); ++row)
+    {
+        for (sheet_t sheet = 0; sheet < sheet_t(params.sheet_count); ++sheet)
+            all_cells.push_back(abs_address_t(sheet,row,0));
+    }
+
+    vector<size_t> modified_counts;
+    for (size_t n = 10; n < all_cells.size(); n *= 10)
+        modified_counts.push_back(n);
+    modified_counts.push_back(all_cells.size());
+
+    cout << setw(10) << "modified" << setw(10) << "dirty";
+    for (size_t thread_count : thread_counts)
+    {
+        ostringstream os;
+        os << thread_count << " thr (ms)";
+        cout << setw(14) << os.str();
+    }
+    cout << endl;
+
+    for (size_t modified_count : modified_counts)
+    {
+        modified_cells_t modified(all_cells.begin(), all_cells.begin() + modified_count);
+        size_t dirty_count = 0;
+        vector<double> durations;
+        for (size_t thread_count : thread_counts)
+        {
+            double start_time = global::get_current_time();
+            for (size_t i = 0; i < params.recalc_count; ++i)
+            {
+                modified_cells_t addrs = modified;
+                dirty_formula_cells_t dirty_cells;
+                get_all_dirty_cells(cxt, addrs, dirty_cells, thread_count);
+                dirty_count = dirty_cells.size();
+            }
+            durations.push_back((global::get_current_time() - start_time) / params.recalc_count);
+        }
+
+        cout << setw(10) << modified_count << setw(10) << dirty_count;
+        for (double duration : durations)
+            cout << fixed << setprecision(2) << setw(14) << duration * 1000.0;
+        cout << endl;
+    }
+}
+
+/**
+ * Build a model where column A forms a single circular reference, in which
+ * each cell halves the cell above it and adds the value in B1, and the
+ * first cell references the last.
+ */
+void build_cycle_model(model_context& cxt, row_t cell_count)
+{
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    cxt.append_sheet(IXION_ASCII("Sheet1"), cell_count, 2);
+    cxt.set_numeric_cell(abs_address_t(0,0,1), 1.0);
+
+    for (row_t row = 0; row < cell_count; ++row)
+    {
+        ostringstream os;
+        os << "A" << (row ? row : cell_count) << "*0.5+$B$1";
+        string formula = os.str();
+        cxt.set_formula_cell(abs_address_t(0,row,0), formula.data(), formula.size(), *resolver);
+    }
+
+    abs_range_t range;
+    range.first = abs_address_t(0, 0, 0);
+    range.last = abs_address_t(0, cell_count-1, 0);
+    register_formula_cells(cxt, range);
+}
+
+/**
+ * Modify B1 and recalculate circular references of increasing sizes
+ * iteratively, and report the time each recalculation takes.
+ */
+void run_cycles(const benchmark_params& params)
+{
+    cout << "max iterations: " << params.cfg.max_iterations
+        << ", epsilon: " << params.cfg.iteration_epsilon << endl;
+    cout << setw(10) << "cells" << setw(14) << "recalc (ms)" << setw(14) << "A1" << endl;
+
+    for (row_t cell_count = 10; cell_count <= 10000; cell_count *= 10)
+    {
+        model_context cxt;
+        cxt.set_config(params.cfg);
+        build_cycle_model(cxt, cell_count);
+
+        abs_address_t input(0,0,1);
+        double start_time = global::get_current_time();
+        for (size_t i = 0; i < params.recalc_count; ++i)
+        {
+            cxt.set_numeric_cell(input, i + 1);
+            modified_cells_t addrs(1, input);
+            dirty_formula_cells_t dirty_cells;
+            get_all_dirty_cells(cxt, addrs, dirty_cells);
+            calculate_cells(cxt, dirty_cells, 0);
+        }
+        double duration = (global::get_current_time() - start_time) / params.recalc_count;
+
+        cout << setw(10) << cell_count << fixed << setprecision(2) << setw(14) << duration * 1000.0
+            << setprecision(4) << setw(14) << cxt.get_numeric_value(abs_address_t(0,0,0)) << endl;
+    }
+}
+
+}
+
+int main (int argc, char** argv)
+{
+    namespace po = ::boost::program_options;
+
+    benchmark_params params;
+    params.sheet_count = 2;
+    params.row_count = 10000;
+    params.column_count = 8;
+    params.recalc_count = 10;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help,h", "print this help.")
+        ("benchmark,b", po::value<string>(),
+         "specify what to measure.  Allowed values are 'recalc' (default), which measures recalculations with different numbers of threads, and 'listeners', which measures the lookups of range listeners, and 'discovery', which measures the lookups of dirty cells against the number of modified cells with different numbers of threads, and 'cycle', which measures iterative recalculations of circular references of different sizes.")
+        ("thread,t", po::value<string>(),
+         "comma-separated list of thread counts to run the benchmark with, e.g. '0,1,2,4'.  By default it's every power of 2 up to the number of CPUs.")
+        ("calc-mode,m", po::value<string>(),
+         "specify how cells are scheduled for threaded calculation.  Allowed values are 'queue' (default), 'wavefront' and 'deterministic'.")
+        ("pin", "pin each calculation thread to its own CPU core.")
+        ("no-locality", "don't prefer calculating cells of the same column on the same thread.")
+        ("max-iterations", po::value<size_t>(&params.cfg.max_iterations), "maximum number of iterations for each circular reference in the 'cycle' benchmark.  By default it's 100.")
+        ("epsilon", po::value<double>(&params.cfg.iteration_epsilon), "largest change at which a circular reference is considered converged in the 'cycle' benchmark.  By default it's 0.001.")
+        ("sheets", po::value<size_t>(&params.sheet_count), "number of sheets.  By default it's 2.")
+        ("rows,r", po::value<size_t>(&params.row_count), "number of rows in each column.  By default it's 10000.")
+        ("columns,c", po::value<size_t>(&params.column_count), "number of formula columns in each sheet.  By default it's 8.")
+        ("recalcs,n", po::value<size_t>(&params.recalc_count), "number of recalculations to run for each thread count, or number of rounds of lookups.  By default it's 10.");
+
+    po::variables_map vm;
+    try
+    {
+        po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+        po::notify(vm);
+    }
+    catch (const exception& e)
+    {
+        // Unknown options.
+        cout << e.what() << endl;
+        cout << desc;
+        return EXIT_FAILURE;
+    }
+
+    if (vm.count("help"))
+    {
+        cout << "Usage: ixion-benchmark [options]" << endl
+            << endl
+            << "Recalculate a generated model repeatedly with different numbers of threads, and report the number of recalculations per second.  Alternatively, look up the range listeners of a generated model repeatedly, and report the number of lookups per second, or look up the dirty cells of a generated model, and report the time each lookup takes, or recalculate circular references of different sizes iteratively." << endl << endl
+            << desc;
+        return EXIT_SUCCESS;
+    }
+
+    if (!params.sheet_count || !params.row_count || !params.column_count || !params.recalc_count)
+    {
+        cout << "the numbers of sheets, rows, columns and recalculations must be greater than 0." << endl;
+        return EXIT_FAILURE;
+    }
+
+    string bench = "recalc";
+    if (vm.count("benchmark"))
+    {
+        bench = vm["benchmark"].as<string>();
+        if (bench == "listeners")
+        {
+            model_context cxt;
+            build_range_model(cxt, params);
+
+            size_t listener_count = 0;
+            double rate = run_listener_lookups(cxt, params, listener_count);
+            size_t lookup_count = params.sheet_count * params.row_count;
+
+            cout << "formula cells: " << params.sheet_count * params.row_count * params.column_count
+                << " (sheets: " << params.sheet_count << ", rows: " << params.row_count
+                << ", columns: " << params.column_count << ")" << endl;
+            cout << fixed << setprecision(2)
+                << "listener memory: " << cxt.get_cell_listener_tracker().get_memory_size() / 1048576.0 << " MiB" << endl
+                << "range listeners per lookup: " << double(listener_count) / lookup_count << endl
+                << "lookups/sec: " << rate << endl;
+
+            return EXIT_SUCCESS;
+        }
+        else if (bench == "cycle")
+        {
+            params.cfg.iterative_calc = true;
+            run_cycles(params);
+            return EXIT_SUCCESS;
+        }
+        else if (bench != "recalc" && bench != "discovery")
+        {
+            cout << "unknown benchmark: " << bench << endl;
+            cout << desc;
+            return EXIT_FAILURE;
+        }
+    }
+
+    vector<size_t> thread_counts;
+    if (vm.count("thread"))
+    {
+        if (!parse_thread_counts(vm["thread"].as<string>(), thread_counts))
+        {
+            cout << "invalid thread counts: " << vm["thread"].as<string>() << endl;
+            return EXIT_FAILURE;
+        }
+    }
+    else
+    {
+        size_t cpu_count = std::max(boost::thread::hardware_concurrency(), 1u);
+        for (size_t n = 1; n <= cpu_count; n *= 2)
+            thread_counts.push_back(n);
+    }
+
+    if (bench == "discovery")
+    {
+        model_context cxt;
+        build_model(cxt, params);
+
+        cout << "formula cells: " << params.sheet_count * params.row_count * params.column_count
+            << " (sheets: " << params.sheet_count << ", rows: " << params.row_count
+            << ", columns: " << params.column_count << ")" << endl;
+        cout << "number of CPUs: " << boost::thread::hardware_concurrency() << endl;
+
+        run_discoveries(cxt, params, thread_counts);
+        return EXIT_SUCCESS;
+    }
+
+    string mode = "queue";
+    if (vm.count("calc-mode"))
+    {
+        mode = vm["calc-mode"].as<string>();
+        if (mode == "wavefront")
+            params.cfg.calc_mode = calc_mode_t::wavefront;
+        else if (mode == "deterministic")
+            params.cfg.calc_mode = calc_mode_t::deterministic;
+        else if (mode != "queue")
+        {
+            cout << "unknown calc mode: " << mode << endl;
+            cout << desc;
+            return EXIT_FAILURE;
+        }
+    }
+
+    params.cfg.pin_threads = vm.count("pin") > 0;
+    params.cfg.column_locality = !vm.count("no-locality");
+
+    model_context cxt;
+    cxt.set_config(params.cfg);
+    build_model(cxt, params);
+
+    size_t cell_count = params.sheet_count * params.row_count * params.column_count;
+    cout << "formula cells: " << cell_count << " (sheets: " << params.sheet_count
+        << ", rows: " << params.row_count << ", columns: " << params.column_count << ")" << endl;
+    cout << "calc mode: " << mode << ", pinned threads: " << (params.cfg.pin_threads ? "yes" : "no")
+        << ", column locality: " << (params.cfg.column_locality ? "yes" : "no") << endl;
+    cout << "number of CPUs: " << boost::thread::hardware_concurrency() << endl;
+
+    // Warm up, which also records the evaluation costs of all cells.
+    run_recalcs(cxt, params, thread_counts[0]);
+
+    cout << setw(8) << "threads" << setw(16) << "recalcs/sec" << setw(16) << "cells/sec" << setw(10) << "speedup" << endl;
+
+    double base = 0.0;
+    for (size_t thread_count : thread_counts)
+    {
+        double rate = run_recalcs(cxt, params, thread_count);
+        if (base == 0.0)
+            base = rate;
+
+        cout << fixed << setprecision(2)
+            << setw(8) << thread_count << setw(16) << rate << setw(16) << setprecision(0) << rate * cell_count
+            << setw(10) << setprecision(2) << rate / base << endl;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
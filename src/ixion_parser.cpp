@@ -7,6 +7,8 @@
 
 #include "model_parser.hpp"
 
+#include "ixion/config.hpp"
+
 #include <string>
 #include <vector>
 #include <iostream>
@@ -21,9 +23,11 @@ namespace {
 
 class parse_file : public unary_function<void, string>
 {
+    const config& m_config;
     const size_t m_thread_count;
 public:
-    parse_file(size_t thread_count) : m_thread_count(thread_count) {}
+    parse_file(const config& cfg, size_t thread_count) :
+        m_config(cfg), m_thread_count(thread_count) {}
 
     void operator() (const string& fpath) const
     {
@@ -33,7 +37,7 @@ public:
 
         try
         {
-            model_parser parser(fpath, m_thread_count);
+            model_parser parser(fpath, m_config, m_thread_count);
             parser.parse();
         }
         catch (const exception& e)
@@ -60,7 +64,9 @@ int main (int argc, char** argv)
     desc.add_options()
         ("help,h", "print this help.")
         ("thread,t", po::value<size_t>(),
-         "specify the number of threads to use for calculation.  Note that the number specified by this option corresponds with the number of calculation threads i.e. those child threads that perform cell interpretations.  The main thread does not perform any calculations; instead, it creates a new child thread to manage the calculation threads, the number of which is specified by the arg.  Therefore, the total number of threads used by this program will be arg + 2.");
+         "specify the number of threads to use for calculation.  Note that the number specified by this option corresponds with the number of calculation threads i.e. those child threads that perform cell interpretations.  The main thread does not perform any calculations; instead, it waits for the calculation threads, the number of which is specified by the arg, to finish.  Therefore, the total number of threads used by this program will be arg + 1.")
+        ("calc-mode,m", po::value<string>(),
+         "specify how cells are scheduled for threaded calculation.  Allowed values are 'queue' (default), in which each cell gets queued as soon as all of its precedent cells are calculated, 'wavefront', in which cells are calculated one dependency level at a time, and 'deterministic', which works like 'wavefront' but always produces the same output regardless of the number of threads.");
 
     po::options_description hidden("Hidden options");
     hidden.add_options()
@@ -99,6 +105,22 @@ int main (int argc, char** argv)
     if (vm.count("thread"))
         thread_count = vm["thread"].as<size_t>();
 
+    config cfg;
+    if (vm.count("calc-mode"))
+    {
+        string mode = vm["calc-mode"].as<string>();
+        if (mode == "wavefront")
+            cfg.calc_mode = calc_mode_t::wavefront;
+        else if (mode == "deterministic")
+            cfg.calc_mode = calc_mode_t::deterministic;
+        else if (mode != "queue")
+        {
+            cout << "unknown calc mode: " << mode << endl;
+            cout << desc;
+            return EXIT_FAILURE;
+        }
+    }
+
     vector<string> files;
     if (vm.count("input-file"))
         files = vm["input-file"].as< vector<string> >();
@@ -112,7 +134,7 @@ int main (int argc, char** argv)
     try
     {
         // Parse all files one at a time.
-        for_each(files.begin(), files.end(), parse_file(thread_count));
+        for_each(files.begin(), files.end(), parse_file(cfg, thread_count));
     }
     catch (const exception&)
     {
@@ -0,0 +1,421 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "ixion/address_set.hpp"
+#include "ixion/exceptions.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <sstream>
+
+namespace ixion {
+
+namespace {
+
+const size_t word_bits = 64;
+
+/** number of words in each chunk of rows. */
+const size_t chunk_words = 64;
+
+/** number of rows in each chunk. */
+const row_t chunk_rows = word_bits * chunk_words;
+
+size_t count_bits(uint64_t v)
+{
+#if defined __GNUC__
+    return __builtin_popcountll(v);
+#else
+    size_t n = 0;
+    for (; v; v &= v - 1)
+        ++n;
+    return n;
+#endif
+}
+
+size_t find_first_bit(uint64_t v)
+{
+    assert(v);
+#if defined __GNUC__
+    return __builtin_ctzll(v);
+#else
+    size_t n = 0;
+    for (; !(v & 1); v >>= 1)
+        ++n;
+    return n;
+#endif
+}
+
+uint64_t* new_chunk()
+{
+    uint64_t* p = new uint64_t[chunk_words];
+    std::memset(p, 0, sizeof(uint64_t) * chunk_words);
+    return p;
+}
+
+}
+
+abs_address_set::const_iterator::const_iterator() :
+    mp_set(NULL), m_pos(abs_address_t::invalid) {}
+
+abs_address_set::const_iterator::const_iterator(const abs_address_set* p, const abs_address_t& pos) :
+    mp_set(p), m_pos(pos) {}
+
+abs_address_set::const_iterator& abs_address_set::const_iterator::operator++()
+{
+    ++m_pos.row;
+    if (!mp_set->find_next(m_pos))
+        m_pos = abs_address_t(abs_address_t::invalid);
+
+    return *this;
+}
+
+abs_address_set::const_iterator abs_address_set::const_iterator::operator++(int)
+{
+    const_iterator ret = *this;
+    ++(*this);
+    return ret;
+}
+
+bool abs_address_set::const_iterator::operator== (const const_iterator& r) const
+{
+    return mp_set == r.mp_set && m_pos == r.m_pos;
+}
+
+bool abs_address_set::const_iterator::operator!= (const const_iterator& r) const
+{
+    return !operator== (r);
+}
+
+abs_address_set::abs_address_set() : m_size(0) {}
+
+abs_address_set::abs_address_set(const abs_address_set& r) : m_size(0)
+{
+    insert(r);
+}
+
+abs_address_set::abs_address_set(abs_address_set&& r) : m_size(0)
+{
+    swap(r);
+}
+
+abs_address_set::~abs_address_set()
+{
+    clear();
+}
+
+abs_address_set& abs_address_set::operator= (abs_address_set r)
+{
+    swap(r);
+    return *this;
+}
+
+bool abs_address_set::insert(const abs_address_t& addr)
+{
+    if (addr.sheet < 0 || addr.row < 0 || addr.column < 0)
+    {
+        std::ostringstream os;
+        os << "abs_address_set::insert: invalid address (sheet=" << addr.sheet
+            << "; row=" << addr.row << "; column=" << addr.column << ")";
+        throw general_error(os.str());
+    }
+
+    if (size_t(addr.sheet) >= m_sheets.size())
+        m_sheets.resize(addr.sheet+1);
+
+    sheet_type& sheet = m_sheets[addr.sheet];
+    sheet_type::iterator it_col = lower_bound(sheet, addr.column);
+    if (it_col == sheet.end() || it_col->first != addr.column)
+        it_col = sheet.insert(it_col, sheet_type::value_type(addr.column, column_type()));
+
+    column_type& column = it_col->second;
+    size_t chunk = addr.row / chunk_rows;
+    if (chunk >= column.size())
+        column.resize(chunk+1, NULL);
+
+    if (!column[chunk])
+        column[chunk] = new_chunk();
+
+    size_t offset = addr.row % chunk_rows;
+    word_type& word = column[chunk][offset / word_bits];
+    word_type bit = word_type(1) << (offset % word_bits);
+    if (word & bit)
+        // Already in the set.
+        return false;
+
+    word |= bit;
+    ++m_size;
+    return true;
+}
+
+void abs_address_set::insert(const abs_address_set& r)
+{
+    if (m_sheets.size() < r.m_sheets.size())
+        m_sheets.resize(r.m_sheets.size());
+
+    for (size_t i = 0; i < r.m_sheets.size(); ++i)
+    {
+        const sheet_type& src_sheet = r.m_sheets[i];
+        sheet_type& sheet = m_sheets[i];
+
+        // Both sheets are sorted by column, so walk them side by side.
+        size_t pos = 0;
+        sheet_type::const_iterator it_src = src_sheet.begin(), it_src_end = src_sheet.end();
+        for (; it_src != it_src_end; ++it_src)
+        {
+            while (pos < sheet.size() && sheet[pos].first < it_src->first)
+                ++pos;
+
+            if (pos == sheet.size() || sheet[pos].first != it_src->first)
+                sheet.insert(sheet.begin() + pos, sheet_type::value_type(it_src->first, column_type()));
+
+            const column_type& src_column = it_src->second;
+            column_type& column = sheet[pos].second;
+            if (column.size() < src_column.size())
+                column.resize(src_column.size(), NULL);
+
+            for (size_t k = 0; k < src_column.size(); ++k)
+            {
+                const word_type* src = src_column[k];
+                if (!src)
+                    continue;
+
+                if (!column[k])
+                    column[k] = new_chunk();
+
+                word_type* dest = column[k];
+                for (size_t w = 0; w < chunk_words; ++w)
+                {
+                    m_size += count_bits(src[w] & ~dest[w]);
+                    dest[w] |= src[w];
+                }
+            }
+        }
+    }
+}
+
+size_t abs_address_set::erase(const abs_address_t& addr)
+{
+    if (!count(addr))
+        return 0;
+
+    size_t offset = addr.row % chunk_rows;
+    column_type& column = lower_bound(m_sheets[addr.sheet], addr.column)->second;
+    word_type& word = column[addr.row / chunk_rows][offset / word_bits];
+    word &= ~(word_type(1) << (offset % word_bits));
+    --m_size;
+    return 1;
+}
+
+size_t abs_address_set::count(const abs_address_t& addr) const
+{
+    if (addr.row < 0)
+        return 0;
+
+    const column_type* column = get_column(addr);
+    if (!column)
+        return 0;
+
+    size_t chunk = addr.row / chunk_rows;
+    if (chunk >= column->size() || !(*column)[chunk])
+        return 0;
+
+    size_t offset = addr.row % chunk_rows;
+    return ((*column)[chunk][offset / word_bits] >> (offset % word_bits)) & 1;
+}
+
+void abs_address_set::get_addresses(const abs_range_t& range, std::vector<abs_address_t>& addrs) const
+{
+    sheet_t sheet_end = std::min<sheet_t>(range.last.sheet + 1, m_sheets.size());
+    for (sheet_t sheet = std::max(range.first.sheet, 0); sheet < sheet_end; ++sheet)
+    {
+        const sheet_type& columns = m_sheets[sheet];
+        sheet_type::const_iterator it_col = lower_bound(columns, range.first.column);
+        for (; it_col != columns.end() && it_col->first <= range.last.column; ++it_col)
+        {
+            // Walk the rows of the column within the range.
+            row_t row = std::max(range.first.row, 0);
+            while (find_row(it_col->second, row, row) && row <= range.last.row)
+            {
+                addrs.push_back(abs_address_t(sheet, row, it_col->first));
+                ++row;
+            }
+        }
+    }
+}
+
+bool abs_address_set::intersects(const abs_range_t& range) const
+{
+    sheet_t sheet_end = std::min<sheet_t>(range.last.sheet + 1, m_sheets.size());
+    for (sheet_t sheet = std::max(range.first.sheet, 0); sheet < sheet_end; ++sheet)
+    {
+        const sheet_type& columns = m_sheets[sheet];
+        sheet_type::const_iterator it_col = lower_bound(columns, range.first.column);
+        for (; it_col != columns.end() && it_col->first <= range.last.column; ++it_col)
+        {
+            row_t row = 0;
+            if (find_row(it_col->second, std::max(range.first.row, 0), row) && row <= range.last.row)
+                return true;
+        }
+    }
+
+    return false;
+}
+
+size_t abs_address_set::size() const
+{
+    return m_size;
+}
+
+bool abs_address_set::empty() const
+{
+    return m_size == 0;
+}
+
+void abs_address_set::clear()
+{
+    std::vector<sheet_type>::iterator it = m_sheets.begin(), it_end = m_sheets.end();
+    for (; it != it_end; ++it)
+    {
+        sheet_type::iterator it_col = it->begin(), it_col_end = it->end();
+        for (; it_col != it_col_end; ++it_col)
+        {
+            column_type::iterator it_chunk = it_col->second.begin(), it_chunk_end = it_col->second.end();
+            for (; it_chunk != it_chunk_end; ++it_chunk)
+                delete[] *it_chunk;
+        }
+    }
+
+    m_sheets.clear();
+    m_size = 0;
+}
+
+void abs_address_set::swap(abs_address_set& r)
+{
+    m_sheets.swap(r.m_sheets);
+    std::swap(m_size, r.m_size);
+}
+
+abs_address_set::const_iterator abs_address_set::begin() const
+{
+    abs_address_t pos(0, 0, 0);
+    if (!find_next(pos))
+        return end();
+
+    return const_iterator(this, pos);
+}
+
+abs_address_set::const_iterator abs_address_set::end() const
+{
+    return const_iterator(this, abs_address_t(abs_address_t::invalid));
+}
+
+bool abs_address_set::operator== (const abs_address_set& r) const
+{
+    if (m_size != r.m_size)
+        return false;
+
+    return std::equal(begin(), end(), r.begin());
+}
+
+bool abs_address_set::operator!= (const abs_address_set& r) const
+{
+    return !operator== (r);
+}
+
+bool abs_address_set::find_next(abs_address_t& pos) const
+{
+    // Start from the row of the position in its own column, and from the
+    // first row in all columns after it.
+    row_t start_row = pos.row;
+    col_t start_col = pos.column;
+    for (size_t sheet = pos.sheet; sheet < m_sheets.size(); ++sheet)
+    {
+        const sheet_type& columns = m_sheets[sheet];
+        sheet_type::const_iterator it_col = lower_bound(columns, start_col);
+        for (; it_col != columns.end(); ++it_col)
+        {
+            if (it_col->first != start_col)
+                start_row = 0;
+
+            if (find_row(it_col->second, start_row, pos.row))
+            {
+                pos.sheet = sheet;
+                pos.column = it_col->first;
+                return true;
+            }
+
+            start_row = 0;
+        }
+
+        start_col = 0;
+        start_row = 0;
+    }
+
+    return false;
+}
+
+bool abs_address_set::find_row(const column_type& column, row_t start, row_t& row)
+{
+    for (size_t chunk = start / chunk_rows; chunk < column.size(); ++chunk)
+    {
+        const word_type* words = column[chunk];
+        if (!words)
+            continue;
+
+        size_t offset = 0;
+        if (row_t(chunk * chunk_rows) < start)
+            offset = start - chunk * chunk_rows;
+
+        size_t w = offset / word_bits;
+        word_type word = words[w] & (~word_type(0) << (offset % word_bits));
+        for (;;)
+        {
+            if (word)
+            {
+                row = chunk * chunk_rows + w * word_bits + find_first_bit(word);
+                return true;
+            }
+
+            if (++w == chunk_words)
+                break;
+
+            word = words[w];
+        }
+    }
+
+    return false;
+}
+
+abs_address_set::sheet_type::const_iterator abs_address_set::lower_bound(const sheet_type& sheet, col_t col)
+{
+    return std::lower_bound(sheet.begin(), sheet.end(), col,
+        [](const sheet_type::value_type& v, col_t c) -> bool { return v.first < c; });
+}
+
+abs_address_set::sheet_type::iterator abs_address_set::lower_bound(sheet_type& sheet, col_t col)
+{
+    return std::lower_bound(sheet.begin(), sheet.end(), col,
+        [](const sheet_type::value_type& v, col_t c) -> bool { return v.first < c; });
+}
+
+const abs_address_set::column_type* abs_address_set::get_column(const abs_address_t& addr) const
+{
+    if (addr.sheet < 0 || size_t(addr.sheet) >= m_sheets.size())
+        return NULL;
+
+    const sheet_type& sheet = m_sheets[addr.sheet];
+    sheet_type::const_iterator it = lower_bound(sheet, addr.column);
+    if (it == sheet.end() || it->first != addr.column)
+        return NULL;
+
+    return &it->second;
+}
+
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -9,6 +9,8 @@
 #include "ixion/exceptions.hpp"
 #include "ixion/formula_result.hpp"
 #include "ixion/cell_listener_tracker.hpp"
+#include "ixion/config.hpp"
+#include "ixion/formula.hpp"
 #include "ixion/interface/formula_model_access.hpp"
 #include "ixion/interface/session_handler.hpp"
 
@@ -16,8 +18,14 @@
 
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <limits>
 #include <string>
 #include <sstream>
 #include <iostream>
@@ -68,23 +76,49 @@ private:
     ::boost::shared_ptr<vector<const formula_token_base*> > mp_tokens;
 };
 
-}
+/**
+ * Threads waiting for formula cell results block on one of these buckets,
+ * chosen by the address of the cell.  This way, formula cells don't need to
+ * carry their own mutex and condition variable.
+ */
+struct wait_bucket
+{
+    ::boost::mutex mtx;
+    ::boost::condition_variable cond;
+};
 
-formula_cell::interpret_status::interpret_status() :
-    result(NULL) {}
+wait_bucket& get_wait_bucket(const formula_cell* p)
+{
+    static const size_t bucket_count = 64;
+    static wait_bucket buckets[bucket_count];
+    return buckets[(reinterpret_cast<uintptr_t>(p) / sizeof(formula_cell)) % bucket_count];
+}
 
-formula_cell::interpret_status::~interpret_status()
+/**
+ * Formula cells store their token identifiers in 32 bits.
+ */
+uint32_t to_tokens_identifier(size_t identifier)
 {
-    delete result;
+    if (identifier > std::numeric_limits<uint32_t>::max())
+    {
+        std::ostringstream os;
+        os << "formula tokens identifier " << identifier << " is out of range.";
+        throw general_error(os.str());
+    }
+
+    return identifier;
+}
+
 }
 
 formula_cell::formula_cell() :
-    m_identifier(0), m_shared_token(false), m_circular_safe(false)
+    m_value(0.0), m_identifier(0), m_eval_cost(0), m_state(state_dirty), m_shared_token(false)
 {
 }
 
 formula_cell::formula_cell(size_t tokens_identifier) :
-    m_identifier(tokens_identifier), m_shared_token(false), m_circular_safe(false)
+    m_value(0.0), m_identifier(to_tokens_identifier(tokens_identifier)), m_eval_cost(0),
+    m_state(state_dirty), m_shared_token(false)
 {
 }
 
@@ -92,11 +126,6 @@ formula_cell::~formula_cell()
 {
 }
 
-void formula_cell::reset_flag()
-{
-    m_circular_safe = false;
-}
-
 size_t formula_cell::get_identifier() const
 {
     return m_identifier;
@@ -104,176 +133,214 @@ size_t formula_cell::get_identifier() const
 
 void formula_cell::set_identifier(size_t identifier)
 {
-    m_identifier = identifier;
+    m_identifier = to_tokens_identifier(identifier);
 }
 
 double formula_cell::get_value() const
 {
-    ::boost::mutex::scoped_lock lock(m_interpret_status.mtx);
-    wait_for_interpreted_result(lock);
+    uint8_t state = m_state.load(std::memory_order_acquire);
+    if ((state & state_mask) == state_dirty && (state & state_pending))
+        // Nobody is going to interpret this cell until it's asked for.
+        throw formula_error(fe_ref_result_not_available);
+
+    wait_for_interpreted_result();
     return fetch_value_from_result();
 }
 
+double formula_cell::get_value(iface::formula_model_access& context, const abs_address_t& pos) const
+{
+    if (context.get_config().lazy_calc && !has_result())
+        calculate_cell(context, pos);
+
+    return get_value();
+}
+
 double formula_cell::get_value_nowait() const
 {
-    boost::mutex::scoped_lock lock(m_interpret_status.mtx);
     return fetch_value_from_result();
 }
 
 double formula_cell::fetch_value_from_result() const
 {
-    if (!m_interpret_status.result)
-        // Result not cached yet.  Reference error.
-        throw formula_error(fe_ref_result_not_available);
-
-    if (m_interpret_status.result->get_type() == formula_result::rt_error)
-        // Error condition.
-        throw formula_error(m_interpret_status.result->get_error());
+    switch (m_state.load(std::memory_order_acquire) & state_mask)
+    {
+        case state_value:
+            break;
+        case state_error:
+            // Error condition.
+            throw formula_error(m_error);
+        case state_string:
+            assert(!"the result is not a numeric value");
+            break;
+        default:
+            // Result not cached yet.  Reference error.
+            throw formula_error(fe_ref_result_not_available);
+    }
 
-    assert(m_interpret_status.result->get_type() == formula_result::rt_value);
-    return m_interpret_status.result->get_value();
+    return m_value;
 }
 
 void formula_cell::interpret(iface::formula_model_access& context, const abs_address_t& pos)
+{
+    interpret(context, pos, context.get_session_handler());
+}
+
+void formula_cell::interpret(
+    iface::formula_model_access& context, const abs_address_t& pos, iface::session_handler* handler)
 {
 #if DEBUG_FORMULA_CELL
     const formula_name_resolver& resolver = context.get_name_resolver();
     __IXION_DEBUG_OUT__ << resolver.get_name(pos, false) << ": interpreting" << endl;
 #endif
-    {
-        ::boost::mutex::scoped_lock lock(m_interpret_status.mtx);
+    uint8_t state = m_state.load(std::memory_order_acquire);
+    while ((state & state_mask) == state_dirty &&
+        !m_state.compare_exchange_weak(state, (state & state_waiting) | state_computing, std::memory_order_acquire))
+        ;
 
-        if (m_interpret_status.result)
+    if ((state & state_mask) != state_dirty)
+    {
+        // When the result is already cached before the cell is interpreted,
+        // it can mean the cell has circular dependency.
+        if ((state & state_mask) == state_error)
         {
-            // When the result is already cached before the cell is interpreted,
-            // it can mean the cell has circular dependency.
-            if (m_interpret_status.result->get_type() == formula_result::rt_error)
+            if (handler)
             {
-                iface::session_handler* handler = context.get_session_handler();
-                if (handler)
-                {
-                    handler->begin_cell_interpret(pos);
-                    const char* msg = get_formula_error_name(m_interpret_status.result->get_error());
-                    handler->set_formula_error(msg);
-                }
+                handler->begin_cell_interpret(pos);
+                const char* msg = get_formula_error_name(m_error);
+                handler->set_formula_error(msg);
             }
-            return;
         }
+        return;
+    }
 
-        formula_interpreter fin(this, context);
-        fin.set_origin(pos);
-        m_interpret_status.result = new formula_result;
-        if (fin.interpret())
-        {
-            // Successful interpretation.
-            *m_interpret_status.result = fin.get_result();
-        }
-        else
-        {
-            // Interpretation ended with an error condition.
-            m_interpret_status.result->set_error(fin.get_error());
-        }
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+    formula_interpreter fin(this, context);
+    fin.set_origin(pos);
+    fin.set_session_handler(handler);
+    formula_result result;
+    if (fin.interpret())
+    {
+        // Successful interpretation.
+        result = fin.get_result();
+    }
+    else
+    {
+        // Interpretation ended with an error condition.
+        result.set_error(fin.get_error());
     }
-    m_interpret_status.cond.notify_all();
-}
 
-bool formula_cell::is_circular_safe() const
-{
-    return m_circular_safe;
+    // Record the time it took, for the scheduler to use in the next
+    // calculation.  Make sure it's never 0, which means unknown.
+    std::chrono::nanoseconds::rep cost =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_time).count();
+    cost = std::max<std::chrono::nanoseconds::rep>(cost, 1);
+    m_eval_cost = cost < std::numeric_limits<uint32_t>::max() ?
+        cost : std::numeric_limits<uint32_t>::max();
+
+    publish_result(result);
 }
 
-void formula_cell::check_circular(const iface::formula_model_access& cxt, const abs_address_t& pos)
+void formula_cell::publish_result(const formula_result& result)
 {
-    // TODO: Check to make sure this is being run on the main thread only.
-    const formula_tokens_t* tokens = NULL;
-    if (is_shared())
-        tokens = cxt.get_shared_formula_tokens(pos.sheet, m_identifier);
-    else
-        tokens = cxt.get_formula_tokens(pos.sheet, m_identifier);
-
-    if (!tokens)
+    uint8_t state = state_dirty;
+    switch (result.get_type())
     {
-        std::ostringstream os;
-        if (is_shared())
-            os << "failed to retrieve shared formula tokens from formula cell's identifier. ";
-        else
-            os << "failed to retrieve formula tokens from formula cell's identifier. ";
-        os << "(identifier=" << m_identifier << ")";
-        throw model_context_error(os.str(), model_context_error::circular_dependency);
+        case formula_result::rt_value:
+            m_value = result.get_value();
+            state = state_value;
+        break;
+        case formula_result::rt_string:
+            m_str_identifier = result.get_string();
+            state = state_string;
+        break;
+        case formula_result::rt_error:
+            m_error = result.get_error();
+            state = state_error;
+        break;
     }
-
-    formula_tokens_t::const_iterator itr = tokens->begin(), itr_end = tokens->end();
-    for (; itr != itr_end; ++itr)
+    if (m_state.exchange(state, std::memory_order_acq_rel) & state_waiting)
     {
-        switch ((*itr)->get_opcode())
-        {
-            case fop_single_ref:
-            {
-                abs_address_t addr = (*itr)->get_single_ref().to_abs(pos);
-                const formula_cell* ref = cxt.get_formula_cell(addr);
-
-                if (!ref)
-                    continue;
+        // Some threads are waiting for this result.  Taking the lock ensures
+        // that they are either already blocked or yet to check the state.
+        wait_bucket& bucket = get_wait_bucket(this);
+        ::boost::mutex::scoped_lock lock(bucket.mtx);
+        bucket.cond.notify_all();
+    }
+}
 
-                if (!check_ref_for_circular_safety(*ref, addr))
-                    return;
-            }
-            break;
-            case fop_range_ref:
-            {
-                abs_range_t range = (*itr)->get_range_ref().to_abs(pos);
-                for (sheet_t sheet = range.first.sheet; sheet <= range.last.sheet; ++sheet)
-                {
-                    for (col_t col = range.first.column; col <= range.last.column; ++col)
-                    {
-                        for (row_t row = range.first.row; row <= range.last.row; ++row)
-                        {
-                            abs_address_t addr(sheet, row, col);
-                            if (cxt.get_celltype(addr) != celltype_t::formula)
-                                continue;
-
-                            if (!check_ref_for_circular_safety(*cxt.get_formula_cell(addr), addr))
-                                return;
-                        }
-                    }
-                }
-            }
-            default:
+void formula_cell::set_circular()
+{
 #if DEBUG_FORMULA_CELL
-                __IXION_DEBUG_OUT__ << "check_circular: token type " << get_opcode_name((*itr)->get_opcode())
-                    << " was not processed." << endl;
-#else
-                ;
+    __IXION_DEBUG_OUT__ << "circular dependency detected !!" << endl;
 #endif
-        }
+    assert((m_state.load() & state_mask) == state_dirty);
+    publish_result(formula_result(fe_ref_result_not_available));
+}
 
-    }
+void formula_cell::start_iteration()
+{
+    assert((m_state.load() & state_mask) == state_dirty);
+    publish_result(formula_result(0.0));
+}
 
-    // No circular dependencies.  Good.
-    m_circular_safe = true;
+double formula_cell::interpret_iteration(iface::formula_model_access& context, const abs_address_t& pos)
+{
+    formula_result previous;
+    bool available = get_result_cache(previous);
+    assert(available);
+    (void)available;
+
+    // Don't report each iteration to the session handler.
+    formula_interpreter fin(this, context);
+    fin.set_origin(pos);
+    fin.set_session_handler(NULL);
+    formula_result result;
+    if (fin.interpret())
+        result = fin.get_result();
+    else
+        result.set_error(fin.get_error());
+
+    double change = 0.0;
+    if (previous.get_type() == formula_result::rt_value && result.get_type() == formula_result::rt_value)
+        change = std::fabs(result.get_value() - previous.get_value());
+    else if (previous != result)
+        change = std::numeric_limits<double>::infinity();
+
+    publish_result(result);
+    return change;
 }
 
-bool formula_cell::check_ref_for_circular_safety(const formula_cell& ref, const abs_address_t& pos)
+void formula_cell::reset()
 {
-    if (!ref.is_circular_safe())
-    {
-        // Circular dependency detected !!
-#if DEBUG_FORMULA_CELL
-        __IXION_DEBUG_OUT__ << "circular dependency detected !!" << endl;
-#endif
-        assert(!m_interpret_status.result);
-        m_interpret_status.result = new formula_result(fe_ref_result_not_available);
+    // Keep the waiting bit so that any thread already waiting for the
+    // result gets woken up once the new result is published.
+    m_state.fetch_and(state_waiting, std::memory_order_acq_rel);
+}
+
+void formula_cell::reset_pending()
+{
+    uint8_t state = m_state.load(std::memory_order_acquire);
+    while (!m_state.compare_exchange_weak(
+        state, (state & state_waiting) | state_pending, std::memory_order_acq_rel))
+        ;
+}
+
+bool formula_cell::release_result(formula_result& result)
+{
+    uint8_t state = m_state.fetch_and(state_waiting, std::memory_order_acq_rel) & state_mask;
+    if (state < state_value)
         return false;
-    }
+
+    fetch_result(state, result);
     return true;
 }
 
-void formula_cell::reset()
+void formula_cell::restore_result(const formula_result& result)
 {
-    ::boost::mutex::scoped_lock lock(m_interpret_status.mtx);
-    delete m_interpret_status.result;
-    m_interpret_status.result = NULL;
-    reset_flag();
+    assert((m_state.load() & state_mask) == state_dirty);
+    publish_result(result);
 }
 
 void formula_cell::get_ref_tokens(const iface::formula_model_access& cxt, const abs_address_t& pos, vector<const formula_token_base*>& tokens)
@@ -291,10 +358,37 @@ void formula_cell::get_ref_tokens(const iface::formula_model_access& cxt, const
     for_each(this_tokens->begin(), this_tokens->end(), func).swap_tokens(tokens);
 }
 
-const formula_result* formula_cell::get_result_cache() const
+bool formula_cell::has_result() const
+{
+    return (m_state.load(std::memory_order_acquire) & state_mask) >= state_value;
+}
+
+bool formula_cell::get_result_cache(formula_result& result) const
+{
+    uint8_t state = m_state.load(std::memory_order_acquire) & state_mask;
+    if (state < state_value)
+        return false;
+
+    fetch_result(state, result);
+    return true;
+}
+
+void formula_cell::fetch_result(uint8_t state, formula_result& result) const
 {
-    ::boost::mutex::scoped_lock lock(m_interpret_status.mtx);
-    return m_interpret_status.result;
+    switch (state)
+    {
+        case state_value:
+            result.set_value(m_value);
+        break;
+        case state_string:
+            result.set_string(m_str_identifier);
+        break;
+        case state_error:
+            result.set_error(m_error);
+        break;
+        default:
+            assert(!"the result is not available");
+    }
 }
 
 bool formula_cell::is_shared() const
@@ -302,22 +396,43 @@ bool formula_cell::is_shared() const
     return m_shared_token;
 }
 
+uint32_t formula_cell::get_eval_cost() const
+{
+    return m_eval_cost;
+}
+
 void formula_cell::set_shared(bool b)
 {
     m_shared_token = b;
 }
 
-void formula_cell::wait_for_interpreted_result(::boost::mutex::scoped_lock& lock) const
+uint8_t formula_cell::wait_for_interpreted_result() const
 {
+    uint8_t state = m_state.load(std::memory_order_acquire);
+    if ((state & state_mask) >= state_value)
+        // Result is already available.  No need to block.
+        return state & state_mask;
+
 #if DEBUG_FORMULA_CELL
     __IXION_DEBUG_OUT__ << "wait for interpreted result" << endl;
 #endif
-    while (!m_interpret_status.result)
+    wait_bucket& bucket = get_wait_bucket(this);
+    ::boost::mutex::scoped_lock lock(bucket.mtx);
+    while (true)
     {
+        state = m_state.load(std::memory_order_acquire);
+        if ((state & state_mask) >= state_value)
+            return state & state_mask;
+
+        // Let the interpreting thread know that someone is waiting.
+        if (!(state & state_waiting) &&
+            !m_state.compare_exchange_weak(state, state | state_waiting, std::memory_order_acquire))
+            continue;
+
 #if DEBUG_FORMULA_CELL
         __IXION_DEBUG_OUT__ << "waiting" << endl;
 #endif
-        m_interpret_status.cond.wait(lock);
+        bucket.cond.wait(lock);
     }
 }
 
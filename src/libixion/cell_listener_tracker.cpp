@@ -10,11 +10,18 @@
 #include "ixion/interface/formula_model_access.hpp"
 #include "ixion/cell.hpp"
 
+#include "listener_set.hpp"
+
 #include <mdds/rectangle_set.hpp>
+#include <boost/thread.hpp>
 
 #define DEBUG_CELL_LISTENER_TRACKER 0
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <list>
+#include <map>
 #include <unordered_map>
 
 #if DEBUG_CELL_LISTENER_TRACKER
@@ -27,35 +34,182 @@ namespace ixion {
 
 namespace {
 
-typedef mdds::rectangle_set<row_t, cell_listener_tracker::address_set_type*> range_query_set_type;
-typedef std::unordered_map<abs_address_t, cell_listener_tracker::address_set_type*, abs_address_t::hash> cell_store_type;
-typedef std::unordered_map<abs_range_t, cell_listener_tracker::address_set_type*, abs_range_t::hash> range_store_type;
+typedef mdds::rectangle_set<row_t, listener_set*> range_query_set_type;
+typedef std::unordered_map<abs_address_t, listener_set, abs_address_t::hash> cell_store_type;
+typedef std::unordered_map<abs_range_t, listener_set, abs_range_t::hash> range_store_type;
+typedef std::unordered_map<abs_address_t, cell_listener_tracker::precedents_type, abs_address_t::hash> precedent_store_type;
+typedef std::vector<range_query_set_type*> sheet_query_store_type;
+typedef std::list<std::pair<abs_address_t, abs_address_set>> listener_cache_type;
+typedef std::unordered_map<abs_address_t, listener_cache_type::iterator, abs_address_t::hash> listener_cache_map_type;
+
+struct shared_block;
 
-class dirty_cell_inserter : public std::unary_function<cell_listener_tracker::address_set_type*, void>
+/**
+ * Reference made by all cells of a shared formula block.  A reference to a
+ * single cell has the same first and last addresses.
+ */
+struct shared_reference
 {
-    iface::formula_model_access& m_context;
-    dirty_formula_cells_t& m_dirty_cells;
-    cell_listener_tracker::address_set_type& m_addrs;
-public:
-    dirty_cell_inserter(iface::formula_model_access& cxt, dirty_formula_cells_t& dirty_cells, cell_listener_tracker::address_set_type& addrs) :
-        m_context(cxt), m_dirty_cells(dirty_cells), m_addrs(addrs) {}
+    const shared_block* block;
+    range_t ref;
+
+    shared_reference(const shared_block* _block, const range_t& _ref) : block(_block), ref(_ref) {}
+};
+
+/**
+ * Rectangular block of cells using the same shared formula, and therefore
+ * making the same references relative to their positions.
+ */
+struct shared_block
+{
+    size_t identifier;
+    abs_range_t cells;
+    std::vector<shared_reference> cell_refs;
+    std::vector<shared_reference> range_refs;
+
+    shared_block(const abs_range_t& _cells, size_t _identifier, const cell_listener_tracker::shared_references_type& refs);
+
+    /**
+     * Copy the references of another block, for a different set of cells.
+     */
+    shared_block(const shared_block& r, const abs_range_t& _cells);
+
+    shared_block(const shared_block&) = delete;
+    shared_block& operator=(const shared_block&) = delete;
+
+    bool has_references(const cell_listener_tracker::shared_references_type& refs) const;
+};
+
+shared_block::shared_block(
+    const abs_range_t& _cells, size_t _identifier, const cell_listener_tracker::shared_references_type& refs) :
+    identifier(_identifier), cells(_cells)
+{
+    cell_refs.reserve(refs.cells.size());
+    std::vector<address_t>::const_iterator it = refs.cells.begin(), it_end = refs.cells.end();
+    for (; it != it_end; ++it)
+        cell_refs.push_back(shared_reference(this, range_t(*it, *it)));
+
+    range_refs.reserve(refs.ranges.size());
+    std::vector<range_t>::const_iterator it_range = refs.ranges.begin(), it_range_end = refs.ranges.end();
+    for (; it_range != it_range_end; ++it_range)
+        range_refs.push_back(shared_reference(this, *it_range));
+}
+
+shared_block::shared_block(const shared_block& r, const abs_range_t& _cells) :
+    identifier(r.identifier), cells(_cells)
+{
+    cell_refs.reserve(r.cell_refs.size());
+    std::vector<shared_reference>::const_iterator it = r.cell_refs.begin(), it_end = r.cell_refs.end();
+    for (; it != it_end; ++it)
+        cell_refs.push_back(shared_reference(this, it->ref));
+
+    range_refs.reserve(r.range_refs.size());
+    for (it = r.range_refs.begin(), it_end = r.range_refs.end(); it != it_end; ++it)
+        range_refs.push_back(shared_reference(this, it->ref));
+}
+
+bool shared_block::has_references(const cell_listener_tracker::shared_references_type& refs) const
+{
+    if (cell_refs.size() != refs.cells.size() || range_refs.size() != refs.ranges.size())
+        return false;
 
-    void operator() (const cell_listener_tracker::address_set_type* p)
+    for (size_t i = 0; i < cell_refs.size(); ++i)
     {
-        // Add all addresses in this set to the dirty cells list.
-        cell_listener_tracker::address_set_type::const_iterator itr = p->begin(), itr_end = p->end();
-        for (; itr != itr_end; ++itr)
-        {
-            const abs_address_t& addr = *itr;
-            if (m_context.get_celltype(addr) != celltype_t::formula)
-                continue;
+        if (cell_refs[i].ref.first != refs.cells[i])
+            return false;
+    }
 
-            // Formula cell exists at this address.
-            m_dirty_cells.insert(addr);
-            m_addrs.insert(addr);
-        }
+    for (size_t i = 0; i < range_refs.size(); ++i)
+    {
+        if (range_refs[i].ref != refs.ranges[i])
+            return false;
     }
-};
+
+    return true;
+}
+
+typedef mdds::rectangle_set<row_t, const shared_reference*> shared_query_set_type;
+typedef std::vector<shared_query_set_type*> sheet_shared_query_store_type;
+typedef std::map<std::pair<sheet_t, size_t>, std::vector<shared_block*> > shared_block_store_type;
+
+/**
+ * Get the lookup set for a sheet, creating one if it doesn't exist yet.
+ */
+template<typename _SetT>
+_SetT& get_query_set(std::vector<_SetT*>& sets, sheet_t sheet)
+{
+    if (size_t(sheet) >= sets.size())
+        sets.resize(sheet+1, NULL);
+
+    if (!sets[sheet])
+        sets[sheet] = new _SetT;
+
+    return *sets[sheet];
+}
+
+/**
+ * Get the span of one component of a reference over the span of the cells
+ * making the reference.
+ */
+template<typename _T>
+void get_reference_span(
+    bool abs_first, _T first, bool abs_last, _T last, _T lo, _T hi, _T& span_first, _T& span_last)
+{
+    span_first = abs_first ? first : lo + first;
+    span_last = abs_last ? last : hi + last;
+}
+
+/**
+ * Narrow down the span of the cells making a reference to those whose
+ * reference includes the target, in one component of the reference.
+ *
+ * @return true if any cells are left in the span, false otherwise.
+ */
+template<typename _T>
+bool narrow_reference_span(bool abs_first, _T first, bool abs_last, _T last, _T target, _T& lo, _T& hi)
+{
+    if (abs_first)
+    {
+        if (target < first)
+            return false;
+    }
+    else
+        hi = std::min(hi, target - first);
+
+    if (abs_last)
+    {
+        if (last < target)
+            return false;
+    }
+    else
+        lo = std::max(lo, target - last);
+
+    return lo <= hi;
+}
+
+/**
+ * Get the range of all cells referenced by the cells of a shared formula
+ * block through one reference.
+ *
+ * @return true if the reference covers any cell, false otherwise.
+ */
+bool get_referenced_range(const shared_reference& r, abs_range_t& range)
+{
+    const abs_range_t& cells = r.block->cells;
+    const range_t& ref = r.ref;
+    get_reference_span(
+        ref.first.abs_sheet, ref.first.sheet, ref.last.abs_sheet, ref.last.sheet,
+        cells.first.sheet, cells.last.sheet, range.first.sheet, range.last.sheet);
+    get_reference_span(
+        ref.first.abs_row, ref.first.row, ref.last.abs_row, ref.last.row,
+        cells.first.row, cells.last.row, range.first.row, range.last.row);
+    get_reference_span(
+        ref.first.abs_column, ref.first.column, ref.last.abs_column, ref.last.column,
+        cells.first.column, cells.last.column, range.first.column, range.last.column);
+
+    return range.first.sheet <= range.last.sheet && range.first.row <= range.last.row &&
+        range.first.column <= range.last.column;
+}
 
 }
 
@@ -64,80 +218,434 @@ struct cell_listener_tracker::impl
 
     iface::formula_model_access& m_context;
 
-    mutable range_query_set_type m_query_set; ///< used for fast lookup of range listeners.
+    /**
+     * Used for fast lookup of range listeners, with one lookup set for each
+     * sheet.  A range spanning multiple sheets is stored in the lookup sets
+     * of all the sheets it spans.  Each lookup set builds its search tree
+     * on the first search following any insertions, so the ranges inserted
+     * in bulk only get the tree built once.
+     */
+    mutable sheet_query_store_type m_query_sets;
     cell_store_type m_cell_listeners;         ///< store listeners for single cells.
     range_store_type m_range_listeners;       ///< store listeners for ranges.
+    precedent_store_type m_precedents;        ///< store references of each listener cell.
     cell_listener_tracker::address_set_type m_volatile_cells;
 
-    impl(iface::formula_model_access& cxt) : m_context(cxt) {}
+    /**
+     * Used for fast lookup of the shared formula blocks, by the ranges of
+     * cells referenced by each reference of the blocks.  Single cell and
+     * range references are kept apart.
+     */
+    mutable sheet_shared_query_store_type m_shared_cell_query_sets;
+    mutable sheet_shared_query_store_type m_shared_range_query_sets;
+
+    /**
+     * Whether the search trees of all the range lookups above have been
+     * built since their last modification.  As of mdds 1.2, a search of
+     * mdds::rectangle_set builds its segment trees in place when they have
+     * been invalidated by an insertion or a removal, and only reads them
+     * otherwise.  The trees are therefore built once, by searching every
+     * lookup under m_query_mtx, before any search that may run on multiple
+     * threads; the searches that follow don't take the lock.
+     */
+    mutable std::atomic<bool> m_query_trees_built;
+    mutable boost::mutex m_query_mtx;
+    shared_block_store_type m_shared_blocks;  ///< store blocks of each shared formula.
+
+    /**
+     * all listeners of each target cell looked up with the cache, the most
+     * recently looked up target first.  Any change to the references
+     * invalidates all of them.  Each entry holds a full copy of the
+     * listeners of its target, so the number of entries is capped by the
+     * caller.
+     */
+    mutable listener_cache_type m_listener_cache;
+    mutable listener_cache_map_type m_listener_cache_map;
+    mutable boost::mutex m_listener_cache_mtx;
+
+    impl(iface::formula_model_access& cxt) : m_context(cxt), m_query_trees_built(false) {}
 
     ~impl()
     {
-        // Delete all the listener set instances.
-        for_each(m_range_listeners.begin(), m_range_listeners.end(), delete_map_value<range_store_type>());
-        for_each(m_cell_listeners.begin(), m_cell_listeners.end(), delete_map_value<cell_store_type>());
+        for_each(m_query_sets.begin(), m_query_sets.end(), delete_element<range_query_set_type>());
+        for_each(m_shared_cell_query_sets.begin(), m_shared_cell_query_sets.end(), delete_element<shared_query_set_type>());
+        for_each(m_shared_range_query_sets.begin(), m_shared_range_query_sets.end(), delete_element<shared_query_set_type>());
+
+        shared_block_store_type::iterator it = m_shared_blocks.begin(), it_end = m_shared_blocks.end();
+        for (; it != it_end; ++it)
+            for_each(it->second.begin(), it->second.end(), delete_element<shared_block>());
+    }
+
+    void insert_range(const abs_range_t& range, listener_set* listeners);
+
+    void invalidate_query_trees()
+    {
+        m_query_trees_built.store(false, std::memory_order_release);
+    }
+
+    /**
+     * Build the search trees of all range lookups, unless they have been
+     * built since their last modification.
+     */
+    void build_query_trees() const;
+
+    void clear_cache()
+    {
+        boost::mutex::scoped_lock lock(m_listener_cache_mtx);
+        if (!m_listener_cache.empty())
+        {
+            m_listener_cache.clear();
+            m_listener_cache_map.clear();
+        }
     }
 
-    void get_all_range_listeners_re(
-        const abs_address_t& origin_target, const abs_address_t& target,
-        dirty_formula_cells_t& listeners, address_set_type& listeners_addr) const;
+    /**
+     * Get the listeners of a single cell, creating an empty container if
+     * it doesn't exist yet.
+     */
+    listener_set& get_cell_listeners(const abs_address_t& dest);
+
+    /**
+     * Get the listeners of a range, creating an empty container if it
+     * doesn't exist yet.  A new container also gets inserted into the range
+     * lookup.
+     */
+    listener_set& get_range_listeners(const abs_range_t& range);
+
+    void remove_range(const abs_range_t& range, listener_set* listeners);
+
+    template<typename _RefT>
+    void remove_precedent(const abs_address_t& cell, const _RefT& ref);
+
+    /**
+     * Insert all references of a shared formula block into the lookup.
+     */
+    void insert_shared_block(const shared_block& block);
+
+    void remove_shared_block(const shared_block& block);
+
+    void push_listener(
+        const abs_address_t& addr, abs_address_set& visited, std::vector<abs_address_t>& stack) const;
+
+    void push_listeners(
+        const listener_set& addrs, abs_address_set& visited, std::vector<abs_address_t>& stack) const;
+
+    void push_cell_listeners(
+        const abs_address_t& target, abs_address_set& visited, std::vector<abs_address_t>& stack) const;
+
+    void push_range_listeners(
+        const abs_address_t& target, abs_address_set& visited, std::vector<abs_address_t>& stack) const;
+
+    /**
+     * Push the cells of the shared formula blocks whose references include
+     * the target cell.
+     */
+    void push_shared_listeners(
+        const sheet_shared_query_store_type& query_sets, const abs_address_t& target,
+        abs_address_set& visited, std::vector<abs_address_t>& stack) const;
+
+    void get_all_listeners(
+        std::vector<abs_address_t>& stack, abs_address_set& visited, dirty_formula_cells_t& listeners) const;
+
+    /**
+     * Walk the listeners of the target cells, taking the targets in batches
+     * from the shared position until none is left.  This gets called from
+     * multiple threads at once, each with its own listeners.
+     */
+    void get_all_listeners(
+        const std::vector<abs_address_t>& targets, std::atomic<size_t>& next,
+        dirty_formula_cells_t& listeners) const;
 };
 
-void cell_listener_tracker::impl::get_all_range_listeners_re(
-    const abs_address_t& origin_target, const abs_address_t& target, dirty_formula_cells_t& listeners, address_set_type& listeners_addrs) const
+void cell_listener_tracker::impl::insert_range(const abs_range_t& range, listener_set* listeners)
 {
 #if DEBUG_CELL_LISTENER_TRACKER
-    __IXION_DEBUG_OUT__ << "--- begin: target address: " << m_context.get_name_resolver().get_name(target, false) << endl;
+    cout << "x1=" << range.first.column << ",y1=" << range.first.row
+        << ",x2=" << (range.last.column+1) << ",y2=" << (range.last.row+1) << ",p=" << listeners << endl;
 #endif
-    if (listeners_addrs.count(target))
+    invalidate_query_trees();
+    for (sheet_t sheet = std::max(range.first.sheet, 0); sheet <= range.last.sheet; ++sheet)
     {
-        // Target is included in the listener list.  No need to scan twice.
-#if DEBUG_CELL_LISTENER_TRACKER
-        __IXION_DEBUG_OUT__ << "listeners for this target has already been retrieved." << endl;
-#endif
-        return;
+        get_query_set(m_query_sets, sheet).insert(
+            range.first.column, range.first.row, range.last.column+1, range.last.row+1, listeners);
     }
+}
 
-    dirty_formula_cells_t new_listeners;
-    address_set_type new_listeners_addrs;
-    range_query_set_type::search_result res = m_query_set.search(target.column, target.row);
+listener_set& cell_listener_tracker::impl::get_cell_listeners(const abs_address_t& dest)
+{
+    return m_cell_listeners[dest];
+}
 
-#if DEBUG_CELL_LISTENER_TRACKER
-    __IXION_DEBUG_OUT__ << "query set count: " << m_query_set.size() << "  search result count: " << res.size() << endl;
-#endif
+listener_set& cell_listener_tracker::impl::get_range_listeners(const abs_range_t& range)
+{
+    range_store_type::iterator itr = m_range_listeners.find(range);
+    if (itr == m_range_listeners.end())
+    {
+        // No container for this range yet.  Create one, and insert it into
+        // the rectangle sets as well (for lookup).  The container stays at
+        // the same address until it gets erased from the map.
+        itr = m_range_listeners.insert(range_store_type::value_type(range, listener_set())).first;
+        insert_range(range, &itr->second);
+    }
+    return itr->second;
+}
 
-    std::for_each(
-        res.begin(), res.end(), dirty_cell_inserter(m_context, new_listeners, new_listeners_addrs));
-    assert(new_listeners.size() == new_listeners_addrs.size());
+void cell_listener_tracker::impl::remove_range(const abs_range_t& range, listener_set* listeners)
+{
+    invalidate_query_trees();
+    for (sheet_t sheet = std::max(range.first.sheet, 0); sheet <= range.last.sheet; ++sheet)
+    {
+        if (size_t(sheet) < m_query_sets.size() && m_query_sets[sheet])
+            m_query_sets[sheet]->remove(listeners);
+    }
+}
 
-#if DEBUG_CELL_LISTENER_TRACKER
-    __IXION_DEBUG_OUT__ << "new listener count: " << new_listeners.size() << endl;
-#endif
+namespace {
 
-    // Go through the new listeners and get their listeners as well.
-    address_set_type::const_iterator itr = new_listeners_addrs.begin(), itr_end = new_listeners_addrs.end();
-    for (; itr != itr_end; ++itr)
+std::vector<abs_address_t>& get_refs(cell_listener_tracker::precedents_type& precedents, const abs_address_t&)
+{
+    return precedents.cells;
+}
+
+std::vector<abs_range_t>& get_refs(cell_listener_tracker::precedents_type& precedents, const abs_range_t&)
+{
+    return precedents.ranges;
+}
+
+}
+
+template<typename _RefT>
+void cell_listener_tracker::impl::remove_precedent(const abs_address_t& cell, const _RefT& ref)
+{
+    precedent_store_type::iterator itr = m_precedents.find(cell);
+    if (itr == m_precedents.end())
+        return;
+
+    std::vector<_RefT>& refs = get_refs(itr->second, ref);
+    refs.erase(std::remove(refs.begin(), refs.end(), ref), refs.end());
+
+    if (itr->second.cells.empty() && itr->second.ranges.empty())
+        // This cell no longer references anything.
+        m_precedents.erase(itr);
+}
+
+namespace {
+
+void insert_shared_references(
+    sheet_shared_query_store_type& query_sets, const std::vector<shared_reference>& refs)
+{
+    std::vector<shared_reference>::const_iterator it = refs.begin(), it_end = refs.end();
+    for (; it != it_end; ++it)
     {
-        if (*itr == origin_target)
+        abs_range_t range;
+        if (!get_referenced_range(*it, range))
+            continue;
+
+        for (sheet_t sheet = std::max(range.first.sheet, 0); sheet <= range.last.sheet; ++sheet)
         {
-#if DEBUG_CELL_LISTENER_TRACKER
-         __IXION_DEBUG_OUT__ << "this equals origin target.  skipping." << endl;
-#endif
+            get_query_set(query_sets, sheet).insert(
+                range.first.column, range.first.row, range.last.column+1, range.last.row+1, &*it);
+        }
+    }
+}
+
+void remove_shared_references(
+    sheet_shared_query_store_type& query_sets, const std::vector<shared_reference>& refs)
+{
+    std::vector<shared_reference>::const_iterator it = refs.begin(), it_end = refs.end();
+    for (; it != it_end; ++it)
+    {
+        abs_range_t range;
+        if (!get_referenced_range(*it, range))
             continue;
+
+        for (sheet_t sheet = std::max(range.first.sheet, 0); sheet <= range.last.sheet; ++sheet)
+        {
+            if (size_t(sheet) < query_sets.size() && query_sets[sheet])
+                query_sets[sheet]->remove(&*it);
         }
-        get_all_range_listeners_re(origin_target, *itr, listeners, listeners_addrs);
     }
+}
+
+}
+
+void cell_listener_tracker::impl::insert_shared_block(const shared_block& block)
+{
+    invalidate_query_trees();
+    insert_shared_references(m_shared_cell_query_sets, block.cell_refs);
+    insert_shared_references(m_shared_range_query_sets, block.range_refs);
+}
+
+void cell_listener_tracker::impl::remove_shared_block(const shared_block& block)
+{
+    invalidate_query_trees();
+    remove_shared_references(m_shared_cell_query_sets, block.cell_refs);
+    remove_shared_references(m_shared_range_query_sets, block.range_refs);
+}
+
+void cell_listener_tracker::impl::push_listener(
+    const abs_address_t& addr, abs_address_set& visited, std::vector<abs_address_t>& stack) const
+{
+    if (m_context.get_celltype(addr) != celltype_t::formula)
+        // Referenced cell is empty or not a formula cell.  Ignore this.
+        return;
+
+    if (visited.insert(addr))
+        stack.push_back(addr);
+}
+
+void cell_listener_tracker::impl::push_listeners(
+    const listener_set& addrs, abs_address_set& visited, std::vector<abs_address_t>& stack) const
+{
+    listener_set::const_iterator itr = addrs.begin(), itr_end = addrs.end();
+    for (; itr != itr_end; ++itr)
+        push_listener(*itr, visited, stack);
+}
+
+void cell_listener_tracker::impl::push_cell_listeners(
+    const abs_address_t& target, abs_address_set& visited, std::vector<abs_address_t>& stack) const
+{
+    cell_store_type::const_iterator itr = m_cell_listeners.find(target);
+    if (itr != m_cell_listeners.end())
+        push_listeners(itr->second, visited, stack);
+
+    push_shared_listeners(m_shared_cell_query_sets, target, visited, stack);
+}
+
+void cell_listener_tracker::impl::push_range_listeners(
+    const abs_address_t& target, abs_address_set& visited, std::vector<abs_address_t>& stack) const
+{
+    push_shared_listeners(m_shared_range_query_sets, target, visited, stack);
+
+    if (target.sheet < 0 || size_t(target.sheet) >= m_query_sets.size() || !m_query_sets[target.sheet])
+        // No ranges on this sheet.
+        return;
+
+    build_query_trees();
+    range_query_set_type& query_set = *m_query_sets[target.sheet];
+    range_query_set_type::search_result res = query_set.search(target.column, target.row);
 
-    // Add new listeners to the caller's list.
-    listeners.insert(new_listeners.begin(), new_listeners.end());
-    listeners_addrs.insert(new_listeners_addrs.begin(), new_listeners_addrs.end());
 #if DEBUG_CELL_LISTENER_TRACKER
-    __IXION_DEBUG_OUT__ << "new listeners: ";
-    std::for_each(new_listeners_addrs.begin(), new_listeners_addrs.end(),
-                  cell_addr_printer(m_context.get_name_resolver()));
-    cout << endl;
-    __IXION_DEBUG_OUT__ << "--- end: target address: " << m_context.get_name_resolver().get_name(target, false) << endl;
+    __IXION_DEBUG_OUT__ << "query set count: " << query_set.size() << "  search result count: " << res.size() << endl;
 #endif
+
+    range_query_set_type::search_result::iterator itr = res.begin(), itr_end = res.end();
+    for (; itr != itr_end; ++itr)
+        push_listeners(**itr, visited, stack);
+}
+
+void cell_listener_tracker::impl::build_query_trees() const
+{
+    if (m_query_trees_built.load(std::memory_order_acquire))
+        return;
+
+    boost::mutex::scoped_lock lock(m_query_mtx);
+    if (m_query_trees_built.load(std::memory_order_relaxed))
+        // Another thread has built them in the meantime.
+        return;
+
+    sheet_query_store_type::const_iterator it = m_query_sets.begin(), it_end = m_query_sets.end();
+    for (; it != it_end; ++it)
+    {
+        if (*it)
+            (*it)->search(0, 0);
+    }
+
+    sheet_shared_query_store_type::const_iterator its = m_shared_cell_query_sets.begin();
+    for (; its != m_shared_cell_query_sets.end(); ++its)
+    {
+        if (*its)
+            (*its)->search(0, 0);
+    }
+
+    for (its = m_shared_range_query_sets.begin(); its != m_shared_range_query_sets.end(); ++its)
+    {
+        if (*its)
+            (*its)->search(0, 0);
+    }
+
+    m_query_trees_built.store(true, std::memory_order_release);
+}
+
+void cell_listener_tracker::impl::push_shared_listeners(
+    const sheet_shared_query_store_type& query_sets, const abs_address_t& target,
+    abs_address_set& visited, std::vector<abs_address_t>& stack) const
+{
+    if (target.sheet < 0 || size_t(target.sheet) >= query_sets.size() || !query_sets[target.sheet])
+        // No shared formula references on this sheet.
+        return;
+
+    build_query_trees();
+    shared_query_set_type::search_result res = query_sets[target.sheet]->search(target.column, target.row);
+    shared_query_set_type::search_result::const_iterator itr = res.begin(), itr_end = res.end();
+    for (; itr != itr_end; ++itr)
+    {
+        // Work out which cells of the block reference the target, one
+        // component at a time.
+        const abs_range_t& cells = (*itr)->block->cells;
+        const range_t& ref = (*itr)->ref;
+
+        sheet_t sheet_lo = cells.first.sheet, sheet_hi = cells.last.sheet;
+        if (!narrow_reference_span(
+            ref.first.abs_sheet, ref.first.sheet, ref.last.abs_sheet, ref.last.sheet, target.sheet, sheet_lo, sheet_hi))
+            continue;
+
+        row_t row_lo = cells.first.row, row_hi = cells.last.row;
+        if (!narrow_reference_span(
+            ref.first.abs_row, ref.first.row, ref.last.abs_row, ref.last.row, target.row, row_lo, row_hi))
+            continue;
+
+        col_t col_lo = cells.first.column, col_hi = cells.last.column;
+        if (!narrow_reference_span(
+            ref.first.abs_column, ref.first.column, ref.last.abs_column, ref.last.column, target.column, col_lo, col_hi))
+            continue;
+
+        for (sheet_t sheet = sheet_lo; sheet <= sheet_hi; ++sheet)
+            for (col_t col = col_lo; col <= col_hi; ++col)
+                for (row_t row = row_lo; row <= row_hi; ++row)
+                    push_listener(abs_address_t(sheet, row, col), visited, stack);
+    }
+}
+
+void cell_listener_tracker::impl::get_all_listeners(
+    std::vector<abs_address_t>& stack, abs_address_set& visited, dirty_formula_cells_t& listeners) const
+{
+    // Walk the listeners with an explicit stack rather than recursively, as
+    // a chain of listeners may be as long as the entire column.
+    while (!stack.empty())
+    {
+        abs_address_t addr = stack.back();
+        stack.pop_back();
+        listeners.insert(addr);
+        push_cell_listeners(addr, visited, stack);
+        push_range_listeners(addr, visited, stack);
+    }
+}
+
+void cell_listener_tracker::impl::get_all_listeners(
+    const std::vector<abs_address_t>& targets, std::atomic<size_t>& next,
+    dirty_formula_cells_t& listeners) const
+{
+    // Taking a batch of adjacent targets at a time keeps the cells walked
+    // by each thread close to one another.
+    const size_t batch_size = 256;
+
+    abs_address_set visited;
+    std::vector<abs_address_t> stack;
+    for (;;)
+    {
+        size_t begin = next.fetch_add(batch_size);
+        if (begin >= targets.size())
+            break;
+
+        size_t end = std::min(begin + batch_size, targets.size());
+        for (size_t i = begin; i < end; ++i)
+        {
+            push_range_listeners(targets[i], visited, stack);
+            push_cell_listeners(targets[i], visited, stack);
+            get_all_listeners(stack, visited, listeners);
+        }
+    }
 }
 
 cell_listener_tracker::cell_listener_tracker(iface::formula_model_access& cxt) :
@@ -155,17 +663,9 @@ void cell_listener_tracker::add(const abs_address_t& src, const abs_address_t& d
     __IXION_DEBUG_OUT__ << "adding - cell src: " << res.get_name(src, false)
         << "  cell dest: " << res.get_name(dest, false) << endl;
 #endif
-    cell_store_type::iterator itr = mp_impl->m_cell_listeners.find(dest);
-    if (itr == mp_impl->m_cell_listeners.end())
-    {
-        // No container for this src cell yet.  Create one.
-        pair<cell_store_type::iterator, bool> r =
-            mp_impl->m_cell_listeners.insert(cell_store_type::value_type(dest, new address_set_type));
-        if (!r.second)
-            throw general_error("failed to insert new address set to cell listener tracker.");
-        itr = r.first;
-    }
-    itr->second->insert(src);
+    mp_impl->clear_cache();
+    if (mp_impl->get_cell_listeners(dest).insert(src))
+        mp_impl->m_precedents[src].cells.push_back(dest);
 }
 
 void cell_listener_tracker::add(const abs_address_t& cell, const abs_range_t& range)
@@ -175,25 +675,78 @@ void cell_listener_tracker::add(const abs_address_t& cell, const abs_range_t& ra
     __IXION_DEBUG_OUT__ << "adding - cell: " << res.get_name(cell, false)
         << "  range: " << res.get_name(range, false) << endl;
 #endif
-    range_store_type::iterator itr = mp_impl->m_range_listeners.find(range);
-    if (itr == mp_impl->m_range_listeners.end())
+    mp_impl->clear_cache();
+    if (mp_impl->get_range_listeners(range).insert(cell))
+        mp_impl->m_precedents[cell].ranges.push_back(range);
+}
+
+namespace {
+
+int compare_address(const abs_address_t& left, const abs_address_t& right)
+{
+    if (left.sheet != right.sheet)
+        return left.sheet < right.sheet ? -1 : 1;
+    if (left.row != right.row)
+        return left.row < right.row ? -1 : 1;
+    if (left.column != right.column)
+        return left.column < right.column ? -1 : 1;
+    return 0;
+}
+
+int compare_address(const abs_range_t& left, const abs_range_t& right)
+{
+    int res = compare_address(left.first, right.first);
+    return res ? res : compare_address(left.last, right.last);
+}
+
+/**
+ * Order references by the cells or ranges being referenced first, then by
+ * the cells referencing them.
+ */
+template<typename _RefT>
+bool less_by_target(const std::pair<abs_address_t, _RefT>& left, const std::pair<abs_address_t, _RefT>& right)
+{
+    int res = compare_address(left.second, right.second);
+    return res ? res < 0 : compare_address(left.first, right.first) < 0;
+}
+
+}
+
+void cell_listener_tracker::add(
+    std::vector<cell_reference_type>& cell_refs, std::vector<range_reference_type>& range_refs)
+{
+    mp_impl->clear_cache();
+    std::sort(cell_refs.begin(), cell_refs.end(), less_by_target<abs_address_t>);
+    std::sort(range_refs.begin(), range_refs.end(), less_by_target<abs_range_t>);
+
+    mp_impl->m_cell_listeners.reserve(mp_impl->m_cell_listeners.size() + cell_refs.size());
+    mp_impl->m_precedents.reserve(mp_impl->m_precedents.size() + cell_refs.size() + range_refs.size());
+
+    // All references to the same cell are next to each other.
+    std::vector<cell_reference_type>::const_iterator it = cell_refs.begin(), it_end = cell_refs.end();
+    while (it != it_end)
     {
-        // No container for this range yet.  Create one.
-        pair<range_store_type::iterator, bool> r =
-            mp_impl->m_range_listeners.insert(range_store_type::value_type(range, new address_set_type));
-        if (!r.second)
-            throw general_error("failed to insert new address set to range listener tracker.");
-        itr = r.first;
+        abs_address_t dest = it->second;
+        listener_set& listeners = mp_impl->get_cell_listeners(dest);
+        for (; it != it_end && it->second == dest; ++it)
+        {
+            if (listeners.insert(it->first))
+                mp_impl->m_precedents[it->first].cells.push_back(dest);
+        }
+    }
 
-        // Insert the container to the rectangle set as well (for lookup).
-#if DEBUG_CELL_LISTENER_TRACKER
-        cout << "x1=" << range.first.column << ",y1=" << range.first.row
-            << ",x2=" << (range.last.column+1) << ",y2=" << (range.last.row+1) << ",p=" << itr->second << endl;
-#endif
-        mp_impl->m_query_set.insert(
-            range.first.column, range.first.row, range.last.column+1, range.last.row+1, itr->second);
+    // Likewise with the references to the same range.
+    std::vector<range_reference_type>::const_iterator it_range = range_refs.begin(), it_range_end = range_refs.end();
+    while (it_range != it_range_end)
+    {
+        abs_range_t range = it_range->second;
+        listener_set& listeners = mp_impl->get_range_listeners(range);
+        for (; it_range != it_range_end && it_range->second == range; ++it_range)
+        {
+            if (listeners.insert(it_range->first))
+                mp_impl->m_precedents[it_range->first].ranges.push_back(range);
+        }
     }
-    itr->second->insert(cell);
 }
 
 void cell_listener_tracker::remove(const abs_address_t& src, const abs_address_t& dest)
@@ -203,14 +756,14 @@ void cell_listener_tracker::remove(const abs_address_t& src, const abs_address_t
         // No listeners for this cell.  Bail out.
         return;
 
-    address_set_type* p = itr->second;
-    p->erase(src);
-    if (p->empty())
-    {
-        // This list is empty.  Remove it from the containers and destroy the instance.
+    mp_impl->clear_cache();
+    listener_set& listeners = itr->second;
+    if (listeners.erase(src))
+        mp_impl->remove_precedent(src, dest);
+
+    if (listeners.empty())
+        // This list is empty.  Remove it from the container.
         mp_impl->m_cell_listeners.erase(itr);
-        delete p;
-    }
 }
 
 void cell_listener_tracker::remove(const abs_address_t& cell, const abs_range_t& range)
@@ -224,17 +777,159 @@ void cell_listener_tracker::remove(const abs_address_t& cell, const abs_range_t&
         // No listeners for this range.  Bail out.
         return;
 
-    address_set_type* p = itr->second;
-    p->erase(cell);
-    if (p->empty())
+    mp_impl->clear_cache();
+    listener_set& listeners = itr->second;
+    if (listeners.erase(cell))
+        mp_impl->remove_precedent(cell, range);
+
+    if (listeners.empty())
     {
-        // This list is empty.  Remove it from the containers and destroy the instance.
+        // This list is empty.  Remove it from the containers.
+        mp_impl->remove_range(range, &listeners);
         mp_impl->m_range_listeners.erase(itr);
-        mp_impl->m_query_set.remove(p);
-        delete p;
     }
 }
 
+namespace {
+
+/**
+ * Check if a block can be extended to include the cells while staying
+ * rectangular.
+ *
+ * @return true if the block has been extended, false otherwise.
+ */
+bool extend_block(abs_range_t& block, const abs_range_t& cells)
+{
+    if (block.first.sheet != cells.first.sheet)
+        return false;
+
+    if (block.first.column == cells.first.column && block.last.column == cells.last.column)
+    {
+        if (block.last.row + 1 == cells.first.row)
+        {
+            block.last.row = cells.last.row;
+            return true;
+        }
+
+        if (cells.last.row + 1 == block.first.row)
+        {
+            block.first.row = cells.first.row;
+            return true;
+        }
+    }
+
+    if (block.first.row == cells.first.row && block.last.row == cells.last.row)
+    {
+        if (block.last.column + 1 == cells.first.column)
+        {
+            block.last.column = cells.last.column;
+            return true;
+        }
+
+        if (cells.last.column + 1 == block.first.column)
+        {
+            block.first.column = cells.first.column;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool contains(const abs_range_t& outer, const abs_range_t& inner)
+{
+    return outer.contains(inner.first) && outer.contains(inner.last);
+}
+
+}
+
+void cell_listener_tracker::add_shared(const abs_range_t& cells, size_t identifier, const shared_references_type& refs)
+{
+    assert(cells.first.sheet == cells.last.sheet);
+    mp_impl->clear_cache();
+
+    std::vector<shared_block*>& blocks =
+        mp_impl->m_shared_blocks[shared_block_store_type::key_type(cells.first.sheet, identifier)];
+
+    // Blocks get extended mostly at their ends, so start from the last one.
+    std::vector<shared_block*>::reverse_iterator it = blocks.rbegin(), it_end = blocks.rend();
+    for (; it != it_end; ++it)
+    {
+        shared_block& block = **it;
+        if (!block.has_references(refs))
+            continue;
+
+        if (contains(block.cells, cells))
+            // Already added.
+            return;
+
+        abs_range_t extended = block.cells;
+        if (extend_block(extended, cells))
+        {
+            mp_impl->remove_shared_block(block);
+            block.cells = extended;
+            mp_impl->insert_shared_block(block);
+            return;
+        }
+    }
+
+    blocks.push_back(new shared_block(cells, identifier, refs));
+    mp_impl->insert_shared_block(*blocks.back());
+}
+
+void cell_listener_tracker::remove_shared(const abs_address_t& cell, size_t identifier)
+{
+    shared_block_store_type::iterator itr =
+        mp_impl->m_shared_blocks.find(shared_block_store_type::key_type(cell.sheet, identifier));
+    if (itr == mp_impl->m_shared_blocks.end())
+        // No blocks for this shared formula.  Bail out.
+        return;
+
+    mp_impl->clear_cache();
+    std::vector<shared_block*>& blocks = itr->second;
+    std::vector<shared_block*> remaining;
+    remaining.reserve(blocks.size() + 3);
+    std::vector<shared_block*>::iterator it = blocks.begin(), it_end = blocks.end();
+    for (; it != it_end; ++it)
+    {
+        shared_block* block = *it;
+        if (!block->cells.contains(cell))
+        {
+            remaining.push_back(block);
+            continue;
+        }
+
+        // Split the block into the parts above and below the row of the
+        // cell, and the parts to the left and right of the cell.
+        abs_range_t parts[4];
+        parts[0] = parts[1] = parts[2] = parts[3] = block->cells;
+        parts[0].last.row = cell.row - 1;
+        parts[1].first.row = cell.row + 1;
+        parts[2].first.row = parts[2].last.row = cell.row;
+        parts[2].last.column = cell.column - 1;
+        parts[3].first.row = parts[3].last.row = cell.row;
+        parts[3].first.column = cell.column + 1;
+
+        mp_impl->remove_shared_block(*block);
+        for (size_t i = 0; i < 4; ++i)
+        {
+            if (parts[i].first.row > parts[i].last.row || parts[i].first.column > parts[i].last.column)
+                // Empty part.
+                continue;
+
+            remaining.push_back(new shared_block(*block, parts[i]));
+            mp_impl->insert_shared_block(*remaining.back());
+        }
+
+        delete block;
+    }
+
+    blocks.swap(remaining);
+
+    if (blocks.empty())
+        mp_impl->m_shared_blocks.erase(itr);
+}
+
 void cell_listener_tracker::add_volatile(const abs_address_t& pos)
 {
     mp_impl->m_volatile_cells.insert(pos);
@@ -250,21 +945,70 @@ const cell_listener_tracker::address_set_type& cell_listener_tracker::get_volati
     return mp_impl->m_volatile_cells;
 }
 
+const cell_listener_tracker::precedents_type* cell_listener_tracker::get_precedents(const abs_address_t& cell) const
+{
+    precedent_store_type::const_iterator itr = mp_impl->m_precedents.find(cell);
+    if (itr == mp_impl->m_precedents.end())
+        return NULL;
+
+    return &itr->second;
+}
+
 namespace {
 
-class cell_addr_printer : public std::unary_function<abs_address_t, void>
+/**
+ * Estimate the memory used by a node-based hash container, excluding the
+ * memory allocated by its elements.  Each node stores a pointer to the next
+ * node and the hash value along with the element.
+ */
+template<typename _StoreT>
+size_t get_store_size(const _StoreT& store)
 {
-    const formula_name_resolver& m_resolver;
-public:
-    cell_addr_printer(const formula_name_resolver& resolver) : m_resolver(resolver) {}
-    void operator() (const abs_address_t& addr) const
+    return store.bucket_count() * sizeof(void*) +
+        store.size() * (sizeof(typename _StoreT::value_type) + sizeof(void*) + sizeof(size_t));
+}
+
+}
+
+size_t cell_listener_tracker::get_memory_size() const
+{
+    size_t size = sizeof(impl);
+
+    size += get_store_size(mp_impl->m_cell_listeners);
+    cell_store_type::const_iterator it_cell = mp_impl->m_cell_listeners.begin(), it_cell_end = mp_impl->m_cell_listeners.end();
+    for (; it_cell != it_cell_end; ++it_cell)
+        size += it_cell->second.get_heap_size();
+
+    size += get_store_size(mp_impl->m_range_listeners);
+    range_store_type::const_iterator it_range = mp_impl->m_range_listeners.begin(), it_range_end = mp_impl->m_range_listeners.end();
+    for (; it_range != it_range_end; ++it_range)
+        size += it_range->second.get_heap_size();
+
+    size += get_store_size(mp_impl->m_precedents);
+    precedent_store_type::const_iterator it_prec = mp_impl->m_precedents.begin(), it_prec_end = mp_impl->m_precedents.end();
+    for (; it_prec != it_prec_end; ++it_prec)
     {
-        address_t pos_display(addr);
-        pos_display.set_absolute(false);
-        cout << m_resolver.get_name(pos_display, abs_address_t(), false) << " ";
+        size += it_prec->second.cells.capacity() * sizeof(abs_address_t);
+        size += it_prec->second.ranges.capacity() * sizeof(abs_range_t);
+    }
+
+    shared_block_store_type::const_iterator it_shared = mp_impl->m_shared_blocks.begin(), it_shared_end = mp_impl->m_shared_blocks.end();
+    for (; it_shared != it_shared_end; ++it_shared)
+    {
+        // Each node of the map stores three pointers and a color.
+        size += sizeof(shared_block_store_type::value_type) + sizeof(void*) * 4;
+        const std::vector<shared_block*>& blocks = it_shared->second;
+        size += blocks.capacity() * sizeof(shared_block*);
+        std::vector<shared_block*>::const_iterator it = blocks.begin(), it_end = blocks.end();
+        for (; it != it_end; ++it)
+        {
+            size += sizeof(shared_block);
+            size += ((*it)->cell_refs.capacity() + (*it)->range_refs.capacity()) * sizeof(shared_reference);
+        }
     }
-};
 
+    size += get_store_size(mp_impl->m_volatile_cells);
+    return size;
 }
 
 void cell_listener_tracker::get_all_cell_listeners(
@@ -274,40 +1018,125 @@ void cell_listener_tracker::get_all_cell_listeners(
     const formula_name_resolver& res = mp_impl->m_context.get_name_resolver();
     __IXION_DEBUG_OUT__ << "target cell: " << res.get_name(target, false) << endl;
 #endif
-    cell_store_type::const_iterator itr = mp_impl->m_cell_listeners.find(target);
-    if (itr == mp_impl->m_cell_listeners.end())
-        // This target cell has no listeners.
+    abs_address_set visited;
+    std::vector<abs_address_t> stack;
+    mp_impl->push_cell_listeners(target, visited, stack);
+    mp_impl->get_all_listeners(stack, visited, listeners);
+}
+
+void cell_listener_tracker::get_all_range_listeners(
+    const abs_address_t& target, dirty_formula_cells_t& listeners) const
+{
+#if DEBUG_CELL_LISTENER_TRACKER
+    __IXION_DEBUG_OUT__ << get_formula_result_output_separator() << endl;
+    __IXION_DEBUG_OUT__ << "get all range listeners for target " << mp_impl->m_context.get_name_resolver().get_name(target, false) << endl;
+#endif
+    abs_address_set visited;
+    std::vector<abs_address_t> stack;
+    mp_impl->push_range_listeners(target, visited, stack);
+    mp_impl->get_all_listeners(stack, visited, listeners);
+}
+
+void cell_listener_tracker::get_direct_listeners(
+    const abs_address_t& target, std::vector<abs_address_t>& listeners) const
+{
+    abs_address_set visited;
+    mp_impl->push_cell_listeners(target, visited, listeners);
+    mp_impl->push_range_listeners(target, visited, listeners);
+}
+
+void cell_listener_tracker::get_all_listeners(
+    const std::vector<abs_address_t>& targets, dirty_formula_cells_t& listeners, size_t thread_count) const
+{
+    if (thread_count > 1 && targets.size() > 1)
+    {
+        mp_impl->build_query_trees();
+
+        // Each thread collects the listeners into its own set, with its own
+        // set of visited cells.  The sets get merged once all threads finish.
+        thread_count = std::min(thread_count, targets.size());
+        std::vector<dirty_formula_cells_t> thread_listeners(thread_count);
+        std::atomic<size_t> next(0);
+        boost::thread_group threads;
+        for (size_t i = 1; i < thread_count; ++i)
+        {
+            dirty_formula_cells_t* p = &thread_listeners[i];
+            threads.create_thread([this, &targets, &next, p]() { mp_impl->get_all_listeners(targets, next, *p); });
+        }
+
+        mp_impl->get_all_listeners(targets, next, thread_listeners[0]);
+        threads.join_all();
+
+        for (size_t i = 0; i < thread_count; ++i)
+            listeners.insert(thread_listeners[i]);
+
         return;
+    }
 
-    const address_set_type& addrs = *itr->second;
-    address_set_type::const_iterator itr2 = addrs.begin(), itr2_end = addrs.end();
-    for (; itr2 != itr2_end; ++itr2)
+    abs_address_set visited;
+    std::vector<abs_address_t> stack;
+    std::vector<abs_address_t>::const_iterator it = targets.begin(), it_end = targets.end();
+    for (; it != it_end; ++it)
+    {
+        mp_impl->push_range_listeners(*it, visited, stack);
+        mp_impl->push_cell_listeners(*it, visited, stack);
+        mp_impl->get_all_listeners(stack, visited, listeners);
+    }
+}
+
+void cell_listener_tracker::get_all_cached_listeners(
+    const std::vector<abs_address_t>& targets, dirty_formula_cells_t& listeners,
+    size_t max_targets) const
+{
+    std::vector<abs_address_t> stack;
+    std::vector<abs_address_t>::const_iterator it = targets.begin(), it_end = targets.end();
+    for (; it != it_end; ++it)
     {
-        const abs_address_t& addr = *itr2; // listener cell address
-        if (mp_impl->m_context.get_celltype(addr) != celltype_t::formula)
-            // Referenced cell is empty or not a formula cell.  Ignore this.
+        {
+            boost::mutex::scoped_lock lock(mp_impl->m_listener_cache_mtx);
+            listener_cache_map_type::iterator itr = mp_impl->m_listener_cache_map.find(*it);
+            if (itr != mp_impl->m_listener_cache_map.end())
+            {
+                // Move it to the front as the most recently used.
+                listener_cache_type& cache = mp_impl->m_listener_cache;
+                cache.splice(cache.begin(), cache, itr->second);
+                listeners.insert(itr->second->second);
+                continue;
+            }
+        }
+
+        // Not cached yet.  Walk the listeners of this target on its own,
+        // without holding the lock.
+        abs_address_set visited, target_listeners;
+        mp_impl->push_range_listeners(*it, visited, stack);
+        mp_impl->push_cell_listeners(*it, visited, stack);
+        mp_impl->get_all_listeners(stack, visited, target_listeners);
+        listeners.insert(target_listeners);
+
+        if (!max_targets)
+            continue;
+
+        boost::mutex::scoped_lock lock(mp_impl->m_listener_cache_mtx);
+        if (mp_impl->m_listener_cache_map.count(*it))
+            // Another thread has cached it in the meantime.
             continue;
 
-        if (listeners.count(addr) == 0)
+        listener_cache_type& cache = mp_impl->m_listener_cache;
+        while (cache.size() >= max_targets)
         {
-            // This cell is not yet on the dirty cell list.  Run recursively.
-            listeners.insert(addr);
-            get_all_cell_listeners(addr, listeners);
-            get_all_range_listeners(addr, listeners);
+            mp_impl->m_listener_cache_map.erase(cache.back().first);
+            cache.pop_back();
         }
+
+        cache.emplace_front(*it, std::move(target_listeners));
+        mp_impl->m_listener_cache_map.insert(listener_cache_map_type::value_type(*it, cache.begin()));
     }
 }
 
-void cell_listener_tracker::get_all_range_listeners(
-    const abs_address_t& target, dirty_formula_cells_t& listeners) const
+size_t cell_listener_tracker::get_cached_target_count() const
 {
-#if DEBUG_CELL_LISTENER_TRACKER
-    __IXION_DEBUG_OUT__ << get_formula_result_output_separator() << endl;
-    __IXION_DEBUG_OUT__ << "get all range listeners for target " << mp_impl->m_context.get_name_resolver().get_name(target, false) << endl;
-#endif
-
-    address_set_type listeners_addrs; // to keep track of circular references.
-    mp_impl->get_all_range_listeners_re(target, target, listeners, listeners_addrs);
+    boost::mutex::scoped_lock lock(mp_impl->m_listener_cache_mtx);
+    return mp_impl->m_listener_cache_map.size();
 }
 
 void cell_listener_tracker::print_cell_listeners(
@@ -325,8 +1154,8 @@ void cell_listener_tracker::print_cell_listeners(
         // No one listens to this target.
         return;
 
-    const address_set_type& addrs = *itr->second;
-    address_set_type::const_iterator itr2 = addrs.begin(), itr2_end = addrs.end();
+    const listener_set& addrs = itr->second;
+    listener_set::const_iterator itr2 = addrs.begin(), itr2_end = addrs.end();
     for (; itr2 != itr2_end; ++itr2)
     {
         address_t pos_display(*itr2);
@@ -7,15 +7,34 @@
 
 #include "ixion/cell_queue_manager.hpp"
 #include "ixion/cell.hpp"
+#include "ixion/config.hpp"
+#include "ixion/formula_result.hpp"
+#include "ixion/table.hpp"
 
 #include "ixion/interface/formula_model_access.hpp"
+#include "ixion/interface/session_handler.hpp"
+
+#include "cell_tasks.hpp"
+#include "early_cutoff.hpp"
+#include "formula_functions.hpp"
 
 #include <boost/thread.hpp>
 #include <boost/thread/mutex.hpp>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdint>
+#include <exception>
+#include <functional>
 #include <iostream>
-#include <queue>
+#include <iterator>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -25,7 +44,6 @@ using ::std::string;
 using ::std::cout;
 using ::std::endl;
 using ::std::ostringstream;
-using ::std::queue;
 using ::boost::mutex;
 using ::boost::thread;
 using ::boost::condition_variable;
@@ -82,304 +100,1006 @@ namespace ixion {
 namespace {
 
 /**
- * Data for each worker thread.
+ * Get the CPUs that the calling process is allowed to run on.
+ *
+ * @return list of CPU numbers, or an empty list if the platform doesn't
+ *         support CPU affinity.
  */
-struct worker_thread_data
+std::vector<size_t> get_available_cpus()
 {
-    struct init_status_data
+    std::vector<size_t> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (!sched_getaffinity(0, sizeof(set), &set))
     {
-        mutex mtx;
-        condition_variable cond;
-        bool ready;
+        for (size_t i = 0; i < CPU_SETSIZE; ++i)
+        {
+            if (CPU_ISSET(i, &set))
+                cpus.push_back(i);
+        }
+    }
+#endif
+    return cpus;
+}
 
-        init_status_data() : ready(false) {}
-    };
+/**
+ * Pin the calling thread to a single CPU.  This is a no-op on platforms
+ * that don't support CPU affinity.
+ */
+void pin_current_thread(size_t cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpu;
+#endif
+}
+
+/**
+ * Queue of tasks ready to run, organized as a heap so that the task with
+ * the highest priority comes out first.
+ */
+struct worker_queue
+{
+    mutex mtx;
+    std::vector<size_t> tasks;
+};
+
+typedef std::vector<std::unique_ptr<worker_queue>> worker_queues_type;
+
+/**
+ * Scheduler state shared among all worker threads for the duration of a
+ * single run.
+ *
+ * <p>Each task consists of either a single cell, or a run of cells in
+ * consecutive rows of one column that share the same formula tokens and
+ * have the same dependency level.  Since cells of the same level never
+ * depend on each other, the cells in a run can be interpreted in one go,
+ * and the tasks themselves never form a cycle.</p>
+ *
+ * <p>Among the tasks ready to run, the ones on the longest remaining path
+ * of dependencies run first.  The length of a path is estimated from the
+ * time it took to interpret each cell in the previous calculation.</p>
+ *
+ * <p>With column locality enabled, each task has a home worker determined
+ * by the region of the column its cells belong to, and always gets queued
+ * to that worker.  The regions are assigned to the workers in contiguous
+ * ranges, so that neighboring columns also tend to share workers.  Without
+ * it, a task gets queued to the worker that released it.</p>
+ */
+class cell_scheduler
+{
+    iface::formula_model_access& m_context;
+    const cell_dependency_graph& m_graph;
+    calc_status* mp_status;
+
+    worker_queues_type m_queues;
+
+    /**
+     * positions of the first cell of each task, plus the end.  The cells of
+     * each task are contiguous in the cell array.
+     */
+    std::vector<size_t> m_task_offsets;
+
+    /** task that each cell belongs to. */
+    std::vector<size_t> m_cell_tasks;
+
+    /** home worker of each task.  Empty unless column locality is enabled. */
+    std::vector<size_t> m_task_homes;
+
+    /**
+     * estimated time to finish all cells that depend on each task, including
+     * the task itself.
+     */
+    std::vector<uint64_t> m_task_priorities;
+
+    /** number of precedent cells not yet interpreted, for each task. */
+    std::unique_ptr<std::atomic<size_t>[]> m_waiting;
+
+    /** number of tasks not yet finished. */
+    std::atomic<size_t> m_remaining;
+
+    /** number of tasks currently sitting in the worker queues. */
+    std::atomic<size_t> m_queued;
+
+    /** number of workers currently waiting for tasks to become available. */
+    std::atomic<size_t> m_idle;
+
+    /** set when the run gets aborted due to an error or a cancellation. */
+    std::atomic<bool> m_stopped;
+
+    mutex m_mtx_idle;
+    condition_variable m_cond_idle;
 
-    struct action_data
+    mutex m_mtx_error;
+    std::exception_ptr m_error;
+
+public:
+    cell_scheduler(
+        size_t worker_count, iface::formula_model_access& cxt, const cell_dependency_graph& graph,
+        calc_status* status) :
+        m_context(cxt),
+        m_graph(graph),
+        mp_status(status),
+        m_remaining(0),
+        m_queued(0),
+        m_idle(0),
+        m_stopped(false)
     {
-        mutex mtx;
-        condition_variable cond;
-        abs_address_t fcell;
-        formula_cell* cell;
-        bool cell_active;
-        bool terminate_requested;
+        assert(worker_count > 0);
+        for (size_t i = 0; i < worker_count; ++i)
+            m_queues.push_back(make_unique<worker_queue>());
+
+        std::vector<uint64_t> costs;
+        build_cell_tasks(m_context, m_graph, m_task_offsets, m_cell_tasks, &costs);
+        build_priorities(costs);
+        if (worker_count > 1 && m_context.get_config().column_locality)
+            assign_task_homes(m_graph, m_task_offsets, worker_count, m_task_homes);
+
+        size_t task_count = m_task_offsets.size() - 1;
+        std::vector<size_t> waiting(task_count, 0);
+        for (size_t i = 0, n = m_graph.cells.size(); i < n; ++i)
+            waiting[m_cell_tasks[i]] += m_graph.precedent_counts[i];
+
+        m_waiting.reset(new std::atomic<size_t>[task_count]);
+        std::vector<size_t> ready;
+        for (size_t i = 0; i < task_count; ++i)
+        {
+            m_waiting[i].store(waiting[i], std::memory_order_relaxed);
+            if (!waiting[i])
+                ready.push_back(i);
+        }
+
+        // Hand out the initially ready tasks in contiguous chunks, to keep
+        // neighboring cells on the same worker.
+        for (size_t i = 0, n = ready.size(); i < n; ++i)
+        {
+            size_t worker = m_task_homes.empty() ? i * worker_count / n : m_task_homes[ready[i]];
+            m_queues[worker]->tasks.push_back(ready[i]);
+        }
+
+        for (auto& q : m_queues)
+            std::make_heap(q->tasks.begin(), q->tasks.end(), task_less(m_task_priorities));
+
+        m_remaining = task_count;
+        m_queued = ready.size();
+    }
+
+    void run_worker(size_t worker_id)
+    {
+        stack_printer __stack_printer__("cell_scheduler::run_worker");
+        try
+        {
+            size_t task = 0;
+            while (next_task(worker_id, task))
+            {
+                for (size_t i = m_task_offsets[task]; i < m_task_offsets[task+1]; ++i)
+                {
+                    if (mp_status && mp_status->cancelled)
+                    {
+                        stop();
+                        return;
+                    }
+
+                    if (m_graph.cutoff)
+                        m_graph.cutoff->interpret(m_graph, i, m_context, m_context.get_session_handler());
+                    else
+                    {
+                        const abs_address_t& addr = m_graph.cells[i];
+                        formula_cell* p = m_context.get_formula_cell(addr);
+                        p->interpret(m_context, addr);
+                    }
+
+                    if (mp_status)
+                        ++mp_status->calculated_count;
+                }
+                finish_task(worker_id, task);
+            }
+        }
+        catch (...)
+        {
+            abort(std::current_exception());
+        }
+    }
 
-        action_data() : cell(NULL), cell_active(false), terminate_requested(false) {}
+    /**
+     * Rethrow the first exception thrown from any of the worker threads, if
+     * any.
+     */
+    void rethrow_error()
+    {
+        if (m_error)
+            std::rethrow_exception(m_error);
+    }
+
+private:
+    /**
+     * Compare two tasks by their priorities.
+     */
+    class task_less
+    {
+        const std::vector<uint64_t>& m_priorities;
+    public:
+        task_less(const std::vector<uint64_t>& priorities) : m_priorities(priorities) {}
+
+        bool operator() (size_t left, size_t right) const
+        {
+            return m_priorities[left] < m_priorities[right];
+        }
     };
 
-    thread thr_main;
+    /**
+     * Compute the priority of each task from the cell costs.  The priority
+     * of a cell is its own cost plus the highest priority among its
+     * dependent cells.  Cells with unknown costs are assumed to cost as much
+     * as the average cell.
+     */
+    void build_priorities(std::vector<uint64_t>& costs)
+    {
+        uint64_t known_total = 0;
+        size_t known_count = 0;
+        for (uint64_t cost : costs)
+        {
+            if (cost)
+            {
+                known_total += cost;
+                ++known_count;
+            }
+        }
 
-    init_status_data init_status;
-    action_data action;
+        uint64_t default_cost = known_count ? known_total / known_count : 1;
 
-    worker_thread_data() {}
-};
+        // Visit the cells in reverse order of dependency, so that all
+        // dependent cells are visited before their precedent cells.  The cost
+        // array gets overwritten with the cell priorities.
+        for (size_t i = costs.size(); i-- > 0; )
+        {
+            uint64_t highest = 0;
+            for (size_t j = m_graph.dependent_offsets[i]; j < m_graph.dependent_offsets[i+1]; ++j)
+                highest = std::max(highest, costs[m_graph.dependents[j]]);
 
-typedef std::vector<std::unique_ptr<worker_thread_data>> worker_threads_type;
+            costs[i] = (costs[i] ? costs[i] : default_cost) + highest;
+        }
 
-/**
- * This structure keeps track of idle worker threads.
- */
-struct worker_thread_status
-{
-    mutex mtx;
-    condition_variable cond;
-    queue<worker_thread_data*> idle_wts;
-    worker_thread_status() {}
+        m_task_priorities.assign(m_task_offsets.size() - 1, 0);
+        for (size_t i = 0, n = costs.size(); i < n; ++i)
+        {
+            uint64_t& priority = m_task_priorities[m_cell_tasks[i]];
+            priority = std::max(priority, costs[i]);
+        }
+    }
 
-    void reset()
+    /**
+     * Fetch the next task to run, blocking until one becomes available.
+     *
+     * @return true if a task has been fetched, or false if there are no more
+     *         tasks left to run.
+     */
+    bool next_task(size_t worker_id, size_t& task)
     {
-        while (!idle_wts.empty())
-            idle_wts.pop();
+        while (true)
+        {
+            if (m_stopped)
+                return false;
+
+            if (pop_local(worker_id, task) || steal(worker_id, task))
+                return true;
+
+            mutex::scoped_lock lock(m_mtx_idle);
+            ++m_idle;
+            while (!m_queued && m_remaining && !m_stopped)
+                m_cond_idle.wait(lock);
+            --m_idle;
+
+            if (!m_remaining || m_stopped)
+                return false;
+        }
     }
-};
 
-worker_thread_status wts;
+    bool pop_local(size_t worker_id, size_t& task)
+    {
+        return pop(*m_queues[worker_id], task);
+    }
 
-/**
- * Main worker thread routine.
- */
-void worker_main(worker_thread_data* data, iface::formula_model_access* context)
-{
-    stack_printer __stack_printer__("manage_queue::worker_main");
-    mutex::scoped_lock lock_cell(data->action.mtx);
+    bool steal(size_t worker_id, size_t& task)
     {
-        mutex::scoped_lock lock_ready(data->init_status.mtx);
-        data->init_status.ready = true;
-        data->init_status.cond.notify_all();
+        size_t n = m_queues.size();
+        for (size_t i = 1; i < n; ++i)
+        {
+            if (pop(*m_queues[(worker_id + i) % n], task))
+                return true;
+        }
+        return false;
     }
 
-    tprintf("worker ready");
+    /**
+     * Pop the task with the highest priority from a queue.
+     */
+    bool pop(worker_queue& q, size_t& task)
+    {
+        mutex::scoped_lock lock(q.mtx);
+        if (q.tasks.empty())
+            return false;
+
+        std::pop_heap(q.tasks.begin(), q.tasks.end(), task_less(m_task_priorities));
+        task = q.tasks.back();
+        q.tasks.pop_back();
+        --m_queued;
+        return true;
+    }
 
-    while (!data->action.terminate_requested)
+    /**
+     * Mark a task as finished, and queue all tasks that no longer wait for
+     * any other precedent cells.
+     */
+    void finish_task(size_t worker_id, size_t task)
     {
-        tprintf("worker waits...");
+        size_t released = 0;
+        for (size_t i = m_task_offsets[task]; i < m_task_offsets[task+1]; ++i)
         {
-            // Register itself as an idle thread.
-            mutex::scoped_lock lock_wts(wts.mtx);
-            wts.idle_wts.push(data);
-            wts.cond.notify_all();
+            const size_t* p = m_graph.dependents.data() + m_graph.dependent_offsets[i];
+            const size_t* p_end = m_graph.dependents.data() + m_graph.dependent_offsets[i+1];
+            for (; p != p_end; ++p)
+            {
+                size_t dep_task = m_cell_tasks[*p];
+                if (m_waiting[dep_task].fetch_sub(1) != 1)
+                    continue;
+
+                worker_queue& q = *m_queues[m_task_homes.empty() ? worker_id : m_task_homes[dep_task]];
+                mutex::scoped_lock lock(q.mtx);
+                q.tasks.push_back(dep_task);
+                std::push_heap(q.tasks.begin(), q.tasks.end(), task_less(m_task_priorities));
+                ++m_queued;
+                ++released;
+            }
         }
-        data->action.cond.wait(lock_cell);
 
-        if (!data->action.cell_active)
-            continue;
+        if (released && m_idle)
+        {
+            mutex::scoped_lock lock(m_mtx_idle);
+            m_cond_idle.notify_all();
+        }
 
-        formula_cell* p = context->get_formula_cell(data->action.fcell);
-        p->interpret(*context, data->action.fcell);
-        data->action.cell_active = false;
+        if (m_remaining.fetch_sub(1) == 1)
+        {
+            // This was the last task.  Wake up all idle workers so that they
+            // can exit.
+            mutex::scoped_lock lock(m_mtx_idle);
+            m_cond_idle.notify_all();
+        }
     }
-}
 
-enum manage_queue_action_t
-{
-    qm_no_action,
-    qm_cell_added_to_queue,
-    qm_terminate_requested
+    void abort(std::exception_ptr e)
+    {
+        {
+            mutex::scoped_lock lock(m_mtx_error);
+            if (!m_error)
+                m_error = e;
+        }
+
+        stop();
+    }
+
+    /**
+     * Stop running any more tasks, and release all waiting workers.
+     */
+    void stop()
+    {
+        mutex::scoped_lock lock(m_mtx_idle);
+        m_stopped = true;
+        m_cond_idle.notify_all();
+    }
 };
 
-struct manage_queue_data
+/**
+ * Session handler that records all session events, so that they can be
+ * reported to the real session handler later.  Each event is tagged with
+ * the position of the cell that was being interpreted at the time.
+ */
+class session_recorder : public iface::session_handler
 {
-    // thread ready
+public:
+    typedef std::function<void(iface::session_handler&)> call_type;
 
-    mutex mtx_thread_ready;
-    worker_threads_type workers;
-    condition_variable cond_thread_ready;
-    bool thread_ready;
+    struct event
+    {
+        size_t position;
+        call_type call;
 
-    // queue status
+        event(size_t _position, const call_type& _call) :
+            position(_position), call(_call) {}
+    };
 
-    mutex mtx_queue;
-    condition_variable cond_queue;
-    queue<abs_address_t> cells;
-    manage_queue_action_t action;
+    typedef std::vector<event> events_type;
 
-    manage_queue_data() :
-        thread_ready(false),
-        action(qm_no_action) {}
+private:
+    events_type m_events;
+    size_t m_position;
 
-    void reset()
+    void record(const call_type& call)
     {
-        thread_ready = false;
-        action = qm_no_action;
-        while (!cells.empty())
-            cells.pop();
+        m_events.push_back(event(m_position, call));
     }
-};
 
-manage_queue_data data;
+public:
+    session_recorder() : m_position(0) {}
 
-void init_workers(size_t worker_count, iface::formula_model_access* context)
-{
-    // Create specified number of worker threads.
-    for (size_t i = 0; i < worker_count; ++i)
+    /**
+     * Set the position of the cell whose events are to be recorded next.
+     */
+    void set_position(size_t pos)
     {
-        data.workers.push_back(make_unique<worker_thread_data>());
-        worker_thread_data& wt = *data.workers.back();
-        wt.thr_main = thread(::boost::bind(worker_main, &wt, context));
+        m_position = pos;
     }
 
-    // Wait until the worker threads become ready.
-    worker_threads_type::iterator itr = data.workers.begin(), itr_end = data.workers.end();
-    for (; itr != itr_end; ++itr)
+    events_type& get_events()
     {
-        worker_thread_data& wt = **itr;
-        mutex::scoped_lock lock(wt.init_status.mtx);
-        while (!wt.init_status.ready)
-            wt.init_status.cond.wait(lock);
+        return m_events;
     }
-}
 
-void terminate_workers()
-{
-#if DEBUG_QUEUE_MANAGER
-    ostringstream os;
-    os << "terminating all workers..." << endl;
-    cout << os.str();
-#endif
-    worker_threads_type::iterator itr = data.workers.begin(), itr_end = data.workers.end();
-    for (; itr != itr_end; ++itr)
+    virtual void begin_cell_interpret(const abs_address_t& pos)
     {
-        worker_thread_data& wt = **itr;
-        mutex::scoped_lock lock(wt.action.mtx);
-        wt.action.terminate_requested = true;
-        wt.action.cond.notify_all();
+        record([pos](iface::session_handler& hdl) { hdl.begin_cell_interpret(pos); });
     }
 
-    itr = data.workers.begin();
-    for (; itr != itr_end; ++itr)
-        (*itr)->thr_main.join();
-}
+    virtual void set_result(const formula_result& result)
+    {
+        record([result](iface::session_handler& hdl) { hdl.set_result(result); });
+    }
 
-void interpret_cell(worker_thread_data& wt)
+    virtual void set_invalid_expression(const char* msg)
+    {
+        string s(msg);
+        record([s](iface::session_handler& hdl) { hdl.set_invalid_expression(s.c_str()); });
+    }
+
+    virtual void set_formula_error(const char* msg)
+    {
+        string s(msg);
+        record([s](iface::session_handler& hdl) { hdl.set_formula_error(s.c_str()); });
+    }
+
+    virtual void push_token(fopcode_t fop)
+    {
+        record([fop](iface::session_handler& hdl) { hdl.push_token(fop); });
+    }
+
+    virtual void push_value(double val)
+    {
+        record([val](iface::session_handler& hdl) { hdl.push_value(val); });
+    }
+
+    virtual void push_string(size_t sid)
+    {
+        record([sid](iface::session_handler& hdl) { hdl.push_string(sid); });
+    }
+
+    virtual void push_single_ref(const address_t& addr, const abs_address_t& pos)
+    {
+        record([addr, pos](iface::session_handler& hdl) { hdl.push_single_ref(addr, pos); });
+    }
+
+    virtual void push_range_ref(const range_t& range, const abs_address_t& pos)
+    {
+        record([range, pos](iface::session_handler& hdl) { hdl.push_range_ref(range, pos); });
+    }
+
+    virtual void push_table_ref(const table_t& table)
+    {
+        record([table](iface::session_handler& hdl) { hdl.push_table_ref(table); });
+    }
+
+    virtual void push_function(formula_function_t foc)
+    {
+        record([foc](iface::session_handler& hdl) { hdl.push_function(foc); });
+    }
+};
+
+/**
+ * Check whether or not interpreting a cell may modify the model context.
+ * Cells that reference named expressions are assumed to do so, since the
+ * expressions get expanded only during interpretation.
+ */
+bool modifies_context(const iface::formula_model_access& cxt, const abs_address_t& pos, const formula_cell& cell)
 {
-    mutex::scoped_lock lock(wt.action.mtx);
+    const formula_tokens_t* tokens = cell.is_shared() ?
+        cxt.get_shared_formula_tokens(pos.sheet, cell.get_identifier()) :
+        cxt.get_formula_tokens(pos.sheet, cell.get_identifier());
 
-    // When we obtain the lock, the cell is expected to be inactive.
-    assert(!wt.action.cell_active);
+    if (!tokens)
+        return false;
 
-    wt.action.fcell = data.cells.front();
-    data.cells.pop();
-    wt.action.cond.notify_all();
+    formula_tokens_t::const_iterator it = tokens->begin(), it_end = tokens->end();
+    for (; it != it_end; ++it)
+    {
+        const formula_token_base& t = **it;
+        switch (t.get_opcode())
+        {
+            case fop_named_expression:
+                return true;
+            case fop_function:
+                if (formula_functions::modifies_context(formula_functions::get_function_opcode(t)))
+                    return true;
+                break;
+            default:
+                ;
+        }
+    }
+
+    return false;
 }
 
 /**
- * Main queue manager thread routine.
+ * Scheduler that calculates cells one dependency level at a time.  All
+ * cells in a level get split into batches of contiguous cells, and the
+ * worker threads pick up the batches in parallel.  Since no cell depends on
+ * another cell in the same level, no worker ever waits for another cell to
+ * be interpreted within a level.
+ *
+ * <p>In the deterministic mode, the cells that may modify the model context
+ * are left out of the batches, and get interpreted by the calling thread in
+ * canonical order after the worker threads finish the level.  The session
+ * events of each batch get recorded, and reported to the session handler
+ * in canonical order at the end of each level.</p>
+ *
+ * <p>With column locality enabled, the batches of each level are divided
+ * into contiguous shares, one for each worker.  Each worker calculates its
+ * own share first before helping with the others, so that a worker tends to
+ * calculate cells of the same columns across levels.</p>
  */
-void manage_queue_main(size_t worker_count, iface::formula_model_access* context)
+class wavefront_scheduler
 {
-    stack_printer __stack_printer__("::manage_queue_main");
-    mutex::scoped_lock lock(data.mtx_queue);
+    /**
+     * Below this number of cells, a level gets calculated by the calling
+     * thread, to avoid waking up the worker threads for too little work.
+     */
+    static const size_t min_parallel_cells = 8;
+
+    /** maximum number of cells in each batch. */
+    static const size_t max_batch_size = 256;
+
+    /** which cells to interpret within a range. */
+    enum class cell_filter { all, parallel, serial };
+
+    /** contiguous range of batches in a level. */
+    struct batch_share
+    {
+        std::atomic<size_t> next;
+        size_t end;
+    };
+
+    iface::formula_model_access& m_context;
+    const cell_dependency_graph& m_graph;
+    calc_status* mp_status;
+    size_t m_worker_count;
+    bool m_deterministic;
+    bool m_locality;
+
+    /** session handler to report the recorded events to, if any. */
+    iface::session_handler* mp_handler;
+
+    /**
+     * flag for each cell indicating whether or not it must be interpreted
+     * by the calling thread.  Used only in the deterministic mode.
+     */
+    std::vector<char> m_serial;
+
+    /** session events recorded for each batch of the current level. */
+    std::vector<std::unique_ptr<session_recorder>> m_recorders;
+
+    /** range of cells in the level currently being calculated. */
+    size_t m_level_begin;
+    size_t m_level_end;
+    size_t m_batch_size;
+
+    /** batch shares of the current level, one for each worker at most. */
+    std::unique_ptr<batch_share[]> m_shares;
+    size_t m_share_count;
+
+    std::atomic<bool> m_aborted;
+    mutex m_mtx_error;
+    std::exception_ptr m_error;
+
+public:
+    wavefront_scheduler(
+        size_t worker_count, iface::formula_model_access& cxt, const cell_dependency_graph& graph,
+        calc_status* status, bool deterministic) :
+        m_context(cxt),
+        m_graph(graph),
+        mp_status(status),
+        m_worker_count(worker_count),
+        m_deterministic(deterministic),
+        m_locality(cxt.get_config().column_locality),
+        mp_handler(cxt.get_session_handler()),
+        m_level_begin(0),
+        m_level_end(0),
+        m_batch_size(1),
+        m_shares(new batch_share[worker_count]),
+        m_share_count(0),
+        m_aborted(false)
+    {
+        assert(worker_count > 0);
+
+        if (m_deterministic)
+        {
+            size_t n = m_graph.cells.size();
+            m_serial.resize(n);
+            for (size_t i = 0; i < n; ++i)
+            {
+                const abs_address_t& addr = m_graph.cells[i];
+                m_serial[i] = modifies_context(m_context, addr, *m_context.get_formula_cell(addr));
+            }
+        }
+    }
+
+    size_t get_level_count() const
+    {
+        return m_graph.level_offsets.size() - 1;
+    }
+
+    /**
+     * Set the level to calculate next.
+     *
+     * @return true if the level should be calculated by the worker threads,
+     *         or false if the level is too small and should be calculated
+     *         by the calling thread.
+     */
+    bool set_level(size_t level)
     {
-        mutex::scoped_lock lock(data.mtx_thread_ready);
-        init_workers(worker_count, context);
-        data.thread_ready = true;
-        data.cond_thread_ready.notify_all();
+        m_level_begin = m_graph.level_offsets[level];
+        m_level_end = m_graph.level_offsets[level+1];
+
+        size_t n = m_level_end - m_level_begin;
+        if (n < min_parallel_cells)
+            return false;
+
+        // Aim for several batches per worker for load balancing, without
+        // making them too small.
+        m_batch_size = (n + m_worker_count * 4 - 1) / (m_worker_count * 4);
+        m_batch_size = std::min(std::max<size_t>(m_batch_size, min_parallel_cells), max_batch_size);
+
+        size_t batch_count = (n + m_batch_size - 1) / m_batch_size;
+        m_share_count = m_locality ? std::min(m_worker_count, batch_count) : 1;
+        for (size_t i = 0; i < m_share_count; ++i)
+        {
+            m_shares[i].next = get_share_offset(batch_count, m_share_count, i);
+            m_shares[i].end = get_share_offset(batch_count, m_share_count, i + 1);
+        }
+
+        if (m_deterministic && mp_handler)
+        {
+            m_recorders.clear();
+            m_recorders.resize(batch_count);
+        }
+
+        return true;
     }
 
-    while (data.action != qm_terminate_requested)
+    void run_worker(size_t worker_id)
     {
-        tprintf("waiting...");
-        data.cond_queue.wait(lock);
-        if (data.action == qm_cell_added_to_queue)
+        stack_printer __stack_printer__("wavefront_scheduler::run_worker");
+        try
+        {
+            // Start with the worker's own share, then move on to the others.
+            for (size_t i = 0; i < m_share_count && !m_aborted; ++i)
+                run_share(m_shares[(worker_id + i) % m_share_count]);
+        }
+        catch (...)
         {
-            data.action = qm_no_action;
+            abort(std::current_exception());
+        }
+    }
 
-            mutex::scoped_lock wts_lock(wts.mtx);
-            while (!wts.idle_wts.empty())
-            {
-                if (data.cells.empty())
-                    // No more cells to interpret.  Bail out.
-                    break;
+    /**
+     * Calculate all cells in the current level on the calling thread.
+     */
+    void run_level()
+    {
+        interpret_cells(m_level_begin, m_level_end, cell_filter::all, nullptr);
+    }
 
-                worker_thread_data& wt = *wts.idle_wts.front();
-                wts.idle_wts.pop();
-                interpret_cell(wt);
+    /**
+     * Finish the current level after the worker threads have calculated it.
+     * In the deterministic mode, this interprets the cells left out of the
+     * batches, and reports all recorded session events.
+     */
+    void finish_level()
+    {
+        if (!m_deterministic)
+            return;
+
+        session_recorder serial_recorder;
+        if (!m_aborted)
+        {
+            try
+            {
+                interpret_cells(
+                    m_level_begin, m_level_end, cell_filter::serial, mp_handler ? &serial_recorder : nullptr);
+            }
+            catch (...)
+            {
+                abort(std::current_exception());
             }
         }
+
+        if (!mp_handler)
+            return;
+
+        // The events of each recorder are already in canonical order, and no
+        // two recorders share the same cell.
+        session_recorder::events_type events;
+        events.swap(serial_recorder.get_events());
+        for (auto& recorder : m_recorders)
+        {
+            if (!recorder)
+                continue;
+
+            session_recorder::events_type& batch_events = recorder->get_events();
+            std::move(batch_events.begin(), batch_events.end(), std::back_inserter(events));
+        }
+        m_recorders.clear();
+
+        std::stable_sort(events.begin(), events.end(),
+            [](const session_recorder::event& left, const session_recorder::event& right) -> bool
+            {
+                return left.position < right.position;
+            }
+        );
+
+        for (const session_recorder::event& e : events)
+            e.call(*mp_handler);
     }
 
-    // Termination is being requested.  Finish interpreting the rest of the
-    // cells, as no more new cells will be added.
+    /**
+     * @return true if the run has been aborted due to an error or a
+     *         cancellation.
+     */
+    bool is_aborted() const
+    {
+        return m_aborted;
+    }
 
-    tprintf("terminating manage queue thread...");
-    while (!data.cells.empty())
+    void rethrow_error()
     {
-        mutex::scoped_lock wts_lock(wts.mtx);
-        if (wts.idle_wts.empty())
-            // In case no threads are idle, wait until one becomes idle.
-            wts.cond.wait(wts_lock);
+        if (m_error)
+            std::rethrow_exception(m_error);
+    }
 
-        while (!wts.idle_wts.empty())
+private:
+    /**
+     * Calculate the remaining batches of a share.
+     */
+    void run_share(batch_share& share)
+    {
+        while (!m_aborted)
         {
-            if (data.cells.empty())
-                // No more cells to interpret.  Bail out.
+            size_t batch = share.next.fetch_add(1);
+            if (batch >= share.end)
                 break;
 
-            worker_thread_data& wt = *wts.idle_wts.front();
-            wts.idle_wts.pop();
-            interpret_cell(wt);
+            size_t begin = m_level_begin + batch * m_batch_size;
+            size_t end = std::min(begin + m_batch_size, m_level_end);
+            if (m_deterministic)
+            {
+                session_recorder* recorder = nullptr;
+                if (mp_handler)
+                {
+                    // Each batch is picked up by exactly one worker.
+                    m_recorders[batch].reset(new session_recorder);
+                    recorder = m_recorders[batch].get();
+                }
+                interpret_cells(begin, end, cell_filter::parallel, recorder);
+            }
+            else
+                interpret_cells(begin, end, cell_filter::all, nullptr);
         }
     }
 
-    terminate_workers();
-}
+    /**
+     * Interpret cells in a range.
+     *
+     * @param recorder session recorder to report the events to, or nullptr
+     *                 to report them to the model's session handler
+     *                 directly.
+     */
+    void interpret_cells(size_t begin, size_t end, cell_filter filter, session_recorder* recorder)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            if (filter != cell_filter::all && bool(m_serial[i]) != (filter == cell_filter::serial))
+                continue;
 
-void add_cell_to_queue(const abs_address_t& cell)
-{
-#if DEBUG_QUEUE_MANAGER
-//  ostringstream os;
-//  os << "adding cell " << global::get_cell_name(p) << " to queue..." << endl;
-//  cout << os.str();
-#endif
+            if (mp_status && mp_status->cancelled)
+            {
+                m_aborted = true;
+                return;
+            }
 
-    ::boost::mutex::scoped_lock lock(data.mtx_queue);
-    data.cells.push(cell);
-    data.action = qm_cell_added_to_queue;
-    data.cond_queue.notify_all();
-}
+            iface::session_handler* handler = recorder;
+            if (recorder)
+                recorder->set_position(i);
+            else
+                handler = m_context.get_session_handler();
 
-void terminate_queue_thread()
-{
-    ::boost::mutex::scoped_lock lock(data.mtx_queue);
-    data.action = qm_terminate_requested;
-    data.cond_queue.notify_all();
-}
+            if (m_graph.cutoff)
+                m_graph.cutoff->interpret(m_graph, i, m_context, handler);
+            else
+            {
+                const abs_address_t& addr = m_graph.cells[i];
+                formula_cell* p = m_context.get_formula_cell(addr);
+                p->interpret(m_context, addr, handler);
+            }
 
-/**
- * Wait until the manage queue thread becomes ready.
- */
-void wait_init()
-{
-    mutex::scoped_lock lock(data.mtx_thread_ready);
-    while (!data.thread_ready)
-        data.cond_thread_ready.wait(lock);
-}
+            if (mp_status)
+                ++mp_status->calculated_count;
+        }
+    }
 
-thread thr_queue;
+    void abort(std::exception_ptr e)
+    {
+        mutex::scoped_lock lock(m_mtx_error);
+        if (!m_error)
+            m_error = e;
+        m_aborted = true;
+    }
+};
 
 } // anonymous namespace
 
-void cell_queue_manager::init(size_t thread_count, iface::formula_model_access& context)
+struct cell_queue_manager::impl
 {
-    // Don't forget to reset the global data.
-    data.reset();
-    wts.reset();
+    typedef std::function<void(size_t)> job_type;
+
+    std::vector<std::unique_ptr<thread>> m_workers;
+
+    /** CPUs to pin the worker threads to.  Empty if not pinned. */
+    std::vector<size_t> m_cpus;
+    bool m_pinned;
+
+    /** serializes the calls to run(). */
+    mutex m_mtx_run;
 
-    thread thr(::boost::bind(manage_queue_main, thread_count, &context));
-    thr_queue.swap(thr);
-    wait_init();
+    /** number of tasks in the last run in the dependency queue mode. */
+
+    mutex m_mtx;
+    condition_variable m_cond_job;
+    condition_variable m_cond_done;
+
+    const job_type* mp_job;
+    size_t m_job_id;  ///< incremented each time a new job is posted.
+    size_t m_active;  ///< number of workers still running the current job.
+    bool m_terminate;
+
+    impl(size_t thread_count, bool pin_threads) :
+        m_pinned(pin_threads), mp_job(nullptr), m_job_id(0), m_active(0), m_terminate(false)
+    {
+        if (pin_threads)
+            m_cpus = get_available_cpus();
+
+        for (size_t i = 0; i < thread_count; ++i)
+            m_workers.push_back(make_unique<thread>(::boost::bind(&impl::worker_main, this, i)));
+    }
+
+    ~impl()
+    {
+        {
+            mutex::scoped_lock lock(m_mtx);
+            m_terminate = true;
+            m_cond_job.notify_all();
+        }
+
+        for (auto& worker : m_workers)
+            worker->join();
+    }
+
+    void worker_main(size_t worker_id)
+    {
+        stack_printer __stack_printer__("cell_queue_manager::impl::worker_main");
+        if (!m_cpus.empty())
+            pin_current_thread(m_cpus[worker_id % m_cpus.size()]);
+
+        size_t last_job_id = 0;
+        mutex::scoped_lock lock(m_mtx);
+        while (true)
+        {
+            while (!m_terminate && m_job_id == last_job_id)
+                m_cond_job.wait(lock);
+
+            if (m_terminate)
+                return;
+
+            last_job_id = m_job_id;
+            const job_type& job = *mp_job;
+
+            lock.unlock();
+            job(worker_id);
+            lock.lock();
+
+            if (--m_active == 0)
+                m_cond_done.notify_all();
+        }
+    }
+
+    /**
+     * Run a job on all worker threads, and wait for all of them to finish.
+     * The job must not throw.
+     */
+    void run(const job_type& job)
+    {
+        mutex::scoped_lock lock(m_mtx);
+        mp_job = &job;
+        m_active = m_workers.size();
+        ++m_job_id;
+        m_cond_job.notify_all();
+
+        while (m_active)
+            m_cond_done.wait(lock);
+
+        mp_job = nullptr;
+    }
+};
+
+cell_queue_manager::cell_queue_manager(size_t thread_count, bool pin_threads) :
+    mp_impl(make_unique<impl>(thread_count, pin_threads))
+{
+    assert(thread_count > 0);
 }
 
-void cell_queue_manager::add_cell(const abs_address_t& cell)
+cell_queue_manager::~cell_queue_manager() {}
+
+size_t cell_queue_manager::get_thread_count() const
 {
-    add_cell_to_queue(cell);
+    return mp_impl->m_workers.size();
 }
 
-void cell_queue_manager::terminate()
+bool cell_queue_manager::is_pinned() const
 {
-    terminate_queue_thread();
-    thr_queue.join();
+    return mp_impl->m_pinned;
+}
+
+calc_status::calc_status() :
+    cell_count(0), calculated_count(0), skipped_count(0), cancelled(false) {}
+
+void cell_queue_manager::run(
+    iface::formula_model_access& context, const cell_dependency_graph& graph, calc_status* status)
+{
+    if (graph.cells.empty())
+        return;
+
+    mutex::scoped_lock lock(mp_impl->m_mtx_run);
+
+    switch (context.get_config().calc_mode)
+    {
+        case calc_mode_t::wavefront:
+        case calc_mode_t::deterministic:
+        {
+            bool deterministic = context.get_config().calc_mode == calc_mode_t::deterministic;
+            wavefront_scheduler scheduler(mp_impl->m_workers.size(), context, graph, status, deterministic);
+            for (size_t level = 0, n = scheduler.get_level_count(); level < n && !scheduler.is_aborted(); ++level)
+            {
+                if (scheduler.set_level(level))
+                {
+                    mp_impl->run([&scheduler](size_t worker_id) { scheduler.run_worker(worker_id); });
+                    scheduler.finish_level();
+                    scheduler.rethrow_error();
+                }
+                else
+                    scheduler.run_level();
+            }
+            break;
+        }
+        case calc_mode_t::dependency_queue:
+        default:
+        {
+            cell_scheduler scheduler(mp_impl->m_workers.size(), context, graph, status);
+            mp_impl->run([&scheduler](size_t worker_id) { scheduler.run_worker(worker_id); });
+            scheduler.rethrow_error();
+        }
+    }
 }
 
 }
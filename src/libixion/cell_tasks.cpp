@@ -0,0 +1,103 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "cell_tasks.hpp"
+
+#include "ixion/cell.hpp"
+#include "ixion/cell_queue_manager.hpp"
+
+#include "ixion/interface/formula_model_access.hpp"
+
+#include <algorithm>
+#include <tuple>
+
+namespace ixion {
+
+void build_cell_tasks(
+    const iface::formula_model_access& cxt, const cell_dependency_graph& graph,
+    std::vector<size_t>& task_offsets, std::vector<size_t>& cell_tasks,
+    std::vector<uint64_t>* costs)
+{
+    size_t n = graph.cells.size();
+    cell_tasks.resize(n);
+    if (costs)
+        costs->resize(n);
+    task_offsets.clear();
+    task_offsets.reserve(n+1);
+
+    const formula_cell* prev_cell = nullptr;
+    size_t run_size = 0;
+    for (size_t level = 0, level_count = graph.level_offsets.size() - 1; level < level_count; ++level)
+    {
+        // A run never extends past the end of a level.
+        prev_cell = nullptr;
+        for (size_t i = graph.level_offsets[level]; i < graph.level_offsets[level+1]; ++i)
+        {
+            const abs_address_t& addr = graph.cells[i];
+            const formula_cell* cell = cxt.get_formula_cell(addr);
+
+            bool extends_run = false;
+            if (prev_cell && run_size < max_task_size && cell->is_shared() && prev_cell->is_shared())
+            {
+                const abs_address_t& prev = graph.cells[i-1];
+                extends_run =
+                    prev.sheet == addr.sheet && prev.column == addr.column && prev.row + 1 == addr.row &&
+                    prev_cell->get_identifier() == cell->get_identifier();
+            }
+
+            if (extends_run)
+                ++run_size;
+            else
+            {
+                task_offsets.push_back(i);
+                run_size = 1;
+            }
+
+            cell_tasks[i] = task_offsets.size() - 1;
+            if (costs)
+                (*costs)[i] = cell->get_eval_cost();
+            prev_cell = cell;
+        }
+    }
+
+    task_offsets.push_back(n);
+}
+
+void assign_task_homes(
+    const cell_dependency_graph& graph, const std::vector<size_t>& task_offsets,
+    size_t worker_count, std::vector<size_t>& homes)
+{
+    typedef std::tuple<sheet_t, col_t, row_t> region_type;
+
+    size_t task_count = task_offsets.size() - 1;
+    std::vector<region_type> task_regions;
+    task_regions.reserve(task_count);
+    for (size_t i = 0; i < task_count; ++i)
+    {
+        const abs_address_t& addr = graph.cells[task_offsets[i]];
+        task_regions.push_back(region_type(addr.sheet, addr.column, addr.row / region_row_size));
+    }
+
+    std::vector<region_type> regions = task_regions;
+    std::sort(regions.begin(), regions.end());
+    regions.erase(std::unique(regions.begin(), regions.end()), regions.end());
+
+    homes.resize(task_count);
+    for (size_t i = 0; i < task_count; ++i)
+    {
+        size_t rank = std::lower_bound(regions.begin(), regions.end(), task_regions[i]) - regions.begin();
+        homes[i] = rank * worker_count / regions.size();
+    }
+}
+
+size_t get_share_offset(size_t item_count, size_t share_count, size_t share)
+{
+    return share * item_count / share_count;
+}
+
+}
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
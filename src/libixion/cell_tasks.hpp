@@ -0,0 +1,87 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef __IXION_CELL_TASKS_HPP__
+#define __IXION_CELL_TASKS_HPP__
+
+#include "ixion/types.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+namespace ixion {
+
+struct cell_dependency_graph;
+
+namespace iface {
+
+class formula_model_access;
+
+}
+
+/** maximum number of cells in a single task. */
+const size_t max_task_size = 128;
+
+/** number of rows in each column region used for locality. */
+const row_t region_row_size = 1024;
+
+/**
+ * Group the cells of a dependency graph into tasks.  Cells of the same
+ * level that are in consecutive rows of one column and share the same
+ * formula tokens form a single task, up to max_task_size cells.  All other
+ * cells become tasks of their own.  Since cells of the same level never
+ * depend on each other, the cells of a task can be interpreted in one go.
+ *
+ * @param cxt model context storing the cells.
+ * @param graph cells to group.
+ * @param task_offsets receives the position of the first cell of each
+ *                     task, plus the end.  The cells of each task are
+ *                     contiguous in the cell array.
+ * @param cell_tasks receives the task that each cell belongs to.
+ * @param costs when not NULL, receives the evaluation cost of each cell
+ *              recorded in the previous calculation, or 0 if not known.
+ */
+void build_cell_tasks(
+    const iface::formula_model_access& cxt, const cell_dependency_graph& graph,
+    std::vector<size_t>& task_offsets, std::vector<size_t>& cell_tasks,
+    std::vector<uint64_t>* costs = nullptr);
+
+/**
+ * Assign a home worker to each task, by the region of the column that the
+ * first cell of the task belongs to.  The columns are split into regions of
+ * region_row_size rows, and the regions sorted by sheet, column and row are
+ * divided into contiguous ranges, one for each worker, so that neighboring
+ * columns also tend to share workers.
+ *
+ * @param graph cells grouped into the tasks.
+ * @param task_offsets position of the first cell of each task, plus the
+ *                     end.
+ * @param worker_count number of workers.  It must be greater than 0.
+ * @param homes receives the home worker of each task.
+ */
+void assign_task_homes(
+    const cell_dependency_graph& graph, const std::vector<size_t>& task_offsets,
+    size_t worker_count, std::vector<size_t>& homes);
+
+/**
+ * Get where a share starts, when dividing items into contiguous shares as
+ * evenly as possible.
+ *
+ * @param item_count number of items to divide.
+ * @param share_count number of shares.  It must be greater than 0.
+ * @param share share to get the start of.  Passing share_count gives the
+ *              end of the last share.
+ *
+ * @return position of the first item of the share.
+ */
+size_t get_share_offset(size_t item_count, size_t share_count, size_t share);
+
+}
+
+#endif
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -10,10 +10,28 @@
 namespace ixion {
 
 config::config() :
-    sep_function_arg(',') {}
+    sep_function_arg(','),
+    calc_mode(calc_mode_t::dependency_queue),
+    pin_threads(false),
+    column_locality(true),
+    cache_dirty_cells(false),
+    dirty_cell_cache_size(256),
+    iterative_calc(false),
+    max_iterations(100),
+    iteration_epsilon(0.001),
+    lazy_calc(false) {}
 
 config::config(const config& r) :
-    sep_function_arg(r.sep_function_arg) {}
+    sep_function_arg(r.sep_function_arg),
+    calc_mode(r.calc_mode),
+    pin_threads(r.pin_threads),
+    column_locality(r.column_locality),
+    cache_dirty_cells(r.cache_dirty_cells),
+    dirty_cell_cache_size(r.dirty_cell_cache_size),
+    iterative_calc(r.iterative_calc),
+    max_iterations(r.max_iterations),
+    iteration_epsilon(r.iteration_epsilon),
+    lazy_calc(r.lazy_calc) {}
 
 }
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
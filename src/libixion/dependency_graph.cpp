@@ -0,0 +1,432 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "dependency_graph.hpp"
+#include "function_objects.hpp"
+
+#include "ixion/cell_listener_tracker.hpp"
+#include "ixion/interface/formula_model_access.hpp"
+
+#include <algorithm>
+
+namespace ixion {
+
+namespace {
+
+const size_t no_cell = static_cast<size_t>(-1);
+
+void erase_id(std::vector<size_t>& ids, size_t id)
+{
+    std::vector<size_t>::iterator it = std::find(ids.begin(), ids.end(), id);
+    if (it == ids.end())
+        return;
+
+    *it = ids.back();
+    ids.pop_back();
+}
+
+}
+
+dependency_graph::dependency_graph() :
+    m_next_rank(0), m_cyclic(false), m_rebuild(false), m_mark(0) {}
+
+void dependency_graph::add_cell(const abs_address_t& pos)
+{
+    boost::mutex::scoped_lock lock(m_mtx);
+
+    // A cell added again may reference different cells than before.
+    size_t id = find_cell(pos);
+    if (id != no_cell)
+        remove_node(id);
+
+    if (m_free_ids.empty())
+    {
+        id = m_nodes.size();
+        m_nodes.push_back(node());
+        m_marks.push_back(0);
+        m_slots.push_back(0);
+    }
+    else
+    {
+        id = m_free_ids.back();
+        m_free_ids.pop_back();
+    }
+
+    // With no relationships yet, the cell can go last in the order.
+    node& nd = m_nodes[id];
+    nd.pos = pos;
+    nd.rank = m_next_rank++;
+    nd.alive = true;
+    nd.added = true;
+
+    m_ids.insert(id_map_type::value_type(pos, id));
+    m_positions.insert(pos);
+    m_added.push_back(id);
+}
+
+void dependency_graph::remove_cell(const abs_address_t& pos)
+{
+    boost::mutex::scoped_lock lock(m_mtx);
+
+    size_t id = find_cell(pos);
+    if (id != no_cell)
+        remove_node(id);
+}
+
+bool dependency_graph::sort_cells(
+    iface::formula_model_access& cxt, const dirty_formula_cells_t& cells,
+    sorted_dependencies& sorted)
+{
+    boost::mutex::scoped_lock lock(m_mtx);
+
+    resolve(cxt);
+    if (m_cyclic)
+        return false;
+
+    std::vector<size_t> ids;
+    ids.reserve(cells.size());
+    dirty_formula_cells_t::const_iterator it = cells.begin(), it_end = cells.end();
+    for (; it != it_end; ++it)
+    {
+        size_t id = find_cell(*it);
+        if (id == no_cell)
+            return false;
+
+        ids.push_back(id);
+    }
+
+    std::sort(ids.begin(), ids.end(),
+        [this](size_t left, size_t right) -> bool
+        {
+            return m_nodes[left].rank < m_nodes[right].rank;
+        }
+    );
+
+    // The cells are already in order, so the id of each cell is its
+    // position in the order.
+    size_t n = ids.size();
+    start_search();
+    sorted.cells.resize(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        sorted.cells[i] = m_nodes[ids[i]].pos;
+        m_marks[ids[i]] = m_mark;
+        m_slots[ids[i]] = i;
+    }
+
+    // Only the relationships among the cells being sorted are used.
+    sorted.precedent_offsets.resize(n+1);
+    sorted.precedents.clear();
+    for (size_t i = 0; i < n; ++i)
+    {
+        sorted.precedent_offsets[i] = sorted.precedents.size();
+        const std::vector<size_t>& precedents = m_nodes[ids[i]].precedents;
+        std::vector<size_t>::const_iterator it_prec = precedents.begin(), it_prec_end = precedents.end();
+        for (; it_prec != it_prec_end; ++it_prec)
+        {
+            if (m_marks[*it_prec] == m_mark)
+                sorted.precedents.push_back(m_slots[*it_prec]);
+        }
+    }
+    sorted.precedent_offsets[n] = sorted.precedents.size();
+
+    sorted.sorted.resize(n);
+    sorted.components.resize(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        sorted.sorted[i] = i;
+        sorted.components[i] = i;
+    }
+    sorted.circular.assign(n, false);
+
+    return true;
+}
+
+size_t dependency_graph::size() const
+{
+    boost::mutex::scoped_lock lock(m_mtx);
+    return m_ids.size();
+}
+
+size_t dependency_graph::find_cell(const abs_address_t& pos) const
+{
+    id_map_type::const_iterator it = m_ids.find(pos);
+    return it == m_ids.end() ? no_cell : it->second;
+}
+
+void dependency_graph::remove_node(size_t id)
+{
+    node& nd = m_nodes[id];
+
+    std::vector<size_t>::const_iterator it = nd.precedents.begin(), it_end = nd.precedents.end();
+    for (; it != it_end; ++it)
+    {
+        if (*it != id)
+            erase_id(m_nodes[*it].dependents, id);
+    }
+
+    for (it = nd.dependents.begin(), it_end = nd.dependents.end(); it != it_end; ++it)
+    {
+        if (*it != id)
+            erase_id(m_nodes[*it].precedents, id);
+    }
+
+    m_ids.erase(nd.pos);
+    m_positions.erase(nd.pos);
+
+    nd.precedents.clear();
+    nd.dependents.clear();
+    nd.alive = false;
+    nd.added = false;
+    m_free_ids.push_back(id);
+
+    // Removing relationships keeps the order intact, but may break the
+    // circular references that kept it from being maintained.
+    if (m_cyclic)
+        m_rebuild = true;
+}
+
+void dependency_graph::resolve(iface::formula_model_access& cxt)
+{
+    std::vector<size_t> added;
+    added.reserve(m_added.size());
+    std::vector<size_t>::const_iterator it = m_added.begin(), it_end = m_added.end();
+    for (; it != it_end; ++it)
+    {
+        // A cell removed since it got added has been cleared of the flag.
+        node& nd = m_nodes[*it];
+        if (!nd.alive || !nd.added)
+            continue;
+
+        if (!cxt.get_formula_cell(nd.pos))
+        {
+            // The formula cell has been replaced without getting removed.
+            remove_node(*it);
+            continue;
+        }
+
+        added.push_back(*it);
+    }
+    m_added.clear();
+
+    // Collect the relationships from both ends, as either end may have been
+    // added before the other.  Those with both ends added are collected
+    // from the referencing end only.
+    const cell_listener_tracker& tracker = cxt.get_cell_listener_tracker();
+    std::vector<std::pair<size_t, size_t> > edges;
+    std::vector<abs_address_t> addrs;
+    for (it = added.begin(), it_end = added.end(); it != it_end; ++it)
+    {
+        size_t id = *it;
+        cell_listener_tracker::precedents_type token_refs;
+        const cell_listener_tracker::precedents_type* refs = get_cell_references(cxt, m_nodes[id].pos, token_refs);
+
+        std::vector<abs_address_t>::const_iterator it_cell = refs->cells.begin(), it_cell_end = refs->cells.end();
+        for (; it_cell != it_cell_end; ++it_cell)
+        {
+            size_t precedent = find_cell(*it_cell);
+            if (precedent != no_cell)
+                edges.push_back(std::pair<size_t, size_t>(precedent, id));
+        }
+
+        std::vector<abs_range_t>::const_iterator it_range = refs->ranges.begin(), it_range_end = refs->ranges.end();
+        for (; it_range != it_range_end; ++it_range)
+        {
+            addrs.clear();
+            m_positions.get_addresses(*it_range, addrs);
+            for (it_cell = addrs.begin(), it_cell_end = addrs.end(); it_cell != it_cell_end; ++it_cell)
+                edges.push_back(std::pair<size_t, size_t>(find_cell(*it_cell), id));
+        }
+
+        addrs.clear();
+        tracker.get_direct_listeners(m_nodes[id].pos, addrs);
+        for (it_cell = addrs.begin(), it_cell_end = addrs.end(); it_cell != it_cell_end; ++it_cell)
+        {
+            size_t dependent = find_cell(*it_cell);
+            if (dependent != no_cell && !m_nodes[dependent].added)
+                edges.push_back(std::pair<size_t, size_t>(id, dependent));
+        }
+    }
+
+    for (it = added.begin(), it_end = added.end(); it != it_end; ++it)
+        m_nodes[*it].added = false;
+
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+    // Moving the cells for each relationship of a large batch would cost
+    // more than sorting all cells again.
+    bool rebuild = m_rebuild || added.size() * 2 > m_ids.size();
+    std::vector<std::pair<size_t, size_t> >::const_iterator it_edge = edges.begin(), it_edge_end = edges.end();
+    for (; it_edge != it_edge_end; ++it_edge)
+    {
+        size_t precedent = it_edge->first, dependent = it_edge->second;
+        if (rebuild || m_cyclic)
+        {
+            m_nodes[precedent].dependents.push_back(dependent);
+            m_nodes[dependent].precedents.push_back(precedent);
+        }
+        else
+            insert_edge(precedent, dependent);
+    }
+
+    if (rebuild)
+        rebuild_order();
+}
+
+void dependency_graph::start_search()
+{
+    if (++m_mark == 0)
+    {
+        // The marks have wrapped around.
+        std::fill(m_marks.begin(), m_marks.end(), 0);
+        m_mark = 1;
+    }
+}
+
+void dependency_graph::insert_edge(size_t precedent, size_t dependent)
+{
+    m_nodes[precedent].dependents.push_back(dependent);
+    m_nodes[dependent].precedents.push_back(precedent);
+
+    size_t lower = m_nodes[dependent].rank, upper = m_nodes[precedent].rank;
+    if (upper < lower)
+        // Already in order.
+        return;
+
+    if (precedent == dependent)
+    {
+        m_cyclic = true;
+        return;
+    }
+
+    // Only the cells ranked between the two ends of the relationship need to
+    // move.  Collect the cells that depend on the dependent end...
+    start_search();
+    std::vector<size_t> forward, stack;
+    stack.push_back(dependent);
+    m_marks[dependent] = m_mark;
+    while (!stack.empty())
+    {
+        size_t id = stack.back();
+        stack.pop_back();
+        forward.push_back(id);
+
+        const std::vector<size_t>& dependents = m_nodes[id].dependents;
+        std::vector<size_t>::const_iterator it = dependents.begin(), it_end = dependents.end();
+        for (; it != it_end; ++it)
+        {
+            if (*it == precedent)
+            {
+                // The relationship closes a circular reference.
+                m_cyclic = true;
+                return;
+            }
+
+            if (m_marks[*it] == m_mark || m_nodes[*it].rank > upper)
+                continue;
+
+            m_marks[*it] = m_mark;
+            stack.push_back(*it);
+        }
+    }
+
+    // ... and the cells that the precedent end depends on.
+    std::vector<size_t> backward;
+    stack.push_back(precedent);
+    m_marks[precedent] = m_mark;
+    while (!stack.empty())
+    {
+        size_t id = stack.back();
+        stack.pop_back();
+        backward.push_back(id);
+
+        const std::vector<size_t>& precedents = m_nodes[id].precedents;
+        std::vector<size_t>::const_iterator it = precedents.begin(), it_end = precedents.end();
+        for (; it != it_end; ++it)
+        {
+            if (m_marks[*it] == m_mark || m_nodes[*it].rank < lower)
+                continue;
+
+            m_marks[*it] = m_mark;
+            stack.push_back(*it);
+        }
+    }
+
+    // Hand the ranks of both groups to the cells of the second group
+    // first, then the first, keeping the order within each group.
+    auto less_by_rank = [this](size_t left, size_t right) -> bool
+    {
+        return m_nodes[left].rank < m_nodes[right].rank;
+    };
+
+    std::sort(forward.begin(), forward.end(), less_by_rank);
+    std::sort(backward.begin(), backward.end(), less_by_rank);
+
+    std::vector<size_t> ranks;
+    ranks.reserve(forward.size() + backward.size());
+    std::vector<size_t>::const_iterator it = backward.begin(), it_end = backward.end();
+    for (; it != it_end; ++it)
+        ranks.push_back(m_nodes[*it].rank);
+    for (it = forward.begin(), it_end = forward.end(); it != it_end; ++it)
+        ranks.push_back(m_nodes[*it].rank);
+    std::sort(ranks.begin(), ranks.end());
+
+    std::vector<size_t>::const_iterator it_rank = ranks.begin();
+    for (it = backward.begin(), it_end = backward.end(); it != it_end; ++it, ++it_rank)
+        m_nodes[*it].rank = *it_rank;
+    for (it = forward.begin(), it_end = forward.end(); it != it_end; ++it, ++it_rank)
+        m_nodes[*it].rank = *it_rank;
+}
+
+void dependency_graph::rebuild_order()
+{
+    m_rebuild = false;
+
+    // Rank the cells with no precedents left first, one level at a time.
+    std::vector<size_t> counts(m_nodes.size(), 0);
+    std::vector<size_t> ready;
+    for (size_t id = 0, n = m_nodes.size(); id < n; ++id)
+    {
+        if (!m_nodes[id].alive)
+            continue;
+
+        counts[id] = m_nodes[id].precedents.size();
+        if (!counts[id])
+            ready.push_back(id);
+    }
+
+    size_t rank = 0;
+    for (size_t i = 0; i < ready.size(); ++i)
+    {
+        node& nd = m_nodes[ready[i]];
+        nd.rank = rank++;
+
+        std::vector<size_t>::const_iterator it = nd.dependents.begin(), it_end = nd.dependents.end();
+        for (; it != it_end; ++it)
+        {
+            if (!--counts[*it])
+                ready.push_back(*it);
+        }
+    }
+
+    // The cells left unranked are part of or depend on circular references.
+    m_cyclic = rank < m_ids.size();
+    if (m_cyclic)
+    {
+        for (size_t id = 0, n = m_nodes.size(); id < n; ++id)
+        {
+            if (m_nodes[id].alive && counts[id])
+                m_nodes[id].rank = rank++;
+        }
+    }
+
+    m_next_rank = rank;
+}
+
+}
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
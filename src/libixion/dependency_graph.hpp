@@ -0,0 +1,216 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef __IXION_DEPENDENCY_GRAPH_HPP__
+#define __IXION_DEPENDENCY_GRAPH_HPP__
+
+#include "ixion/address.hpp"
+#include "ixion/address_set.hpp"
+
+#include <boost/thread/mutex.hpp>
+
+#include <cstdlib>
+#include <unordered_map>
+#include <vector>
+
+namespace ixion {
+
+namespace iface {
+
+class formula_model_access;
+
+}
+
+/**
+ * Cells to calculate in order of dependency, with the dependency
+ * relationships among them.  Each cell is referred to by its id, which is
+ * its position in the cell array.
+ */
+struct sorted_dependencies
+{
+    /** cells by their ids. */
+    std::vector<abs_address_t> cells;
+
+    /** ids of the cells in the order of calculation. */
+    std::vector<size_t> sorted;
+
+    /**
+     * offsets into the precedent id array for each cell id, plus one extra
+     * entry marking the end.
+     */
+    std::vector<size_t> precedent_offsets;
+
+    /** ids of the precedent cells, grouped by the cell that depends on them. */
+    std::vector<size_t> precedents;
+
+    /** whether each cell is part of a circular dependency. */
+    std::vector<bool> circular;
+
+    /**
+     * id of the strongly connected component that each cell belongs to.
+     * The cells of each component are contiguous in the sorted order.
+     */
+    std::vector<size_t> components;
+};
+
+/**
+ * Dependency relationships among all registered formula cells, kept along
+ * with a topological order of the cells for the lifetime of the model.
+ * Each formula cell gets added when it's registered and removed when it's
+ * unregistered, so that a calculation only needs to pick the dirty cells
+ * out of the order, rather than sort them all over again.
+ *
+ * <p>The relationships of the cells added since the last calculation get
+ * resolved in one batch on the next calculation, so that registering many
+ * cells one at a time doesn't search the range references of the model
+ * after each one.  Each relationship resolved that goes against the
+ * current order moves only the cells between the two ends of it, as in
+ * the dynamic topological sort of Pearce and Kelly.  A large batch gets the
+ * whole order rebuilt instead.</p>
+ *
+ * <p>While the cells form any circular reference, the order is not
+ * maintained, and calculations fall back to sorting the dirty cells
+ * themselves.  The order gets rebuilt once a cell is removed.</p>
+ */
+class dependency_graph
+{
+    struct node
+    {
+        abs_address_t pos;
+
+        /** position of the cell in the order. */
+        size_t rank;
+
+        /** ids of the cells this cell references. */
+        std::vector<size_t> precedents;
+
+        /** ids of the cells that reference this cell. */
+        std::vector<size_t> dependents;
+
+        /** false when the id is free to be reused. */
+        bool alive;
+
+        /** true until the relationships of the cell have been resolved. */
+        bool added;
+
+        node() : rank(0), alive(false), added(false) {}
+    };
+
+    typedef std::unordered_map<abs_address_t, size_t, abs_address_t::hash> id_map_type;
+
+public:
+    dependency_graph();
+
+    dependency_graph(const dependency_graph&) = delete;
+    dependency_graph& operator= (const dependency_graph&) = delete;
+
+    /**
+     * Add a formula cell.  If the cell has already been added, its
+     * relationships are resolved again.
+     *
+     * @param pos address of the formula cell.
+     */
+    void add_cell(const abs_address_t& pos);
+
+    /**
+     * Remove a formula cell along with all its relationships.  If the cell
+     * has not been added, it does nothing.
+     *
+     * @param pos address of the formula cell.
+     */
+    void remove_cell(const abs_address_t& pos);
+
+    /**
+     * Pick the cells to calculate out of the order, along with the
+     * relationships among them.  It resolves the relationships of the cells
+     * added since the last call first.
+     *
+     * @param cxt model context, used to look up the references of the
+     *            cells.
+     * @param cells cells to calculate.
+     * @param sorted receives the cells in order of calculation.
+     *
+     * @return true if the cells have been sorted, or false if any of them
+     *         has not been added, or the cells form any circular reference,
+     *         in which case the caller needs to sort them by itself.
+     */
+    bool sort_cells(
+        iface::formula_model_access& cxt, const dirty_formula_cells_t& cells,
+        sorted_dependencies& sorted);
+
+    /**
+     * @return number of cells in the graph.
+     */
+    size_t size() const;
+
+private:
+    size_t find_cell(const abs_address_t& pos) const;
+
+    void remove_node(size_t id);
+
+    /**
+     * Resolve the relationships of the cells added since the last call, and
+     * bring the order up to date.
+     */
+    void resolve(iface::formula_model_access& cxt);
+
+    /**
+     * Start a new search, which marks no cell as visited yet.
+     */
+    void start_search();
+
+    /**
+     * Insert a relationship, and move the cells in between its ends when it
+     * goes against the order.
+     *
+     * @param precedent id of the cell being referenced.
+     * @param dependent id of the cell referencing it.
+     */
+    void insert_edge(size_t precedent, size_t dependent);
+
+    /**
+     * Sort all cells from scratch.  It leaves the order marked as cyclic if
+     * not all cells could be sorted.
+     */
+    void rebuild_order();
+
+    std::vector<node> m_nodes;
+    std::vector<size_t> m_free_ids;
+    id_map_type m_ids;
+
+    /** addresses of all cells, for looking up the cells in ranges. */
+    abs_address_set m_positions;
+
+    /** ids of the cells whose relationships have not been resolved. */
+    std::vector<size_t> m_added;
+
+    size_t m_next_rank;
+
+    /** true while the order is not maintained. */
+    bool m_cyclic;
+
+    /** true when the order needs to be rebuilt before it's used. */
+    bool m_rebuild;
+
+    /** mark of each cell visited by the current search, by its id. */
+    std::vector<size_t> m_marks;
+    size_t m_mark;
+
+    /** position of each marked cell among the cells being sorted. */
+    std::vector<size_t> m_slots;
+
+    /**
+     * Calculations may run on other threads than the one registering the
+     * cells, so all calls are serialized.
+     */
+    mutable boost::mutex m_mtx;
+};
+
+}
+
+#endif
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -6,17 +6,23 @@
  */
 
 #include "depends_tracker.hpp"
+#include "early_cutoff.hpp"
 
 #include "ixion/global.hpp"
 #include "ixion/cell.hpp"
 #include "ixion/cell_queue_manager.hpp"
+#include "ixion/config.hpp"
+#include "ixion/formula.hpp"
 #include "ixion/formula_name_resolver.hpp"
 
 #include "ixion/interface/formula_model_access.hpp"
 
+#include <algorithm>
+#include <memory>
 #include <vector>
 #include <iostream>
 #include <fstream>
+#include <unordered_map>
 
 #define DEBUG_DEPENDS_TRACKER 0
 
@@ -43,6 +49,18 @@ private:
 };
 #endif
 
+/**
+ * Order cell addresses by sheet, column and row.
+ */
+bool less_by_column(const abs_address_t& left, const abs_address_t& right)
+{
+    if (left.sheet != right.sheet)
+        return left.sheet < right.sheet;
+    if (left.column != right.column)
+        return left.column < right.column;
+    return left.row < right.row;
+}
+
 /**
  * Function object to reset the status of formula cell to pre-interpretation
  * status.
@@ -59,44 +77,6 @@ public:
     }
 };
 
-class circular_check_handler : public unary_function<abs_address_t, void>
-{
-    iface::formula_model_access& m_cxt;
-public:
-    circular_check_handler(iface::formula_model_access& cxt) : m_cxt(cxt) {}
-
-    void operator() (const abs_address_t& pos) const
-    {
-        formula_cell* p = m_cxt.get_formula_cell(pos);
-        p->check_circular(m_cxt, pos);
-    }
-};
-
-class thread_queue_handler : public unary_function<abs_address_t, void>
-{
-    iface::formula_model_access& m_cxt;
-public:
-    thread_queue_handler(iface::formula_model_access& cxt) : m_cxt(cxt) {}
-    void operator() (const abs_address_t& pos) const
-    {
-        cell_queue_manager::add_cell(pos);
-    }
-};
-
-struct cell_interpret_handler : public unary_function<abs_address_t, void>
-{
-    cell_interpret_handler(iface::formula_model_access& cxt) :
-        m_context(cxt) {}
-
-    void operator() (const abs_address_t& pos) const
-    {
-        formula_cell* p = m_context.get_formula_cell(pos);
-        p->interpret(m_context, pos);
-    }
-private:
-    iface::formula_model_access& m_context;
-};
-
 }
 
 dependency_tracker::cell_back_inserter::cell_back_inserter(vector<abs_address_t> & sorted_cells) :
@@ -110,17 +90,34 @@ void dependency_tracker::cell_back_inserter::operator() (const abs_address_t& ce
 // ============================================================================
 
 dependency_tracker::dependency_tracker(
-    const dirty_formula_cells_t& dirty_cells, iface::formula_model_access& cxt) :
-    m_dirty_cells(dirty_cells), m_context(cxt)
+    const dirty_formula_cells_t& dirty_cells, iface::formula_model_access& cxt,
+    const modified_cells_t* modified_cells) :
+    m_dirty_cells(dirty_cells), m_context(cxt), m_presorted(false), m_early_cutoff(modified_cells != nullptr)
 {
+    if (modified_cells)
+        m_modified_cells.insert(modified_cells->begin(), modified_cells->end());
+
+    dependency_graph* graph = cxt.get_dependency_graph();
+    if (graph)
+        m_presorted = graph->sort_cells(cxt, dirty_cells, m_sorted);
 }
 
 dependency_tracker::~dependency_tracker()
 {
 }
 
+bool dependency_tracker::needs_references() const
+{
+    // The early cutoff still needs to know which cells reference the
+    // modified cells.
+    return !m_presorted || m_early_cutoff;
+}
+
 void dependency_tracker::insert_depend(const abs_address_t& origin_cell, const abs_address_t& depend_cell)
 {
+    if (m_presorted)
+        return;
+
 #if DEBUG_DEPENDS_TRACKER
     const formula_name_resolver& resolver = m_context.get_name_resolver();
     __IXION_DEBUG_OUT__ << resolver.get_name(origin_cell, false) << "->" << resolver.get_name(depend_cell, false) << endl;
@@ -128,54 +125,389 @@ void dependency_tracker::insert_depend(const abs_address_t& origin_cell, const a
     m_deps.insert(origin_cell, depend_cell);
 }
 
-void dependency_tracker::interpret_all_cells(size_t thread_count)
+void dependency_tracker::insert_input_depend(const abs_address_t& origin_cell, const abs_address_t& input_cell)
 {
-    vector<abs_address_t> sorted_cells;
-    topo_sort_cells(sorted_cells);
+    if (m_early_cutoff && m_modified_cells.count(input_cell))
+        m_required_cells.insert(origin_cell);
+}
+
+void dependency_tracker::insert_range_depend(const abs_address_t& origin_cell, const abs_range_t& range)
+{
+    if (m_early_cutoff && m_modified_cells.intersects(range))
+        m_required_cells.insert(origin_cell);
+
+    if (m_presorted)
+        return;
+
+    // Look up the dirty cells in each column of the range, rather than
+    // checking every cell in the range.
+    m_range_cells.clear();
+    m_dirty_cells.get_addresses(range, m_range_cells);
+    vector<abs_address_t>::const_iterator it = m_range_cells.begin(), it_end = m_range_cells.end();
+    for (; it != it_end; ++it)
+        insert_depend(origin_cell, *it);
+}
+
+void dependency_tracker::interpret_all_cells(size_t thread_count, calc_status* status)
+{
+    // Start a new epoch unless the cells have just been looked up in the
+    // current one, so that the volatile functions all see the time of this
+    // calculation.
+    calc_epoch* epoch = m_context.get_calc_epoch();
+    if (epoch)
+    {
+        if (!epoch->keep)
+            start_calc_epoch(m_context);
+        epoch->keep = false;
+    }
+
+    if (!m_presorted)
+    {
+        vector<abs_address_t> all_cells(m_dirty_cells.begin(), m_dirty_cells.end());
+        vector<abs_address_t> sorted_cells;
+        sorted_cells.reserve(all_cells.size());
+        cell_back_inserter handler(sorted_cells);
+        dfs_type dfs(all_cells, m_deps, handler);
+        dfs.run();
+
+        size_t n = dfs.size();
+        m_sorted.cells.resize(n);
+        m_sorted.circular.resize(n);
+        m_sorted.components.resize(n);
+        for (size_t i = 0; i < n; ++i)
+        {
+            m_sorted.cells[i] = dfs.get_cell(i);
+            m_sorted.circular[i] = dfs.is_circular(i);
+            m_sorted.components[i] = dfs.get_component(i);
+        }
+
+        m_sorted.sorted = dfs.get_sorted_indices();
+        m_sorted.precedent_offsets = dfs.get_precedent_offsets();
+        m_sorted.precedents = dfs.get_precedents();
+    }
+
+    const sorted_dependencies& deps = m_sorted;
+    if (status)
+        status->cell_count = deps.cells.size();
 
 #if DEBUG_DEPENDS_TRACKER
     __IXION_DEBUG_OUT__ << "Topologically sorted cells ---------------------------------" << endl;
-    for_each(sorted_cells.begin(), sorted_cells.end(), cell_printer(m_context));
+    for (size_t i = 0, n = deps.sorted.size(); i < n; ++i)
+        cell_printer(m_context)(deps.cells[deps.sorted[i]]);
 #endif
 
-    // Reset cell status.
+    // Reset cell status.  For the early cutoff, keep the previous results
+    // aside by the id of each cell.
 #if DEBUG_DEPENDS_TRACKER
     __IXION_DEBUG_OUT__ << "Reset cell status ------------------------------------------" << endl;
 #endif
-    for_each(sorted_cells.begin(), sorted_cells.end(), cell_reset_handler(m_context));
+    vector<previous_result> results;
+    if (m_early_cutoff)
+    {
+        results.resize(deps.cells.size());
+        for (size_t i = 0, n = deps.cells.size(); i < n; ++i)
+        {
+            formula_cell* p = m_context.get_formula_cell(deps.cells[i]);
+            results[i].available = p->release_result(results[i].result);
+        }
+    }
+    else
+        for_each(deps.cells.begin(), deps.cells.end(), cell_reset_handler(m_context));
 
-    // First, detect circular dependencies and mark those circular
-    // dependent cells with appropriate error flags.
+    // Mark the cells that the sort has found to be part of circular
+    // dependencies with appropriate error flags.  The cells depending on
+    // them pick up the error when they get interpreted.
 #if DEBUG_DEPENDS_TRACKER
-    __IXION_DEBUG_OUT__ << "Check circular dependencies --------------------------------" << endl;
+    __IXION_DEBUG_OUT__ << "Mark circular dependencies ---------------------------------" << endl;
 #endif
-    for_each(sorted_cells.begin(), sorted_cells.end(), circular_check_handler(m_context));
+    // When they are to be calculated iteratively, they start from 0
+    // instead.
+    const config& cfg = m_context.get_config();
+    bool has_circular = false;
+    for (size_t i = 0, n = deps.cells.size(); i < n; ++i)
+    {
+        if (!deps.circular[i])
+            continue;
+
+        has_circular = true;
+        formula_cell* p = m_context.get_formula_cell(deps.cells[i]);
+        if (cfg.iterative_calc)
+            p->start_iteration();
+        else
+            p->set_circular();
+
+        if (!results.empty())
+        {
+            // Circular references are always calculated.
+            results[i].available = false;
+        }
+    }
 
-    if (thread_count > 0)
+    std::unique_ptr<early_cutoff> cutoff;
+    if ((cfg.iterative_calc && has_circular) || (!thread_count && cfg.calc_mode != calc_mode_t::deterministic))
     {
-        // Interpret cells in topological order using threads.
-        cell_queue_manager::init(thread_count, m_context);
-        for_each(sorted_cells.begin(), sorted_cells.end(), thread_queue_handler(m_context));
-        cell_queue_manager::terminate();
+        // Interpret cells using just a single thread, in the sorted order.
+        // The cells of each circular reference are contiguous in it, which
+        // is needed to iterate them.
+        if (m_early_cutoff)
+        {
+            vector<size_t> ids(deps.cells.size());
+            for (size_t i = 0, n = ids.size(); i < n; ++i)
+                ids[i] = i;
+
+            cutoff = create_early_cutoff(deps, ids, results);
+        }
+
+        interpret_sorted_cells(deps, cutoff.get(), status);
     }
     else
     {
-        // Interpret cells using just a single thread.
-        for_each(sorted_cells.begin(), sorted_cells.end(), cell_interpret_handler(m_context));
+        cell_dependency_graph graph;
+        vector<size_t> ids;
+        build_dependency_graph(deps, graph, ids);
+        if (m_early_cutoff)
+        {
+            cutoff = create_early_cutoff(deps, ids, results);
+            graph.cutoff = cutoff.get();
+        }
+
+        if (thread_count > 0)
+        {
+            // Interpret cells in order of dependency using threads.
+            std::shared_ptr<cell_queue_manager> queue = m_context.get_cell_queue_manager(thread_count);
+            if (queue)
+                queue->run(m_context, graph, status);
+            else
+            {
+                // The model doesn't keep its own worker threads.  Spawn them
+                // just for this calculation.
+                cell_queue_manager temp_queue(thread_count, cfg.pin_threads);
+                temp_queue.run(m_context, graph, status);
+            }
+        }
+        else
+        {
+            // Interpret cells in the same canonical order that the
+            // calculation threads would use.
+            for (size_t i = 0, n = graph.cells.size(); i < n; ++i)
+            {
+                if (status && status->cancelled)
+                    break;
+
+                if (cutoff)
+                    cutoff->interpret(graph, i, m_context, m_context.get_session_handler());
+                else
+                {
+                    formula_cell* p = m_context.get_formula_cell(graph.cells[i]);
+                    p->interpret(m_context, graph.cells[i]);
+                }
+
+                if (status)
+                    ++status->calculated_count;
+            }
+        }
     }
+
+    if (cutoff && status)
+        status->skipped_count += cutoff->get_skipped_count();
 }
 
-void dependency_tracker::topo_sort_cells(vector<abs_address_t>& sorted_cells) const
+std::unique_ptr<early_cutoff> dependency_tracker::create_early_cutoff(
+    const sorted_dependencies& deps, const vector<size_t>& ids, vector<previous_result>& results) const
 {
-    cell_back_inserter handler(sorted_cells);
-    vector<abs_address_t> all_cells;
-    all_cells.reserve(m_dirty_cells.size());
-    dirty_formula_cells_t::const_iterator itr = m_dirty_cells.begin(), itr_end = m_dirty_cells.end();
-    for (; itr != itr_end; ++itr)
-        all_cells.push_back(*itr);
-
-    dfs_type dfs(all_cells, m_deps.get(), handler);
-    dfs.run();
+    vector<previous_result> ordered(ids.size());
+    for (size_t i = 0, n = ids.size(); i < n; ++i)
+        ordered[i] = results[ids[i]];
+
+    std::unique_ptr<early_cutoff> cutoff(new early_cutoff(ordered));
+    for (size_t i = 0, n = ids.size(); i < n; ++i)
+    {
+        const abs_address_t& pos = deps.cells[ids[i]];
+        if (m_required_cells.count(pos) || m_modified_cells.count(pos))
+            cutoff->require(i);
+    }
+
+    return cutoff;
+}
+
+void dependency_tracker::interpret_sorted_cells(const sorted_dependencies& deps, early_cutoff* cutoff, calc_status* status)
+{
+    const config& cfg = m_context.get_config();
+    const vector<size_t>& sorted = deps.sorted;
+    const vector<size_t>& precedent_offsets = deps.precedent_offsets;
+    const vector<size_t>& precedents = deps.precedents;
+    size_t n = sorted.size();
+
+    // Whether the result of each cell has changed, by the id of the cell.
+    vector<bool> changed;
+    if (cutoff)
+        changed.resize(n, false);
+
+    size_t i = 0;
+    while (i < n)
+    {
+        if (status && status->cancelled)
+            break;
+
+        size_t id = sorted[i];
+        if (!cfg.iterative_calc || !deps.circular[id])
+        {
+            const abs_address_t& pos = deps.cells[id];
+            formula_cell* p = m_context.get_formula_cell(pos);
+            if (cutoff)
+            {
+                for (size_t j = precedent_offsets[id]; j < precedent_offsets[id+1]; ++j)
+                {
+                    if (changed[precedents[j]])
+                    {
+                        cutoff->require(id);
+                        break;
+                    }
+                }
+
+                changed[id] = cutoff->interpret(id, *p, m_context, pos, m_context.get_session_handler());
+            }
+            else
+                p->interpret(m_context, pos);
+
+            if (status)
+                ++status->calculated_count;
+
+            ++i;
+            continue;
+        }
+
+        size_t end = i + 1;
+        while (end < n && deps.components[sorted[end]] == deps.components[id])
+            ++end;
+
+        // Interpret only the cells of this circular reference, until no
+        // value changes by more than the epsilon.
+        for (size_t iteration = 0; iteration < cfg.max_iterations; ++iteration)
+        {
+            double change = 0.0;
+            for (size_t j = i; j < end; ++j)
+            {
+                const abs_address_t& pos = deps.cells[sorted[j]];
+                change = std::max(change, m_context.get_formula_cell(pos)->interpret_iteration(m_context, pos));
+            }
+
+            if (change <= cfg.iteration_epsilon)
+                break;
+        }
+
+        if (cutoff)
+        {
+            for (size_t j = i; j < end; ++j)
+                changed[sorted[j]] = true;
+        }
+
+        if (status)
+            status->calculated_count += end - i;
+
+        i = end;
+    }
+}
+
+void dependency_tracker::build_dependency_graph(
+    const sorted_dependencies& deps, cell_dependency_graph& graph, vector<size_t>& ids) const
+{
+    const vector<size_t>& sorted = deps.sorted;
+    const vector<size_t>& precedent_offsets = deps.precedent_offsets;
+    const vector<size_t>& precedents = deps.precedents;
+    size_t n = sorted.size();
+
+    // Position of each cell in the sorted order.
+    vector<size_t> positions(n);
+    for (size_t i = 0; i < n; ++i)
+        positions[sorted[i]] = i;
+
+    // Compute the level of each cell, and count the dependency edges.  Only
+    // those edges that point to a precedent earlier in the sorted order are
+    // used; the rest are part of circular references.  Visiting the cells
+    // in sorted order ensures that the level of each precedent cell is
+    // final by the time it's used.
+    vector<size_t> levels(n, 0);
+    size_t level_count = n ? 1 : 0;
+    size_t edge_count = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        size_t id = sorted[i];
+        for (size_t j = precedent_offsets[id]; j < precedent_offsets[id+1]; ++j)
+        {
+            size_t precedent = positions[precedents[j]];
+            if (precedent >= i)
+                continue;
+
+            levels[i] = std::max(levels[i], levels[precedent] + 1);
+            ++edge_count;
+        }
+        level_count = std::max(level_count, levels[i] + 1);
+    }
+
+    // Sort the cells by level, then by sheet, column and row.
+    vector<size_t> order(n);
+    for (size_t i = 0; i < n; ++i)
+        order[i] = i;
+
+    std::sort(order.begin(), order.end(),
+        [&levels, &sorted, &deps](size_t left, size_t right) -> bool
+        {
+            if (levels[left] != levels[right])
+                return levels[left] < levels[right];
+
+            return less_by_column(deps.cells[sorted[left]], deps.cells[sorted[right]]);
+        }
+    );
+
+    // Final position of each cell in the graph.
+    vector<size_t> final_positions(n);
+    graph.cells.resize(n);
+    ids.resize(n);
+    graph.level_offsets.assign(level_count+1, 0);
+    for (size_t i = 0; i < n; ++i)
+    {
+        final_positions[sorted[order[i]]] = i;
+        graph.cells[i] = deps.cells[sorted[order[i]]];
+        ids[i] = sorted[order[i]];
+        ++graph.level_offsets[levels[order[i]]+1];
+    }
+
+    for (size_t i = 0; i < level_count; ++i)
+        graph.level_offsets[i+1] += graph.level_offsets[i];
+
+    // Build the dependent lists, using the same edges as above.
+    graph.precedent_counts.assign(n, 0);
+    graph.dependent_offsets.assign(n+1, 0);
+    for (size_t i = 0; i < n; ++i)
+    {
+        size_t id = sorted[order[i]];
+        for (size_t j = precedent_offsets[id]; j < precedent_offsets[id+1]; ++j)
+        {
+            size_t precedent = precedents[j];
+            if (positions[precedent] >= order[i])
+                continue;
+
+            ++graph.precedent_counts[i];
+            ++graph.dependent_offsets[final_positions[precedent]+1];
+        }
+    }
+
+    for (size_t i = 0; i < n; ++i)
+        graph.dependent_offsets[i+1] += graph.dependent_offsets[i];
+
+    graph.dependents.resize(edge_count);
+    vector<size_t> filled(graph.dependent_offsets.begin(), graph.dependent_offsets.end()-1);
+    for (size_t i = 0; i < n; ++i)
+    {
+        size_t id = sorted[order[i]];
+        for (size_t j = precedent_offsets[id]; j < precedent_offsets[id+1]; ++j)
+        {
+            size_t precedent = precedents[j];
+            if (positions[precedent] < order[i])
+                graph.dependents[filled[final_positions[precedent]]++] = i;
+        }
+    }
 }
 
 }
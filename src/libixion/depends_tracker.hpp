@@ -8,16 +8,24 @@
 #ifndef __DEPENDS_TRACKER_HPP__
 #define __DEPENDS_TRACKER_HPP__
 
+#include "ixion/address_set.hpp"
 #include "ixion/formula_parser.hpp"
 #include "ixion/depth_first_search.hpp"
 
+#include "dependency_graph.hpp"
+
+#include <memory>
 #include <set>
 #include <string>
 #include <vector>
 
 namespace ixion {
 
+class early_cutoff;
 class formula_cell;
+struct cell_dependency_graph;
+struct previous_result;
+struct calc_status;
 
 namespace iface {
 
@@ -29,6 +37,10 @@ class formula_model_access;
  * This class keeps track of inter-cell dependencies.  Each formula cell
  * item stores pointers to other cells that it depends on (precedent cells).
  * This information is used to build a complete dependency tree.
+ *
+ * When the model keeps a dependency graph of all its formula cells, the
+ * dirty cells are taken in the order kept there, and the dependency
+ * relationships inserted are not needed.
  */
 class dependency_tracker
 {
@@ -44,9 +56,30 @@ class dependency_tracker
     typedef depth_first_search<abs_address_t, cell_back_inserter, abs_address_t::hash> dfs_type;
 
 public:
-    dependency_tracker(const dirty_formula_cells_t& dirty_cells, iface::formula_model_access& cxt);
+    /**
+     * Constructor.
+     *
+     * @param dirty_cells all dirty cells to be calculated.
+     * @param cxt model context.
+     * @param modified_cells cells modified since the last calculation.
+     *                       When given, each dirty cell keeps its previous
+     *                       result instead of getting interpreted, unless
+     *                       it references any of these cells or any dirty
+     *                       cell whose result has changed.  When NULL, all
+     *                       dirty cells get interpreted.
+     */
+    dependency_tracker(
+        const dirty_formula_cells_t& dirty_cells, iface::formula_model_access& cxt,
+        const modified_cells_t* modified_cells = nullptr);
     ~dependency_tracker();
 
+    /**
+     * @return true if the references of the dirty cells need to be
+     *         inserted before the cells get interpreted, or false if the
+     *         cells have already been sorted.
+     */
+    bool needs_references() const;
+
     /**
      * Insert a single dependency relationship.
      *
@@ -55,18 +88,83 @@ public:
      */
     void insert_depend(const abs_address_t& origin_cell, const abs_address_t& depend_cell);
 
-    void interpret_all_cells(size_t thread_count);
+    /**
+     * Insert a reference from a cell to a cell that is not dirty.  It
+     * requires the referencing cell to be interpreted if the referenced
+     * cell has been modified.
+     *
+     * @param origin_cell cell that references <code>input_cell</code>.
+     * @param input_cell cell that is not dirty.
+     */
+    void insert_input_depend(const abs_address_t& origin_cell, const abs_address_t& input_cell);
+
+    /**
+     * Insert dependency relationships between a cell and all dirty cells
+     * within a range that it references.
+     *
+     * @param origin_cell cell that references the range.
+     * @param range range referenced by <code>origin_cell</code>.
+     */
+    void insert_range_depend(const abs_address_t& origin_cell, const abs_range_t& range);
 
     /**
-     * Perform topological sort on all cell instances, and returns an array of
-     * cells that are sorted in order of dependency.
+     * Interpret all dirty cells in order of dependency.
+     *
+     * @param thread_count number of calculation threads to use, or 0 to
+     *                     interpret all cells on the calling thread.
+     * @param status optional progress and cancellation state.
      */
-    void topo_sort_cells(std::vector<abs_address_t>& sorted_cells) const;
+    void interpret_all_cells(size_t thread_count, calc_status* status = nullptr);
 
 private:
+    /**
+     * Interpret all dirty cells on the calling thread in sorted order.  In
+     * iterative calculation, the cells of each circular reference are
+     * calculated iteratively.
+     *
+     * @param deps sorted cells.
+     * @param cutoff previous results of the cells by their ids, or NULL to
+     *               interpret all cells.
+     * @param status optional progress and cancellation state.
+     */
+    void interpret_sorted_cells(const sorted_dependencies& deps, early_cutoff* cutoff, calc_status* status);
+
+    /**
+     * Set up the early cutoff for the cells in an order of calculation.
+     *
+     * @param deps sorted cells.
+     * @param ids id of the cell at each position in the order.
+     * @param results previous results of the cells by their ids.  They are
+     *                moved to the early cutoff.
+     */
+    std::unique_ptr<early_cutoff> create_early_cutoff(
+        const sorted_dependencies& deps, const std::vector<size_t>& ids, std::vector<previous_result>& results) const;
+
+    /**
+     * Build a dependency graph of sorted cells for parallel interpretation.
+     *
+     * @param deps sorted cells.
+     * @param graph dependency graph to populate.
+     * @param ids id of the cell at each position of the graph.
+     */
+    void build_dependency_graph(const sorted_dependencies& deps, cell_dependency_graph& graph, std::vector<size_t>& ids) const;
+
     dfs_type::precedent_set m_deps;
     const dirty_formula_cells_t& m_dirty_cells;
+
+    /** dirty cells within the range being looked up. */
+    std::vector<abs_address_t> m_range_cells;
     iface::formula_model_access& m_context;
+
+    /** dirty cells taken in order from the dependency graph of the model. */
+    sorted_dependencies m_sorted;
+    bool m_presorted;
+
+    bool m_early_cutoff;
+    abs_address_set m_modified_cells;
+
+    /** cells that reference modified cells. */
+    abs_address_set m_required_cells;
 };
 
 }
@@ -0,0 +1,73 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "early_cutoff.hpp"
+
+#include "ixion/cell.hpp"
+#include "ixion/cell_queue_manager.hpp"
+#include "ixion/interface/formula_model_access.hpp"
+
+namespace ixion {
+
+previous_result::previous_result() : available(false) {}
+
+early_cutoff::early_cutoff(std::vector<previous_result>& results) :
+    m_required(new std::atomic<bool>[results.size()]),
+    m_skipped_count(0)
+{
+    m_results.swap(results);
+    for (size_t i = 0, n = m_results.size(); i < n; ++i)
+        m_required[i].store(false, std::memory_order_relaxed);
+}
+
+void early_cutoff::require(size_t pos)
+{
+    m_required[pos].store(true, std::memory_order_relaxed);
+}
+
+bool early_cutoff::interpret(
+    size_t pos, formula_cell& cell, iface::formula_model_access& context, const abs_address_t& addr,
+    iface::session_handler* handler)
+{
+    const previous_result& previous = m_results[pos];
+    if (previous.available && !m_required[pos].load(std::memory_order_relaxed))
+    {
+        // None of its precedent cells has changed.
+        cell.restore_result(previous.result);
+        m_skipped_count.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    cell.interpret(context, addr, handler);
+    if (!previous.available)
+        return true;
+
+    formula_result result;
+    return !cell.get_result_cache(result) || result != previous.result;
+}
+
+void early_cutoff::interpret(
+    const cell_dependency_graph& graph, size_t pos, iface::formula_model_access& context,
+    iface::session_handler* handler)
+{
+    const abs_address_t& addr = graph.cells[pos];
+    formula_cell* p = context.get_formula_cell(addr);
+    if (!interpret(pos, *p, context, addr, handler))
+        return;
+
+    for (size_t i = graph.dependent_offsets[pos]; i < graph.dependent_offsets[pos+1]; ++i)
+        require(graph.dependents[i]);
+}
+
+size_t early_cutoff::get_skipped_count() const
+{
+    return m_skipped_count.load();
+}
+
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
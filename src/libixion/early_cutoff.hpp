@@ -0,0 +1,117 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef __IXION_EARLY_CUTOFF_HPP__
+#define __IXION_EARLY_CUTOFF_HPP__
+
+#include "ixion/address.hpp"
+#include "ixion/formula_result.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+namespace ixion {
+
+class formula_cell;
+struct cell_dependency_graph;
+
+namespace iface {
+
+class formula_model_access;
+class session_handler;
+
+}
+
+/**
+ * Result of a cell from before it got reset for calculation.
+ */
+struct previous_result
+{
+    formula_result result;
+
+    /** false when the cell had no result. */
+    bool available;
+
+    previous_result();
+};
+
+/**
+ * Previous results of the cells being calculated, which the cells keep
+ * instead of getting interpreted when none of their precedent cells has
+ * changed.  Each cell is referred to by its position in the order of
+ * calculation.
+ *
+ * <p>A cell is required to be interpreted when it has no previous result,
+ * or when it has been marked by require().  The caller marks the cells
+ * that reference modified cells before the calculation, and the dependent
+ * cells of each cell whose result has changed during the calculation.</p>
+ */
+class early_cutoff
+{
+public:
+    /**
+     * @param results previous results of the cells.  They are moved to the
+     *                instance.
+     */
+    explicit early_cutoff(std::vector<previous_result>& results);
+
+    early_cutoff(const early_cutoff&) = delete;
+    early_cutoff& operator= (const early_cutoff&) = delete;
+
+    /**
+     * Require a cell to be interpreted.  It may be called concurrently for
+     * the same cell, but must happen before the cell gets interpreted.
+     */
+    void require(size_t pos);
+
+    /**
+     * Interpret a cell if it's required, or else put its previous result
+     * back.
+     *
+     * @param pos position of the cell.
+     * @param cell cell to interpret.
+     * @param context model context.
+     * @param addr address of the cell.
+     * @param handler session handler to report the interpretation to.
+     *
+     * @return true if the result of the cell has changed, false otherwise.
+     */
+    bool interpret(
+        size_t pos, formula_cell& cell, iface::formula_model_access& context, const abs_address_t& addr,
+        iface::session_handler* handler);
+
+    /**
+     * Interpret a cell of a dependency graph like above, and require the
+     * dependent cells of the cell when its result has changed.
+     *
+     * @param graph dependency graph whose cell positions this instance
+     *              refers to.
+     * @param pos position of the cell in the graph.
+     * @param context model context.
+     * @param handler session handler to report the interpretation to.
+     */
+    void interpret(
+        const cell_dependency_graph& graph, size_t pos, iface::formula_model_access& context,
+        iface::session_handler* handler);
+
+    /**
+     * @return number of cells that have kept their previous results.
+     */
+    size_t get_skipped_count() const;
+
+private:
+    std::vector<previous_result> m_results;
+    std::unique_ptr<std::atomic<bool>[]> m_required;
+    std::atomic<size_t> m_skipped_count;
+};
+
+}
+
+#endif
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
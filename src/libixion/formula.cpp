@@ -12,15 +12,23 @@
 #include "ixion/formula_function_opcode.hpp"
 #include "ixion/cell.hpp"
 #include "ixion/cell_listener_tracker.hpp"
+#include "ixion/cell_queue_manager.hpp"
+#include "ixion/config.hpp"
+#include "ixion/exceptions.hpp"
 #include "ixion/types.hpp"
 
 #include "function_objects.hpp"
 #include "formula_functions.hpp"
 #include "depends_tracker.hpp"
+#include "dependency_graph.hpp"
 
 #define DEBUG_FORMULA_API 0
 
 #include <sstream>
+#include <atomic>
+#include <exception>
+
+#include <boost/thread.hpp>
 
 #if DEBUG_FORMULA_API
 #include <iostream>
@@ -163,6 +171,74 @@ bool has_volatile(const formula_tokens_t& tokens)
     return false;
 }
 
+const formula_tokens_t* get_cell_tokens(
+    const iface::formula_model_access& cxt, const abs_address_t& pos, const formula_cell& cell)
+{
+    if (cell.is_shared())
+        return cxt.get_shared_formula_tokens(pos.sheet, cell.get_identifier());
+
+    return cxt.get_formula_tokens(pos.sheet, cell.get_identifier());
+}
+
+/**
+ * Check if the references of a formula cell can be tracked as part of the
+ * block of cells sharing its formula.
+ */
+bool in_shared_block(const iface::formula_model_access& cxt, const abs_address_t& pos, const formula_cell& cell)
+{
+    if (!cell.is_shared())
+        return false;
+
+    abs_range_t range = cxt.get_shared_formula_range(pos.sheet, cell.get_identifier());
+    return range.contains(pos);
+}
+
+/**
+ * Get the references of a shared formula, relative to the cell using it.
+ */
+void get_shared_references(
+    const iface::formula_model_access& cxt, const abs_address_t& pos, formula_cell& cell,
+    cell_listener_tracker::shared_references_type& refs)
+{
+    std::vector<const formula_token_base*> ref_tokens;
+    cell.get_ref_tokens(cxt, pos, ref_tokens);
+    std::vector<const formula_token_base*>::const_iterator it = ref_tokens.begin(), it_end = ref_tokens.end();
+    for (; it != it_end; ++it)
+    {
+        const formula_token_base& t = **it;
+        switch (t.get_opcode())
+        {
+            case fop_single_ref:
+                refs.cells.push_back(t.get_single_ref());
+            break;
+            case fop_range_ref:
+                refs.ranges.push_back(t.get_range_ref());
+            break;
+            default:
+                ; // ignore the rest.
+        }
+    }
+}
+
+/** shared formula cell, with the identifier of its formula tokens. */
+typedef std::pair<size_t, abs_address_t> shared_cell_type;
+
+/**
+ * Order shared formula cells by sheet and formula first, then by column and
+ * row, so that the cells in the same column of a block are next to each
+ * other.
+ */
+bool less_by_block(const shared_cell_type& left, const shared_cell_type& right)
+{
+    if (left.second.sheet != right.second.sheet)
+        return left.second.sheet < right.second.sheet;
+    if (left.first != right.first)
+        return left.first < right.first;
+    if (left.second.column != right.second.column)
+        return left.second.column < right.second.column;
+    return left.second.row < right.second.row;
+}
+
 }
 
 void register_formula_cell(iface::formula_model_access& cxt, const abs_address_t& pos)
@@ -172,16 +248,134 @@ void register_formula_cell(iface::formula_model_access& cxt, const abs_address_t
         // Not a formula cell. Bail out.
         return;
 
-    std::vector<const formula_token_base*> ref_tokens;
-    cell->get_ref_tokens(cxt, pos, ref_tokens);
-    std::for_each(ref_tokens.begin(), ref_tokens.end(),
-             formula_cell_listener_handler(cxt,
-                 pos, formula_cell_listener_handler::mode_add));
+    cell_listener_tracker& tracker = cxt.get_cell_listener_tracker();
+    if (in_shared_block(cxt, pos, *cell))
+    {
+        cell_listener_tracker::shared_references_type refs;
+        get_shared_references(cxt, pos, *cell, refs);
+        abs_range_t range;
+        range.first = range.last = pos;
+        tracker.add_shared(range, cell->get_identifier(), refs);
+    }
+    else
+    {
+        std::vector<const formula_token_base*> ref_tokens;
+        cell->get_ref_tokens(cxt, pos, ref_tokens);
+        std::for_each(ref_tokens.begin(), ref_tokens.end(),
+                 formula_cell_listener_handler(cxt,
+                     pos, formula_cell_listener_handler::mode_add));
+    }
 
     // Check if the cell is volatile.
-    const formula_tokens_t* tokens = cxt.get_formula_tokens(pos.sheet, cell->get_identifier());
+    const formula_tokens_t* tokens = get_cell_tokens(cxt, pos, *cell);
     if (tokens && has_volatile(*tokens))
-        cxt.get_cell_listener_tracker().add_volatile(pos);
+        tracker.add_volatile(pos);
+
+    dependency_graph* graph = cxt.get_dependency_graph();
+    if (graph)
+        graph->add_cell(pos);
+}
+
+void register_formula_cells(iface::formula_model_access& cxt, const std::vector<abs_address_t>& cells)
+{
+    cell_listener_tracker& tracker = cxt.get_cell_listener_tracker();
+    dependency_graph* graph = cxt.get_dependency_graph();
+    std::vector<cell_listener_tracker::cell_reference_type> cell_refs;
+    std::vector<cell_listener_tracker::range_reference_type> range_refs;
+    std::vector<shared_cell_type> shared_cells;
+    std::vector<const formula_token_base*> ref_tokens;
+
+    std::vector<abs_address_t>::const_iterator it = cells.begin(), it_end = cells.end();
+    for (; it != it_end; ++it)
+    {
+        const abs_address_t& pos = *it;
+        formula_cell* cell = cxt.get_formula_cell(pos);
+        if (!cell)
+            // Not a formula cell.  Skip it.
+            continue;
+
+        if (graph)
+            graph->add_cell(pos);
+
+        // Check if the cell is volatile.
+        const formula_tokens_t* tokens = get_cell_tokens(cxt, pos, *cell);
+        if (tokens && has_volatile(*tokens))
+            tracker.add_volatile(pos);
+
+        if (in_shared_block(cxt, pos, *cell))
+        {
+            shared_cells.push_back(shared_cell_type(cell->get_identifier(), pos));
+            continue;
+        }
+
+        ref_tokens.clear();
+        cell->get_ref_tokens(cxt, pos, ref_tokens);
+        std::vector<const formula_token_base*>::const_iterator it_token = ref_tokens.begin(), it_token_end = ref_tokens.end();
+        for (; it_token != it_token_end; ++it_token)
+        {
+            const formula_token_base& t = **it_token;
+            switch (t.get_opcode())
+            {
+                case fop_single_ref:
+                    cell_refs.push_back(
+                        cell_listener_tracker::cell_reference_type(pos, t.get_single_ref().to_abs(pos)));
+                break;
+                case fop_range_ref:
+                    range_refs.push_back(
+                        cell_listener_tracker::range_reference_type(pos, t.get_range_ref().to_abs(pos)));
+                break;
+                default:
+                    ; // ignore the rest.
+            }
+        }
+    }
+
+    tracker.add(cell_refs, range_refs);
+
+    // Add the shared formula cells in runs of consecutive rows, which
+    // adjacent runs get merged into.
+    std::sort(shared_cells.begin(), shared_cells.end(), less_by_block);
+    cell_listener_tracker::shared_references_type refs;
+    std::vector<shared_cell_type>::const_iterator it_shared = shared_cells.begin(), it_shared_end = shared_cells.end();
+    while (it_shared != it_shared_end)
+    {
+        size_t identifier = it_shared->first;
+        abs_range_t run;
+        run.first = run.last = it_shared->second;
+        for (++it_shared; it_shared != it_shared_end; ++it_shared)
+        {
+            const abs_address_t& pos = it_shared->second;
+            if (it_shared->first != identifier || pos.sheet != run.last.sheet ||
+                pos.column != run.last.column || pos.row != run.last.row + 1)
+                break;
+
+            run.last.row = pos.row;
+        }
+
+        refs.cells.clear();
+        refs.ranges.clear();
+        get_shared_references(cxt, run.first, *cxt.get_formula_cell(run.first), refs);
+        tracker.add_shared(run, identifier, refs);
+    }
+}
+
+void register_formula_cells(iface::formula_model_access& cxt, const abs_range_t& range)
+{
+    std::vector<abs_address_t> cells;
+    for (sheet_t sheet = range.first.sheet; sheet <= range.last.sheet; ++sheet)
+    {
+        for (col_t col = range.first.column; col <= range.last.column; ++col)
+        {
+            for (row_t row = range.first.row; row <= range.last.row; ++row)
+            {
+                abs_address_t pos(sheet, row, col);
+                if (cxt.get_celltype(pos) == celltype_t::formula)
+                    cells.push_back(pos);
+            }
+        }
+    }
+
+    register_formula_cells(cxt, cells);
 }
 
 void unregister_formula_cell(iface::formula_model_access& cxt, const abs_address_t& pos)
@@ -193,9 +387,22 @@ void unregister_formula_cell(iface::formula_model_access& cxt, const abs_address
         // Not a formula cell. Bail out.
         return;
 
+    dependency_graph* graph = cxt.get_dependency_graph();
+    if (graph)
+        graph->remove_cell(pos);
+
     cell_listener_tracker& tracker = cxt.get_cell_listener_tracker();
     tracker.remove_volatile(pos);
 
+    if (fcell->is_shared())
+        tracker.remove_shared(pos, fcell->get_identifier());
+
+    if (!tracker.get_precedents(pos))
+        // The cell has no references registered individually.  A cell may
+        // still have them after it started sharing its formula with the
+        // cell below.
+        return;
+
     // Go through all its existing references, and remove
     // itself as their listener.  This step is important
     // especially during partial re-calculation.
@@ -206,8 +413,20 @@ void unregister_formula_cell(iface::formula_model_access& cxt, const abs_address
                  pos, formula_cell_listener_handler::mode_remove));
 }
 
+void start_calc_epoch(iface::formula_model_access& cxt)
+{
+    calc_epoch* epoch = cxt.get_calc_epoch();
+    if (!epoch)
+        return;
+
+    ++epoch->id;
+    epoch->timestamp = global::get_current_time();
+    epoch->keep = true;
+}
+
 void get_all_dirty_cells(
-    iface::formula_model_access& cxt, modified_cells_t& addrs, dirty_formula_cells_t& cells)
+    iface::formula_model_access& cxt, modified_cells_t& addrs, dirty_formula_cells_t& cells,
+    size_t thread_count, bool skip_volatile)
 {
 #if DEBUG_FORMULA_API
     __IXION_DEBUG_OUT__ << "number of modified cells: " << addrs.size() << endl;
@@ -215,8 +434,22 @@ void get_all_dirty_cells(
 
     cell_listener_tracker& tracker = cxt.get_cell_listener_tracker();
 
-    // Volatile cells are always included.
+    // Volatile cells are included once in each epoch, and always when the
+    // model doesn't keep an epoch.
+    calc_epoch* epoch = cxt.get_calc_epoch();
+    if (!skip_volatile || (epoch && !epoch->id))
+        start_calc_epoch(cxt);
+
+    bool add_volatile = !epoch || epoch->volatile_id != epoch->id;
+    if (epoch)
+    {
+        // Calculate the dirty cells in the epoch they were looked up in.
+        epoch->volatile_id = epoch->id;
+        epoch->keep = true;
+    }
+
     const cell_listener_tracker::address_set_type& vcells = tracker.get_volatile_cells();
+    if (add_volatile)
     {
         cell_listener_tracker::address_set_type::const_iterator itr = vcells.begin(), itr_end = vcells.end();
         for (; itr != itr_end; ++itr)
@@ -233,22 +466,275 @@ void get_all_dirty_cells(
     std::sort(addrs.begin(), addrs.end());
     addrs.erase(std::unique(addrs.begin(), addrs.end()), addrs.end());
 
+    if (cxt.get_config().cache_dirty_cells)
+        tracker.get_all_cached_listeners(addrs, cells, cxt.get_config().dirty_cell_cache_size);
+    else
+        tracker.get_all_listeners(addrs, cells, thread_count);
+}
+
+namespace {
+
+/**
+ * Remove the cells just calculated from the cells waiting for lazy
+ * calculation, so that they don't get calculated again on demand.  Pending
+ * cells left without results by a cancelled calculation stay pending, so
+ * that they still get calculated when asked for.
+ */
+void erase_pending_cells(iface::formula_model_access& cxt, const dirty_formula_cells_t& cells)
+{
+    abs_address_set* pending = cxt.get_pending_cells();
+    boost::recursive_mutex* mtx = cxt.get_lazy_calc_mutex();
+    if (!pending || !mtx)
+        return;
+
+    boost::recursive_mutex::scoped_lock lock(*mtx);
+    if (pending->empty())
+        return;
+
+    dirty_formula_cells_t::const_iterator it = cells.begin(), it_end = cells.end();
+    for (; it != it_end; ++it)
     {
-        modified_cells_t::const_iterator itr = addrs.begin(), itr_end = addrs.end();
-        for (; itr != itr_end; ++itr)
+        if (!pending->count(*it))
+            continue;
+
+        formula_cell* p = cxt.get_formula_cell(*it);
+        if (p && !p->has_result())
         {
-            tracker.get_all_range_listeners(*itr, cells);
-            tracker.get_all_cell_listeners(*itr, cells);
+            // Interpreting the cell cleared its pending mark.
+            p->reset_pending();
+            continue;
         }
+
+        pending->erase(*it);
     }
 }
 
+}
+
 void calculate_cells(iface::formula_model_access& cxt, dirty_formula_cells_t& cells, size_t thread_count)
 {
     dependency_tracker deptracker(cells, cxt);
-    std::for_each(cells.begin(), cells.end(),
-                  cell_dependency_handler(cxt, deptracker, cells));
+    if (deptracker.needs_references())
+        std::for_each(cells.begin(), cells.end(),
+                      cell_dependency_handler(cxt, deptracker, cells));
     deptracker.interpret_all_cells(thread_count);
+    erase_pending_cells(cxt, cells);
+}
+
+size_t calculate_cells(
+    iface::formula_model_access& cxt, const modified_cells_t& modified_cells,
+    dirty_formula_cells_t& cells, size_t thread_count)
+{
+    dependency_tracker deptracker(cells, cxt, &modified_cells);
+    if (deptracker.needs_references())
+        std::for_each(cells.begin(), cells.end(),
+                      cell_dependency_handler(cxt, deptracker, cells));
+
+    calc_status status;
+    deptracker.interpret_all_cells(thread_count, &status);
+    erase_pending_cells(cxt, cells);
+    return status.skipped_count;
+}
+
+void mark_cells_dirty(iface::formula_model_access& cxt, const dirty_formula_cells_t& cells)
+{
+    abs_address_set* pending = cxt.get_pending_cells();
+    boost::recursive_mutex* mtx = cxt.get_lazy_calc_mutex();
+    if (!pending || !mtx)
+        throw general_error("mark_cells_dirty: the model doesn't support lazy calculation.");
+
+    boost::recursive_mutex::scoped_lock lock(*mtx);
+    dirty_formula_cells_t::const_iterator it = cells.begin(), it_end = cells.end();
+    for (; it != it_end; ++it)
+    {
+        formula_cell* p = cxt.get_formula_cell(*it);
+        if (!p)
+            continue;
+
+        p->reset_pending();
+        pending->insert(*it);
+    }
+}
+
+size_t calculate_cell(iface::formula_model_access& cxt, const abs_address_t& pos)
+{
+    abs_address_set* pending = cxt.get_pending_cells();
+    boost::recursive_mutex* mtx = cxt.get_lazy_calc_mutex();
+    if (!pending || !mtx)
+        return 0;
+
+    // The mutex is recursive so that a calculation reading a pending cell
+    // not found among the precedents of the cell being calculated can
+    // calculate that cell in turn.
+    boost::recursive_mutex::scoped_lock lock(*mtx);
+    if (!pending->count(pos))
+        // Either not marked dirty, or already calculated.
+        return 0;
+
+    // Collect the pending cells that the cell depends on, by following the
+    // references of each pending cell found.  Pending cells that no longer
+    // store formulas are dropped along the way.
+    dirty_formula_cells_t cells;
+    std::vector<abs_address_t> stack;
+    auto visit = [&](const abs_address_t& addr)
+    {
+        if (!pending->count(addr) || cells.count(addr))
+            return;
+
+        if (!cxt.get_formula_cell(addr))
+        {
+            pending->erase(addr);
+            return;
+        }
+
+        cells.insert(addr);
+        stack.push_back(addr);
+    };
+
+    visit(pos);
+    std::vector<abs_address_t> range_cells;
+    while (!stack.empty())
+    {
+        abs_address_t cell = stack.back();
+        stack.pop_back();
+
+        cell_listener_tracker::precedents_type token_refs;
+        const cell_listener_tracker::precedents_type* refs = get_cell_references(cxt, cell, token_refs);
+        std::for_each(refs->cells.begin(), refs->cells.end(), visit);
+
+        std::vector<abs_range_t>::const_iterator it = refs->ranges.begin(), it_end = refs->ranges.end();
+        for (; it != it_end; ++it)
+        {
+            range_cells.clear();
+            pending->get_addresses(*it, range_cells);
+            std::for_each(range_cells.begin(), range_cells.end(), visit);
+        }
+    }
+
+    if (cells.empty())
+        return 0;
+
+    dependency_tracker deptracker(cells, cxt);
+    if (deptracker.needs_references())
+        std::for_each(cells.begin(), cells.end(),
+                      cell_dependency_handler(cxt, deptracker, cells));
+    deptracker.interpret_all_cells(0);
+
+    dirty_formula_cells_t::const_iterator it = cells.begin(), it_end = cells.end();
+    for (; it != it_end; ++it)
+        pending->erase(*it);
+
+    // The remaining pending cells belong to the same calculation, and get
+    // calculated in the same epoch.
+    calc_epoch* epoch = cxt.get_calc_epoch();
+    if (epoch && !pending->empty())
+        epoch->keep = true;
+
+    return cells.size();
+}
+
+struct calc_handle::impl
+{
+    iface::formula_model_access& m_context;
+    dirty_formula_cells_t m_cells;
+    size_t m_thread_count;
+    calc_status m_status;
+    std::atomic<bool> m_done;
+    std::exception_ptr m_error;
+
+    ::boost::mutex m_mtx_thread;
+    ::boost::thread m_thread;
+
+    impl(iface::formula_model_access& cxt, const dirty_formula_cells_t& cells, size_t thread_count) :
+        m_context(cxt), m_cells(cells), m_thread_count(thread_count), m_done(false)
+    {
+        m_thread = ::boost::thread(&impl::run, this);
+    }
+
+    void run()
+    {
+        try
+        {
+            dependency_tracker deptracker(m_cells, m_context);
+            if (deptracker.needs_references())
+                std::for_each(m_cells.begin(), m_cells.end(),
+                              cell_dependency_handler(m_context, deptracker, m_cells));
+            deptracker.interpret_all_cells(m_thread_count, &m_status);
+            erase_pending_cells(m_context, m_cells);
+        }
+        catch (...)
+        {
+            m_error = std::current_exception();
+        }
+
+        m_done = true;
+    }
+
+    void join()
+    {
+        ::boost::mutex::scoped_lock lock(m_mtx_thread);
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+};
+
+calc_handle::calc_handle(
+    iface::formula_model_access& cxt, const dirty_formula_cells_t& cells, size_t thread_count) :
+    mp_impl(new impl(cxt, cells, thread_count)) {}
+
+calc_handle::~calc_handle()
+{
+    mp_impl->join();
+}
+
+void calc_handle::wait()
+{
+    mp_impl->join();
+    if (mp_impl->m_error)
+        std::rethrow_exception(mp_impl->m_error);
+}
+
+bool calc_handle::is_done() const
+{
+    return mp_impl->m_done;
+}
+
+double calc_handle::get_progress() const
+{
+    size_t total = mp_impl->m_status.cell_count;
+    if (!total)
+        return mp_impl->m_done ? 100.0 : 0.0;
+
+    return mp_impl->m_status.calculated_count * 100.0 / total;
+}
+
+void calc_handle::cancel()
+{
+    mp_impl->m_status.cancelled = true;
+}
+
+bool calc_handle::is_cancelled() const
+{
+    return mp_impl->m_status.cancelled;
+}
+
+void calc_handle::get_pending_cells(dirty_formula_cells_t& cells)
+{
+    mp_impl->join();
+
+    dirty_formula_cells_t::const_iterator it = mp_impl->m_cells.begin(), it_end = mp_impl->m_cells.end();
+    for (; it != it_end; ++it)
+    {
+        const formula_cell* p = mp_impl->m_context.get_formula_cell(*it);
+        if (p && !p->has_result())
+            cells.insert(*it);
+    }
+}
+
+std::unique_ptr<calc_handle> calculate_cells_async(
+    iface::formula_model_access& cxt, const dirty_formula_cells_t& cells, size_t thread_count)
+{
+    return std::unique_ptr<calc_handle>(new calc_handle(cxt, cells, thread_count));
 }
 
 }
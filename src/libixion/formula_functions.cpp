@@ -134,6 +134,18 @@ const char* formula_functions::get_function_name(formula_function_t oc)
     return unknown_func_name;
 }
 
+bool formula_functions::modifies_context(formula_function_t oc)
+{
+    switch (oc)
+    {
+        case formula_function_t::func_concatenate:
+            return true;
+        default:
+            ;
+    }
+    return false;
+}
+
 formula_functions::formula_functions(iface::formula_model_access& cxt) :
     m_context(cxt)
 {
@@ -368,7 +380,9 @@ void formula_functions::fnc_now(value_stack_t& args) const
 
     // TODO: this value is currently not accurate since we don't take into
     // account the zero date yet.
-    double cur_time = global::get_current_time();
+    // All cells calculated in the same epoch get the same time.
+    const calc_epoch* epoch = m_context.get_calc_epoch();
+    double cur_time = epoch ? epoch->timestamp : global::get_current_time();
     cur_time /= 86400.0; // convert seconds to days.
     args.push_value(cur_time);
 }
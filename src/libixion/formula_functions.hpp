@@ -49,6 +49,18 @@ public:
     static formula_function_t get_function_opcode(const char* p, size_t n);
     static const char* get_function_name(formula_function_t oc);
 
+    /**
+     * Check whether or not a function may modify the state of the model
+     * context, e.g. by adding a new string to the string pool.  The order in
+     * which such functions get called affects the state of the model.
+     *
+     * @param oc function opcode.
+     *
+     * @return true if the function may modify the model context, false
+     *         otherwise.
+     */
+    static bool modifies_context(formula_function_t oc);
+
     void interpret(formula_function_t oc, value_stack_t& args);
 
 private:
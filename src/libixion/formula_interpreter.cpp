@@ -42,7 +42,7 @@ opcode_token paren_close = opcode_token(fop_close);
 formula_interpreter::formula_interpreter(const formula_cell* cell, iface::formula_model_access& cxt) :
     m_parent_cell(cell),
     m_context(cxt),
-    mp_handler(NULL),
+    mp_handler(cxt.get_session_handler()),
     m_stack(cxt),
     m_error(fe_no_error)
 {
@@ -57,9 +57,13 @@ void formula_interpreter::set_origin(const abs_address_t& pos)
     m_pos = pos;
 }
 
+void formula_interpreter::set_session_handler(iface::session_handler* handler)
+{
+    mp_handler = handler;
+}
+
 bool formula_interpreter::interpret()
 {
-    mp_handler = m_context.get_session_handler();
     if (mp_handler)
         mp_handler->begin_cell_interpret(m_pos);
 
@@ -168,9 +172,7 @@ void get_result_from_cell(const iface::formula_model_access& cxt, const abs_addr
             if (!fcell)
                 return;
 
-            const formula_result* fres = fcell->get_result_cache();
-            if (fres)
-                res = *fres;
+            fcell->get_result_cache(res);
         }
         break;
         case celltype_t::numeric:
@@ -351,22 +353,22 @@ bool pop_stack_value_or_string(const iface::formula_model_access& cxt,
                 {
                     const formula_cell* fc = cxt.get_formula_cell(addr);
                     assert(fc);
-                    const formula_result* res = fc->get_result_cache();
-                    if (!res)
+                    formula_result res;
+                    if (!fc->get_result_cache(res))
                         return false;
 
-                    switch (res->get_type())
+                    switch (res.get_type())
                     {
                         case formula_result::rt_value:
                         {
                             vt = stack_value_t::value;
-                            val = res->get_value();
+                            val = res.get_value();
                             return true;
                         }
                         case formula_result::rt_string:
                         {
                             vt = stack_value_t::string;
-                            string_id_t strid = res->get_string();
+                            string_id_t strid = res.get_string();
                             const string* ps = cxt.get_string(strid);
                             if (!ps)
                                 return false;
@@ -54,6 +54,14 @@ public:
     ~formula_interpreter();
 
     void set_origin(const abs_address_t& pos);
+
+    /**
+     * Set the session handler to report the progress of the interpretation
+     * to, in place of the one provided by the model context.
+     *
+     * @param handler session handler, or NULL to not report anything.
+     */
+    void set_session_handler(iface::session_handler* handler);
     bool interpret();
     const formula_result& get_result() const;
     formula_error_t get_error() const;
@@ -334,7 +334,8 @@ bool operator== (const formula_tokens_t& left, const formula_tokens_t& right)
     formula_tokens_t::const_iterator itr = left.begin(), itr_end = left.end(), itr2 = right.begin();
     for (; itr != itr_end; ++itr, ++itr2)
     {
-        if (*itr != *itr2)
+        // Compare the tokens, not the pointers that own them.
+        if (**itr != **itr2)
             return false;
     }
     return true;
@@ -14,6 +14,7 @@
 #include "ixion/interface/formula_model_access.hpp"
 
 #include <string>
+#include <sstream>
 
 namespace ixion {
 
@@ -242,17 +243,17 @@ const std::string value_stack_t::pop_string()
                 case celltype_t::formula:
                 {
                     const formula_cell* fc = m_context.get_formula_cell(addr);
-                    const formula_result* res = fc->get_result_cache();
-                    if (!res)
+                    formula_result res;
+                    if (!fc->get_result_cache(res))
                         break;
 
-                    switch (res->get_type())
+                    switch (res.get_type())
                     {
                         case formula_result::rt_error:
-                            throw formula_error(res->get_error());
+                            throw formula_error(res.get_error());
                         case formula_result::rt_string:
                         {
-                            const std::string* ps = m_context.get_string(res->get_string());
+                            const std::string* ps = m_context.get_string(res.get_string());
                             if (!ps)
                                 throw formula_error(fe_stack_error);
                             return *ps;
@@ -261,7 +262,7 @@ const std::string value_stack_t::pop_string()
                         case formula_result::rt_value:
                         {
                             std::ostringstream os;
-                            os << res->get_value();
+                            os << res.get_value();
                             return os.str();
                         }
                         default:
@@ -15,6 +15,7 @@
 #include "ixion/interface/formula_model_access.hpp"
 #include "ixion/formula_name_resolver.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <vector>
 
@@ -30,43 +31,24 @@ namespace ixion {
 
 namespace {
 
-class ref_cell_picker : public std::unary_function<const formula_token_base*, void>
+/**
+ * Pick up the single cells and ranges referenced by the reference tokens.
+ */
+class ref_picker : public std::unary_function<const formula_token_base*, void>
 {
 public:
-    ref_cell_picker(iface::formula_model_access& cxt, const abs_address_t& origin, std::vector<abs_address_t>& deps) :
-        m_context(cxt), m_origin(origin), m_deps(deps) {}
+    ref_picker(const abs_address_t& origin, cell_listener_tracker::precedents_type& refs) :
+        m_origin(origin), m_refs(refs) {}
 
     void operator() (const formula_token_base* p)
     {
         switch (p->get_opcode())
         {
             case fop_single_ref:
-            {
-                abs_address_t addr = p->get_single_ref().to_abs(m_origin);
-                if (m_context.get_celltype(addr) != celltype_t::formula)
-                    break;
-
-                m_deps.push_back(addr);
-            }
+                m_refs.cells.push_back(p->get_single_ref().to_abs(m_origin));
             break;
             case fop_range_ref:
-            {
-                abs_range_t range = p->get_range_ref().to_abs(m_origin);
-                for (sheet_t sheet = range.first.sheet; sheet <= range.last.sheet; ++sheet)
-                {
-                    for (col_t col = range.first.column; col <= range.last.column; ++col)
-                    {
-                        for (row_t row = range.first.row; row <= range.last.row; ++row)
-                        {
-                            abs_address_t addr(sheet, row, col);
-                            if (m_context.get_celltype(addr) != celltype_t::formula)
-                                continue;
-
-                            m_deps.push_back(addr);
-                        }
-                    }
-                }
-            }
+                m_refs.ranges.push_back(p->get_range_ref().to_abs(m_origin));
             break;
             default:
                 ; // ignore the rest.
@@ -74,28 +56,8 @@ public:
     }
 
 private:
-    iface::formula_model_access& m_context;
     const abs_address_t& m_origin;
-    std::vector<abs_address_t>&  m_deps;
-};
-
-class depcell_inserter : public std::unary_function<abs_address_t, void>
-{
-public:
-    depcell_inserter(dependency_tracker& tracker, const dirty_formula_cells_t& dirty_cells, const abs_address_t& fcell) :
-        m_tracker(tracker),
-        m_dirty_cells(dirty_cells),
-        m_fcell(fcell) {}
-
-    void operator() (const abs_address_t& cell)
-    {
-        if (m_dirty_cells.count(cell) > 0)
-            m_tracker.insert_depend(m_fcell, cell);
-    }
-private:
-    dependency_tracker& m_tracker;
-    const dirty_formula_cells_t& m_dirty_cells;
-    abs_address_t m_fcell;
+    cell_listener_tracker::precedents_type& m_refs;
 };
 
 }
@@ -150,6 +112,26 @@ void formula_cell_listener_handler::operator() (const formula_token_base* p) con
     }
 }
 
+const cell_listener_tracker::precedents_type* get_cell_references(
+    iface::formula_model_access& cxt, const abs_address_t& fcell,
+    cell_listener_tracker::precedents_type& token_refs)
+{
+    // Registered cells have their references stored in the listener
+    // tracker.  Only pick them up from the tokens when the cell has none
+    // stored, which is also the case when the cell hasn't been registered.
+    const cell_listener_tracker::precedents_type* refs =
+        cxt.get_cell_listener_tracker().get_precedents(fcell);
+    if (refs)
+        return refs;
+
+    std::vector<const formula_token_base*> ref_tokens;
+    formula_cell* p = cxt.get_formula_cell(fcell);
+    assert(p);
+    p->get_ref_tokens(cxt, fcell, ref_tokens);
+    std::for_each(ref_tokens.begin(), ref_tokens.end(), ref_picker(fcell, token_refs));
+    return &token_refs;
+}
+
 cell_dependency_handler::cell_dependency_handler(
     iface::formula_model_access& cxt, dependency_tracker& dep_tracker, dirty_formula_cells_t& dirty_cells) :
     m_context(cxt), m_dep_tracker(dep_tracker), m_dirty_cells(dirty_cells) {}
@@ -161,28 +143,28 @@ void cell_dependency_handler::operator() (const abs_address_t& fcell)
     __IXION_DEBUG_OUT__ << get_formula_result_output_separator() << endl;
     __IXION_DEBUG_OUT__ << "processing dependency of " << resolver.get_name(fcell, false) << endl;
 #endif
-    // Register cell dependencies.
-    std::vector<const formula_token_base*> ref_tokens;
-    formula_cell* p = m_context.get_formula_cell(fcell);
-    assert(p);
-    p->get_ref_tokens(m_context, fcell, ref_tokens);
-
-#if DEBUG_FUNCTION_OBJECTS
-    __IXION_DEBUG_OUT__ << "this cell contains " << ref_tokens.size() << " reference tokens." << endl;
-#endif
-    // Pick up the referenced cells from the ref tokens.  I should
-    // probably combine this with the above get_ref_tokens() call above
-    // for efficiency.
-    std::vector<abs_address_t> deps;
-    for_each(ref_tokens.begin(), ref_tokens.end(), ref_cell_picker(m_context, fcell, deps));
+    cell_listener_tracker::precedents_type token_refs;
+    const cell_listener_tracker::precedents_type* refs = get_cell_references(m_context, fcell, token_refs);
 
 #if DEBUG_FUNCTION_OBJECTS
-    __IXION_DEBUG_OUT__ << "number of precedent cells picked up: " << deps.size() << endl;
+    __IXION_DEBUG_OUT__ << "this cell references " << refs->cells.size() << " cells and "
+        << refs->ranges.size() << " ranges." << endl;
 #endif
     // Register dependency information.  Only dirty cells should be
     // registered as precedent cells since non-dirty cells are equivalent
     // to constants.
-    for_each(deps.begin(), deps.end(), depcell_inserter(m_dep_tracker, m_dirty_cells, fcell));
+    std::vector<abs_address_t>::const_iterator it = refs->cells.begin(), it_end = refs->cells.end();
+    for (; it != it_end; ++it)
+    {
+        if (m_dirty_cells.count(*it) > 0)
+            m_dep_tracker.insert_depend(fcell, *it);
+        else
+            m_dep_tracker.insert_input_depend(fcell, *it);
+    }
+
+    std::vector<abs_range_t>::const_iterator it_range = refs->ranges.begin(), it_range_end = refs->ranges.end();
+    for (; it_range != it_range_end; ++it_range)
+        m_dep_tracker.insert_range_depend(fcell, *it_range);
 }
 
 }
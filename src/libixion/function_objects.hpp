@@ -9,6 +9,8 @@
 #define __IXION_FUNCTION_OBJECTS_HPP__
 
 #include "ixion/address.hpp"
+#include "ixion/address_set.hpp"
+#include "ixion/cell_listener_tracker.hpp"
 
 #include <functional>
 
@@ -20,7 +22,6 @@ class formula_model_access;
 
 }
 
-class cell_listener_tracker;
 class dependency_tracker;
 class formula_cell;
 class formula_token_base;
@@ -44,6 +45,23 @@ private:
     mode_t m_mode;
 };
 
+/**
+ * Get the single cells and ranges referenced by a formula cell.  They are
+ * taken from the cell listener tracker when the cell has been registered,
+ * or else picked up from the formula tokens of the cell.
+ *
+ * @param cxt model context.
+ * @param fcell address of the formula cell.
+ * @param token_refs receives the references picked up from the formula
+ *                   tokens, when the tracker has none stored for the cell.
+ *
+ * @return references of the cell, pointing to either those stored in the
+ *         tracker or <code>token_refs</code>.
+ */
+const cell_listener_tracker::precedents_type* get_cell_references(
+    iface::formula_model_access& cxt, const abs_address_t& fcell,
+    cell_listener_tracker::precedents_type& token_refs);
+
 class cell_dependency_handler : public std::unary_function<abs_address_t, void>
 {
 public:
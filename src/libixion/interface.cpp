@@ -33,6 +33,31 @@ const table_handler* formula_model_access::get_table_handler() const
     return NULL;
 }
 
+std::shared_ptr<cell_queue_manager> formula_model_access::get_cell_queue_manager(size_t /*thread_count*/)
+{
+    return std::shared_ptr<cell_queue_manager>();
+}
+
+abs_address_set* formula_model_access::get_pending_cells()
+{
+    return NULL;
+}
+
+boost::recursive_mutex* formula_model_access::get_lazy_calc_mutex()
+{
+    return NULL;
+}
+
+calc_epoch* formula_model_access::get_calc_epoch()
+{
+    return NULL;
+}
+
+dependency_graph* formula_model_access::get_dependency_graph()
+{
+    return NULL;
+}
+
 }}
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
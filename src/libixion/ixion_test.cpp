@@ -7,17 +7,35 @@
 
 #include "ixion/formula_name_resolver.hpp"
 #include "ixion/address.hpp"
+#include "ixion/address_set.hpp"
 #include "ixion/formula.hpp"
 #include "ixion/model_context.hpp"
 #include "ixion/global.hpp"
 #include "ixion/macros.hpp"
+#include "ixion/cell.hpp"
+#include "ixion/cell_listener_tracker.hpp"
+#include "ixion/cell_queue_manager.hpp"
+#include "ixion/config.hpp"
+#include "ixion/exceptions.hpp"
+#include "ixion/formula_result.hpp"
+#include "ixion/interface/session_handler.hpp"
 #include "ixion/interface/table_handler.hpp"
 
+#include "cell_tasks.hpp"
+
+#include <boost/thread.hpp>
+
+#include <algorithm>
 #include <iostream>
 #include <cassert>
+#include <cmath>
 #include <string>
 #include <cstring>
 #include <sstream>
+#include <set>
+#include <atomic>
+#include <limits>
+#include <tuple>
 
 using namespace std;
 using namespace ixion;
@@ -34,6 +52,30 @@ void test_size()
     cout << "* celltype_t: " << sizeof(celltype_t) << endl;
     cout << "* formula_cell: " << sizeof(formula_cell) << endl;
     cout << "* formula_tokens_t: " << sizeof(formula_tokens_t) << endl;
+
+    // Formula cells store their results in place, and must stay small
+    // enough for models with millions of them.
+    assert(sizeof(formula_cell) < 32);
+
+    // They keep the identifiers of their tokens in 32 bits, and reject
+    // identifiers not fitting in them.
+    const uint32_t max_identifier = std::numeric_limits<uint32_t>::max();
+    formula_cell cell(max_identifier);
+    assert(cell.get_identifier() == max_identifier);
+
+    if (std::numeric_limits<size_t>::max() > max_identifier)
+    {
+        bool thrown = false;
+        try
+        {
+            formula_cell too_large(size_t(max_identifier) + 1);
+        }
+        catch (const general_error&)
+        {
+            thrown = true;
+        }
+        assert(thrown);
+    }
 }
 
 void test_string_to_double()
@@ -601,6 +643,118 @@ bool check_formula_expression(
 /**
  * Make sure the public API works as advertized.
  */
+void test_address_set()
+{
+    cout << "test address set" << endl;
+
+    abs_address_set cells;
+    assert(cells.empty());
+    assert(cells.begin() == cells.end());
+
+    // Insert cells across sheets, columns and row chunks, in no particular
+    // order.
+    std::vector<abs_address_t> addrs;
+    addrs.push_back(abs_address_t(1,5,0));
+    addrs.push_back(abs_address_t(0,100000,2));
+    addrs.push_back(abs_address_t(0,63,2));
+    addrs.push_back(abs_address_t(0,64,2));
+    addrs.push_back(abs_address_t(0,0,0));
+    addrs.push_back(abs_address_t(0,4095,2));
+    addrs.push_back(abs_address_t(0,4096,2));
+    addrs.push_back(abs_address_t(3,0,10));
+    for (size_t i = 0; i < addrs.size(); ++i)
+        assert(cells.insert(addrs[i]));
+
+    assert(!cells.insert(abs_address_t(0,64,2)));
+    assert(cells.size() == addrs.size());
+    assert(cells.count(abs_address_t(0,4096,2)) == 1);
+    assert(cells.count(abs_address_t(0,4097,2)) == 0);
+    assert(cells.count(abs_address_t(2,0,0)) == 0);
+    assert(cells.count(abs_address_t(0,0,100)) == 0);
+
+    // Iterate in order of sheet, column and row.
+    std::vector<abs_address_t> sorted(cells.begin(), cells.end());
+    assert(sorted.size() == addrs.size());
+    assert(sorted[0] == abs_address_t(0,0,0));
+    assert(sorted[1] == abs_address_t(0,63,2));
+    assert(sorted[2] == abs_address_t(0,64,2));
+    assert(sorted[3] == abs_address_t(0,4095,2));
+    assert(sorted[4] == abs_address_t(0,4096,2));
+    assert(sorted[5] == abs_address_t(0,100000,2));
+    assert(sorted[6] == abs_address_t(1,5,0));
+    assert(sorted[7] == abs_address_t(3,0,10));
+
+    // Look up a range.
+    abs_range_t range;
+    range.first = abs_address_t(0,64,0);
+    range.last = abs_address_t(1,5000,2);
+    std::vector<abs_address_t> found;
+    cells.get_addresses(range, found);
+    assert(found.size() == 3);
+    assert(found[0] == abs_address_t(0,64,2));
+    assert(found[1] == abs_address_t(0,4095,2));
+    assert(found[2] == abs_address_t(0,4096,2));
+    assert(cells.intersects(range));
+
+    range.first = abs_address_t(0,4097,0);
+    range.last = abs_address_t(0,99999,2);
+    assert(!cells.intersects(range));
+    range.last.row = 100000;
+    assert(cells.intersects(range));
+
+    // Erase.
+    assert(cells.erase(abs_address_t(0,4095,2)) == 1);
+    assert(cells.erase(abs_address_t(0,4095,2)) == 0);
+    assert(cells.size() == addrs.size() - 1);
+    assert(!cells.count(abs_address_t(0,4095,2)));
+
+    // Union.
+    abs_address_set others;
+    others.insert(abs_address_t(0,64,2));
+    others.insert(abs_address_t(0,65,2));
+    others.insert(abs_address_t(5,1,1));
+    abs_address_set merged = cells;
+    assert(merged == cells);
+    merged.insert(others);
+    assert(merged.size() == cells.size() + 2);
+    assert(merged != cells);
+    assert(merged.count(abs_address_t(0,65,2)) && merged.count(abs_address_t(5,1,1)));
+
+    cells.insert(others.begin(), others.end());
+    assert(merged == cells);
+
+    // Columns are stored sparsely, and merge in order.
+    others.clear();
+    others.insert(abs_address_t(0,1,16383));
+    others.insert(abs_address_t(0,1,1));
+    merged.insert(others);
+    assert(merged.count(abs_address_t(0,1,16383)) && merged.count(abs_address_t(0,1,1)));
+    sorted.assign(merged.begin(), merged.end());
+    assert(sorted.size() == cells.size() + 2);
+    assert(sorted[1] == abs_address_t(0,1,1));
+    assert(sorted[7] == abs_address_t(0,1,16383));
+    assert(sorted.back() == abs_address_t(5,1,1));
+
+    // Invalid addresses get rejected.
+    for (const abs_address_t& invalid : { abs_address_t(-1,0,0), abs_address_t(0,-1,0), abs_address_t(0,0,-1) })
+    {
+        try
+        {
+            cells.insert(invalid);
+            assert(!"general_error was not thrown");
+        }
+        catch (const general_error&) {}
+
+        assert(!cells.count(invalid));
+    }
+
+    assert(merged != cells);
+
+    cells.clear();
+    assert(cells.empty());
+    assert(cells.begin() == cells.end());
+}
+
 void test_parse_and_print_expressions()
 {
     cout << "test public formula api" << endl;
@@ -849,6 +1003,1900 @@ void test_volatile_function()
 
 }
 
+/**
+ * Session handler that ignores all session events.
+ */
+class null_session_handler : public iface::session_handler
+{
+public:
+    virtual void begin_cell_interpret(const abs_address_t& /*pos*/) {}
+    virtual void set_result(const formula_result& /*result*/) {}
+    virtual void set_invalid_expression(const char* /*msg*/) {}
+    virtual void set_formula_error(const char* /*msg*/) {}
+    virtual void push_token(fopcode_t /*fop*/) {}
+    virtual void push_value(double /*val*/) {}
+    virtual void push_string(size_t /*sid*/) {}
+    virtual void push_single_ref(const address_t& /*addr*/, const abs_address_t& /*pos*/) {}
+    virtual void push_range_ref(const range_t& /*range*/, const abs_address_t& /*pos*/) {}
+    virtual void push_table_ref(const table_t& /*table*/) {}
+    virtual void push_function(formula_function_t /*foc*/) {}
+};
+
+/**
+ * Session handler that counts the threads interpreting cells.  A thread
+ * gets counted the first time it interprets a cell, so that a re-created
+ * worker thread gets counted again even if it happens to get the same
+ * thread ID as the one it replaces.
+ */
+class thread_counter : public null_session_handler
+{
+    std::atomic<size_t> m_count;
+
+public:
+    thread_counter() : m_count(0) {}
+
+    size_t get_count() const { return m_count; }
+
+    virtual void begin_cell_interpret(const abs_address_t& /*pos*/)
+    {
+        static thread_local bool counted = false;
+        if (counted)
+            return;
+
+        counted = true;
+        ++m_count;
+    }
+};
+
+/**
+ * Session handler that records the order in which the cells get
+ * interpreted.  It's only usable with a single calculation thread.
+ */
+class cell_order_recorder : public null_session_handler
+{
+    std::vector<abs_address_t> m_cells;
+
+public:
+    const std::vector<abs_address_t>& get_cells() const { return m_cells; }
+
+    void clear() { m_cells.clear(); }
+
+    virtual void begin_cell_interpret(const abs_address_t& pos)
+    {
+        m_cells.push_back(pos);
+    }
+};
+
+void test_thread_pool_reuse()
+{
+    cout << "test thread pool reuse" << endl;
+
+    model_context cxt;
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    assert(resolver);
+
+    cxt.append_sheet(IXION_ASCII("test"), 1048576, 1024);
+
+    // A1 is a value, and A2:A50 each reference the cell above it.
+    cxt.set_numeric_cell(abs_address_t(0,0,0), 1.0);
+    dirty_formula_cells_t dirty_cells;
+    for (row_t row = 1; row < 50; ++row)
+    {
+        std::ostringstream os;
+        os << "A" << row << "+1";
+        std::string formula = os.str();
+        abs_address_t pos(0,row,0);
+        insert_formula(cxt, pos, formula.c_str(), *resolver);
+        dirty_cells.insert(pos);
+    }
+
+    // No worker threads are kept until the pool size is set.
+    assert(!cxt.get_cell_queue_manager(4));
+    cxt.set_thread_pool_size(4);
+    std::shared_ptr<cell_queue_manager> queue = cxt.get_cell_queue_manager(4);
+    assert(queue);
+    assert(queue->get_thread_count() == 4);
+
+    // The getter doesn't create or destroy the worker threads.
+    assert(!cxt.get_cell_queue_manager(2));
+    assert(!cxt.get_cell_queue_manager(0));
+    assert(cxt.get_cell_queue_manager(4) == queue);
+
+    // No evaluation costs are known before the first calculation.
+    assert(!cxt.get_formula_cell(abs_address_t(0,49,0))->get_eval_cost());
+
+    thread_counter counter;
+    cxt.set_session_handler(&counter);
+    calculate_cells(cxt, dirty_cells, 4);
+    assert(cxt.get_numeric_value(abs_address_t(0,49,0)) == 50.0);
+    assert(cxt.get_formula_cell(abs_address_t(0,49,0))->get_eval_cost() > 0);
+
+    // Modify A1 and recalculate repeatedly.  The same worker threads should
+    // be used each time, so no more than 4 threads ever interpret cells.
+    modified_cells_t dirty_addrs;
+    dirty_addrs.push_back(abs_address_t(0,0,0));
+    for (int i = 0; i < 10; ++i)
+    {
+        cxt.set_numeric_cell(abs_address_t(0,0,0), i);
+        dirty_cells.clear();
+        get_all_dirty_cells(cxt, dirty_addrs, dirty_cells);
+        assert(dirty_cells.size() == 49);
+        calculate_cells(cxt, dirty_cells, 4);
+        assert(cxt.get_numeric_value(abs_address_t(0,49,0)) == i + 49.0);
+    }
+    size_t thread_count = counter.get_count();
+    assert(0 < thread_count && thread_count <= 4);
+
+    // Calculations requesting another thread count use temporary threads,
+    // and keep the pool as is.
+    cxt.set_numeric_cell(abs_address_t(0,0,0), 100.0);
+    dirty_cells.clear();
+    get_all_dirty_cells(cxt, dirty_addrs, dirty_cells);
+    calculate_cells(cxt, dirty_cells, 2);
+    assert(cxt.get_numeric_value(abs_address_t(0,49,0)) == 149.0);
+    assert(counter.get_count() > thread_count);
+    assert(cxt.get_cell_queue_manager(4) == queue);
+    cxt.set_session_handler(NULL);
+
+    // Setting the same size keeps the worker threads.
+    cxt.set_thread_pool_size(4);
+    assert(cxt.get_cell_queue_manager(4) == queue);
+
+    // Changing the size re-creates them.
+    cxt.set_thread_pool_size(2);
+    assert(!cxt.get_cell_queue_manager(4));
+    assert(cxt.get_cell_queue_manager(2)->get_thread_count() == 2);
+    assert(!cxt.get_cell_queue_manager(2)->is_pinned());
+
+    // Pinning the threads makes them unusable until they get re-created.
+    config cfg = cxt.get_config();
+    cfg.pin_threads = true;
+    cxt.set_config(cfg);
+    assert(!cxt.get_cell_queue_manager(2));
+    cxt.set_thread_pool_size(2);
+    assert(cxt.get_cell_queue_manager(2)->is_pinned());
+
+    cxt.set_numeric_cell(abs_address_t(0,0,0), 200.0);
+    dirty_cells.clear();
+    get_all_dirty_cells(cxt, dirty_addrs, dirty_cells);
+    calculate_cells(cxt, dirty_cells, 2);
+    assert(cxt.get_numeric_value(abs_address_t(0,49,0)) == 249.0);
+
+    // A calculation holding on to the worker threads keeps them alive
+    // across a shutdown.
+    queue = cxt.get_cell_queue_manager(2);
+    cxt.shutdown_thread_pool();
+    assert(!cxt.get_cell_queue_manager(2));
+    assert(queue.use_count() == 1);
+    assert(queue->get_thread_count() == 2);
+}
+
+void run_concurrent_model(size_t model_id, size_t row_size)
+{
+    model_context cxt;
+    config cfg;
+    cfg.calc_mode = (model_id % 2) ? calc_mode_t::wavefront : calc_mode_t::dependency_queue;
+    cfg.column_locality = (model_id / 2) % 2 == 0;
+    cxt.set_config(cfg);
+    cxt.set_thread_pool_size(1 + model_id % 4);
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    assert(resolver);
+
+    cxt.append_sheet(IXION_ASCII("test"), 1048576, 1024);
+
+    // Column A stores values, column B their running totals, and column C
+    // the sums of column A up to the same row.
+    dirty_formula_cells_t dirty_cells;
+    for (size_t i = 0; i < row_size; ++i)
+    {
+        row_t row = i;
+        cxt.set_numeric_cell(abs_address_t(0,row,0), model_id + i);
+
+        std::ostringstream os;
+        if (row == 0)
+            os << "A1";
+        else
+            os << "B" << row << "+A" << row + 1;
+        std::string formula = os.str();
+        insert_formula(cxt, abs_address_t(0,row,1), formula.c_str(), *resolver);
+        dirty_cells.insert(abs_address_t(0,row,1));
+
+        os.str(std::string());
+        os << "SUM(A1:A" << row + 1 << ")";
+        formula = os.str();
+        insert_formula(cxt, abs_address_t(0,row,2), formula.c_str(), *resolver);
+        dirty_cells.insert(abs_address_t(0,row,2));
+
+        // Cells in column D all share the same formula tokens and don't
+        // depend on each other.
+        os.str(std::string());
+        os << "A" << row + 1 << "*2+$A$1";
+        formula = os.str();
+        insert_formula(cxt, abs_address_t(0,row,3), formula.c_str(), *resolver);
+        dirty_cells.insert(abs_address_t(0,row,3));
+    }
+
+    assert(cxt.get_formula_cell(abs_address_t(0,row_size-1,3))->is_shared());
+
+    modified_cells_t dirty_addrs;
+    dirty_addrs.push_back(abs_address_t(0,0,0));
+
+    for (size_t loop = 0; loop < 5; ++loop)
+    {
+        double offset = loop * 10.0;
+        if (loop)
+        {
+            // Modify A1, which affects all formula cells.
+            cxt.set_numeric_cell(abs_address_t(0,0,0), model_id + offset);
+            dirty_cells.clear();
+            get_all_dirty_cells(cxt, dirty_addrs, dirty_cells);
+            assert(dirty_cells.size() == row_size*3);
+        }
+
+        calculate_cells(cxt, dirty_cells, 1 + model_id % 4);
+
+        double expected = offset;
+        for (size_t i = 0; i < row_size; ++i)
+        {
+            row_t row = i;
+            expected += model_id + i;
+            assert(cxt.get_numeric_value(abs_address_t(0,row,1)) == expected);
+            assert(cxt.get_numeric_value(abs_address_t(0,row,2)) == expected);
+
+            double a1 = model_id + offset;
+            double a = row ? model_id + i : a1;
+            assert(cxt.get_numeric_value(abs_address_t(0,row,3)) == a*2 + a1);
+        }
+    }
+}
+
+void test_concurrent_models()
+{
+    cout << "test concurrent models" << endl;
+
+    // Calculate multiple independent models simultaneously, each using its
+    // own set of worker threads.
+    const size_t model_count = 8;
+    boost::thread_group threads;
+    for (size_t i = 0; i < model_count; ++i)
+        threads.create_thread(::boost::bind(&run_concurrent_model, i, 200));
+
+    threads.join_all();
+}
+
+void test_shared_formula_tasks()
+{
+    cout << "test shared formula tasks" << endl;
+
+    model_context cxt;
+    cxt.set_thread_pool_size(1);
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    assert(resolver);
+
+    const row_t row_size = 300;
+    cxt.append_sheet(IXION_ASCII("test"), row_size, 8);
+
+    // Column B shares one formula, and references the values in column A.
+    for (row_t row = 0; row < row_size; ++row)
+    {
+        cxt.set_numeric_cell(abs_address_t(0,row,0), row);
+
+        std::ostringstream os;
+        os << "A" << row + 1 << "*2";
+        std::string formula = os.str();
+        insert_formula(cxt, abs_address_t(0,row,1), formula.c_str(), *resolver);
+    }
+
+    // Column E shares one formula referencing column F.  F1:F5 are values,
+    // and F6:F10 share another formula, so E1:E5 and E6:E10 end up at
+    // different dependency levels.  G1:G3 don't share their formulas.
+    for (row_t row = 0; row < 10; ++row)
+    {
+        std::ostringstream os;
+        os << "F" << row + 1 << "*2";
+        std::string formula = os.str();
+        insert_formula(cxt, abs_address_t(0,row,4), formula.c_str(), *resolver);
+
+        if (row < 5)
+        {
+            cxt.set_numeric_cell(abs_address_t(0,row,5), row);
+            continue;
+        }
+
+        os.str(std::string());
+        os << "A" << row + 1 << "+1";
+        formula = os.str();
+        insert_formula(cxt, abs_address_t(0,row,5), formula.c_str(), *resolver);
+    }
+    insert_formula(cxt, abs_address_t(0,0,6), "A1+1", *resolver);
+    insert_formula(cxt, abs_address_t(0,1,6), "A2*5", *resolver);
+    insert_formula(cxt, abs_address_t(0,2,6), "SUM(A1:A3)", *resolver);
+
+    assert(cxt.get_formula_cell(abs_address_t(0,row_size-1,1))->is_shared());
+    assert(cxt.get_formula_cell(abs_address_t(0,9,4))->is_shared());
+    assert(cxt.get_formula_cell(abs_address_t(0,9,5))->is_shared());
+    assert(!cxt.get_formula_cell(abs_address_t(0,1,6))->is_shared());
+
+    // Collect the formula cells in the given columns down to the given row.
+    auto add_cells = [&cxt](std::vector<abs_address_t>& cells, col_t first_col, col_t last_col, row_t row_count)
+    {
+        for (col_t col = first_col; col <= last_col; ++col)
+        {
+            for (row_t row = 0; row < row_count; ++row)
+            {
+                abs_address_t pos(0,row,col);
+                if (cxt.get_celltype(pos) == celltype_t::formula)
+                    cells.push_back(pos);
+            }
+        }
+    };
+
+    // Group the cells of each dependency level into tasks the same way the
+    // scheduler does, and return the number of tasks.
+    typedef std::vector<std::vector<abs_address_t>> levels_type;
+    auto count_tasks = [&cxt](levels_type levels)
+    {
+        cell_dependency_graph graph;
+        graph.level_offsets.push_back(0);
+        for (std::vector<abs_address_t>& level : levels)
+        {
+            std::sort(level.begin(), level.end(),
+                [](const abs_address_t& left, const abs_address_t& right) -> bool
+                {
+                    return std::tie(left.sheet, left.column, left.row) < std::tie(right.sheet, right.column, right.row);
+                }
+            );
+            graph.cells.insert(graph.cells.end(), level.begin(), level.end());
+            graph.level_offsets.push_back(graph.cells.size());
+        }
+
+        std::vector<size_t> task_offsets, cell_tasks;
+        build_cell_tasks(cxt, graph, task_offsets, cell_tasks);
+        assert(cell_tasks.size() == graph.cells.size());
+        assert(task_offsets.front() == 0 && task_offsets.back() == graph.cells.size());
+        return task_offsets.size() - 1;
+    };
+
+    // A run of shared cells forms one task, up to 128 cells.
+    levels_type levels(1);
+    add_cells(levels[0], 1, 1, 128);
+    assert(count_tasks(levels) == 1);
+    levels[0].clear();
+    add_cells(levels[0], 1, 1, 129);
+    assert(count_tasks(levels) == 2);
+    levels[0].clear();
+    add_cells(levels[0], 1, 1, row_size);
+    assert(count_tasks(levels) == 3);
+
+    // A cell missing from the run breaks it.
+    levels[0].clear();
+    for (row_t row = 0; row < 20; ++row)
+    {
+        if (row != 10)
+            levels[0].push_back(abs_address_t(0,row,1));
+    }
+    assert(count_tasks(levels) == 2);
+
+    // Without F6:F10 being calculated along with it, all of column E is at
+    // the same level.  Otherwise E6:E10 are a level above E1:E5, which
+    // breaks the run.
+    levels[0].clear();
+    add_cells(levels[0], 5, 5, 10);
+    assert(count_tasks(levels) == 1);
+    levels[0].clear();
+    add_cells(levels[0], 4, 4, 10);
+    assert(count_tasks(levels) == 1);
+
+    levels.assign(2, std::vector<abs_address_t>());
+    add_cells(levels[0], 4, 4, 5);
+    add_cells(levels[0], 5, 5, 10);
+    for (row_t row = 5; row < 10; ++row)
+        levels[1].push_back(abs_address_t(0,row,4));
+    assert(count_tasks(levels) == 3);
+
+    // A change of column breaks a run, and cells not sharing their formulas
+    // form tasks of their own.
+    add_cells(levels[0], 6, 6, 10);
+    assert(count_tasks(levels) == 6);
+
+    levels[0].clear();
+    add_cells(levels[0], 0, 3, row_size);
+    add_cells(levels[0], 4, 4, 5);
+    add_cells(levels[0], 5, 7, row_size);
+    assert(count_tasks(levels) == 3 + 2 + 1 + 3);
+
+    // The tasks get calculated like any other cells.
+    dirty_formula_cells_t cells;
+    for (const std::vector<abs_address_t>& level : levels)
+        cells.insert(level.begin(), level.end());
+    calculate_cells(cxt, cells, 1);
+    assert(cxt.get_numeric_value(abs_address_t(0,row_size-1,1)) == (row_size - 1) * 2.0);
+    assert(cxt.get_numeric_value(abs_address_t(0,4,4)) == 8.0);
+    assert(cxt.get_numeric_value(abs_address_t(0,9,4)) == 20.0);
+    assert(cxt.get_numeric_value(abs_address_t(0,2,6)) == 3.0);
+}
+
+void test_task_homes()
+{
+    cout << "test task homes" << endl;
+
+    // Each cell is a task of its own, except for a run of cells in C1020:C1030
+    // which crosses into the next region.  The cells are not in any
+    // particular order.
+    cell_dependency_graph graph;
+    std::vector<size_t> task_offsets;
+    for (row_t row = 0; row < 3000; row += 7)
+    {
+        task_offsets.push_back(graph.cells.size());
+        graph.cells.push_back(abs_address_t(0,row,1));
+    }
+    task_offsets.push_back(graph.cells.size());
+    for (row_t row = 1019; row < 1030; ++row)
+        graph.cells.push_back(abs_address_t(0,row,2));
+    for (row_t row = 5000; row < 5100; row += 10)
+    {
+        task_offsets.push_back(graph.cells.size());
+        graph.cells.push_back(abs_address_t(1,row,0));
+        task_offsets.push_back(graph.cells.size());
+        graph.cells.push_back(abs_address_t(0,row,3));
+    }
+    task_offsets.push_back(graph.cells.size());
+
+    // There are three regions in column B, followed by one each in columns
+    // C and D, and then the one in column A of the second sheet.
+    size_t task_count = task_offsets.size() - 1;
+    const size_t region_count = 6;
+    auto get_region = [](const abs_address_t& pos) -> size_t
+    {
+        if (pos.sheet == 1)
+            return 5;
+
+        switch (pos.column)
+        {
+            case 1:
+                return pos.row / region_row_size;
+            case 2:
+                return 3;
+            default:
+                return 4;
+        }
+    };
+
+    for (size_t worker_count = 1; worker_count <= 8; ++worker_count)
+    {
+        std::vector<size_t> homes;
+        assign_task_homes(graph, task_offsets, worker_count, homes);
+        assert(homes.size() == task_count);
+
+        // Tasks of the same region share the same home, and the regions in
+        // order go to the workers in order, in contiguous ranges.  Each
+        // worker gets a region as long as there are enough regions.
+        std::vector<size_t> region_homes(region_count, worker_count);
+        for (size_t i = 0; i < task_count; ++i)
+        {
+            assert(homes[i] < worker_count);
+            size_t region = get_region(graph.cells[task_offsets[i]]);
+            assert(region_homes[region] == worker_count || region_homes[region] == homes[i]);
+            region_homes[region] = homes[i];
+        }
+
+        std::set<size_t> workers;
+        for (size_t region = 0; region < region_count; ++region)
+        {
+            assert(region_homes[region] < worker_count);
+            if (region)
+                assert(region_homes[region-1] <= region_homes[region]);
+            workers.insert(region_homes[region]);
+        }
+        assert(workers.size() == std::min(worker_count, region_count));
+    }
+
+    // The batches of each wavefront level get divided into contiguous shares
+    // covering all of them, one share for each worker.  Each share differs
+    // in size by at most one batch from the others.
+    for (size_t batch_count = 1; batch_count <= 40; ++batch_count)
+    {
+        for (size_t share_count = 1; share_count <= std::min<size_t>(batch_count, 8); ++share_count)
+        {
+            assert(get_share_offset(batch_count, share_count, 0) == 0);
+            assert(get_share_offset(batch_count, share_count, share_count) == batch_count);
+
+            size_t min_size = batch_count, max_size = 0;
+            for (size_t share = 0; share < share_count; ++share)
+            {
+                size_t begin = get_share_offset(batch_count, share_count, share);
+                size_t end = get_share_offset(batch_count, share_count, share + 1);
+                assert(begin < end);
+                min_size = std::min(min_size, end - begin);
+                max_size = std::max(max_size, end - begin);
+            }
+            assert(max_size - min_size <= 1);
+        }
+    }
+}
+
+void test_task_priorities()
+{
+    cout << "test task priorities" << endl;
+
+    model_context cxt;
+    cxt.set_thread_pool_size(1);
+    cell_order_recorder recorder;
+    cxt.set_session_handler(&recorder);
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    assert(resolver);
+
+    const row_t chain_size = 50;
+    const row_t wide_size = 200;
+    cxt.append_sheet(IXION_ASCII("test"), wide_size, 4);
+    cxt.set_numeric_cell(abs_address_t(0,0,0), 1.0);
+
+    // Column B is a long chain starting from A1.  Column C consists of
+    // cheap cells depending only on A1, which come after the head of the
+    // chain in the cell array, and are all ready to run along with it.
+    dirty_formula_cells_t dirty_cells;
+    for (row_t row = 0; row < chain_size; ++row)
+    {
+        std::ostringstream os;
+        if (row)
+            os << "B" << row << "+1";
+        else
+            os << "A1+1";
+        std::string formula = os.str();
+        insert_formula(cxt, abs_address_t(0,row,1), formula.c_str(), *resolver);
+        dirty_cells.insert(abs_address_t(0,row,1));
+    }
+
+    for (row_t row = 0; row < wide_size; ++row)
+    {
+        insert_formula(cxt, abs_address_t(0,row,2), "$A$1*2", *resolver);
+        dirty_cells.insert(abs_address_t(0,row,2));
+    }
+
+    // Without known costs, every cell is assumed to cost the same.  With one
+    // worker thread, the chain runs first, as every cell of it but the last
+    // has a longer path ahead than any of the cells in column C.
+    recorder.clear();
+    calculate_cells(cxt, dirty_cells, 1);
+    const std::vector<abs_address_t>& cells = recorder.get_cells();
+    assert(cells.size() == size_t(chain_size + wide_size));
+    for (row_t row = 0; row < chain_size - 1; ++row)
+        assert(cells[row] == abs_address_t(0,row,1));
+    assert(cxt.get_numeric_value(abs_address_t(0,chain_size-1,1)) == 1.0 + chain_size);
+    assert(cxt.get_numeric_value(abs_address_t(0,wide_size-1,2)) == 2.0);
+
+    // The costs recorded in the calculation get used in the next one.  The
+    // order then depends on the measured times, which may vary.
+    assert(cxt.get_formula_cell(abs_address_t(0,0,1))->get_eval_cost() > 0);
+    assert(cxt.get_formula_cell(abs_address_t(0,0,2))->get_eval_cost() > 0);
+    cxt.set_numeric_cell(abs_address_t(0,0,0), 2.0);
+    modified_cells_t modified(1, abs_address_t(0,0,0));
+    dirty_cells.clear();
+    get_all_dirty_cells(cxt, modified, dirty_cells);
+    recorder.clear();
+    calculate_cells(cxt, dirty_cells, 1);
+    assert(cells.size() == size_t(chain_size + wide_size));
+    assert(cxt.get_numeric_value(abs_address_t(0,chain_size-1,1)) == 2.0 + chain_size);
+    assert(cxt.get_numeric_value(abs_address_t(0,wide_size-1,2)) == 4.0);
+
+    cxt.set_session_handler(NULL);
+}
+
+void test_async_calculation()
+{
+    cout << "test async calculation" << endl;
+
+    model_context cxt;
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    assert(resolver);
+
+    cxt.append_sheet(IXION_ASCII("test"), 1048576, 1024);
+
+    // A1 takes a second to calculate, and A2:A50 each reference the cell
+    // above it.
+    dirty_formula_cells_t dirty_cells;
+    insert_formula(cxt, abs_address_t(0,0,0), "WAIT()", *resolver);
+    dirty_cells.insert(abs_address_t(0,0,0));
+    for (row_t row = 1; row < 50; ++row)
+    {
+        std::ostringstream os;
+        os << "A" << row << "+1";
+        std::string formula = os.str();
+        abs_address_t pos(0,row,0);
+        insert_formula(cxt, pos, formula.c_str(), *resolver);
+        dirty_cells.insert(pos);
+    }
+
+    // Cancel the calculation while A1 is still being calculated.
+    std::unique_ptr<calc_handle> handle = calculate_cells_async(cxt, dirty_cells, 2);
+    assert(handle);
+    handle->cancel();
+    assert(handle->is_cancelled());
+    handle->wait();
+    assert(handle->is_done());
+    assert(handle->get_progress() < 100.0);
+
+    // Cells that have not been calculated should have no results.
+    dirty_formula_cells_t pending_cells;
+    handle->get_pending_cells(pending_cells);
+    assert(pending_cells.size() >= 49);
+    for (const abs_address_t& pos : pending_cells)
+        assert(!cxt.get_formula_cell(pos)->has_result());
+
+    // Calculate the remaining cells.  Reading the value of a cell blocks
+    // until the cell gets calculated.
+    handle = calculate_cells_async(cxt, pending_cells, 2);
+    assert(cxt.get_numeric_value(abs_address_t(0,49,0)) == 50.0);
+    handle->wait();
+    assert(handle->is_done());
+    assert(!handle->is_cancelled());
+    assert(handle->get_progress() == 100.0);
+
+    pending_cells.clear();
+    handle->get_pending_cells(pending_cells);
+    assert(pending_cells.empty());
+    assert(cxt.get_numeric_value(abs_address_t(0,49,0)) == 50.0);
+}
+
+/**
+ * Session handler that logs all session events as text.
+ */
+class event_logger : public iface::session_handler
+{
+    const model_context& m_context;
+    std::ostringstream m_log;
+
+public:
+    event_logger(const model_context& cxt) : m_context(cxt) {}
+
+    std::string str() const { return m_log.str(); }
+
+    virtual void begin_cell_interpret(const abs_address_t& pos)
+    {
+        m_log << "begin " << pos.sheet << ',' << pos.row << ',' << pos.column << endl;
+    }
+
+    virtual void set_result(const formula_result& result)
+    {
+        m_log << "result " << result.str(m_context) << endl;
+    }
+
+    virtual void set_invalid_expression(const char* msg)
+    {
+        m_log << "invalid " << msg << endl;
+    }
+
+    virtual void set_formula_error(const char* msg)
+    {
+        m_log << "error " << msg << endl;
+    }
+
+    virtual void push_token(fopcode_t fop)
+    {
+        m_log << "token " << get_formula_opcode_string(fop) << endl;
+    }
+
+    virtual void push_value(double val)
+    {
+        m_log << "value " << val << endl;
+    }
+
+    virtual void push_string(size_t sid)
+    {
+        m_log << "string " << sid << endl;
+    }
+
+    virtual void push_single_ref(const address_t& addr, const abs_address_t& pos)
+    {
+        m_log << "ref " << addr.to_abs(pos).row << ',' << addr.to_abs(pos).column << endl;
+    }
+
+    virtual void push_range_ref(const range_t& range, const abs_address_t& pos)
+    {
+        abs_range_t r = range.to_abs(pos);
+        m_log << "range " << r.first.row << ',' << r.first.column << ':' << r.last.row << ',' << r.last.column << endl;
+    }
+
+    virtual void push_table_ref(const table_t& /*table*/)
+    {
+        m_log << "table" << endl;
+    }
+
+    virtual void push_function(formula_function_t foc)
+    {
+        m_log << "function " << get_formula_function_name(foc) << endl;
+    }
+};
+
+/**
+ * Calculate a model in the deterministic mode, and return the session
+ * events, the content of the string pool and the cell results as text.
+ */
+std::string run_deterministic_model(size_t thread_count)
+{
+    const size_t row_size = 300;
+
+    model_context cxt;
+    config cfg;
+    cfg.calc_mode = calc_mode_t::deterministic;
+    cxt.set_config(cfg);
+    event_logger logger(cxt);
+    cxt.set_session_handler(&logger);
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    assert(resolver);
+
+    cxt.append_sheet(IXION_ASCII("test"), 1048576, 1024);
+
+    // Cells in column B create new strings, cells in column C don't, and
+    // cells in column D depend on both.
+    dirty_formula_cells_t dirty_cells;
+    for (size_t i = 0; i < row_size; ++i)
+    {
+        row_t row = i;
+        cxt.set_numeric_cell(abs_address_t(0,row,0), i);
+
+        std::ostringstream os;
+        os << "CONCATENATE(\"s\",A" << row + 1 << ")";
+        std::string formula = os.str();
+        insert_formula(cxt, abs_address_t(0,row,1), formula.c_str(), *resolver);
+        dirty_cells.insert(abs_address_t(0,row,1));
+
+        os.str(std::string());
+        os << "A" << row + 1 << "*2";
+        formula = os.str();
+        insert_formula(cxt, abs_address_t(0,row,2), formula.c_str(), *resolver);
+        dirty_cells.insert(abs_address_t(0,row,2));
+
+        os.str(std::string());
+        os << "LEN(B" << row + 1 << ")+C" << row + 1;
+        formula = os.str();
+        insert_formula(cxt, abs_address_t(0,row,3), formula.c_str(), *resolver);
+        dirty_cells.insert(abs_address_t(0,row,3));
+    }
+
+    size_t string_count = cxt.get_string_count();
+    calculate_cells(cxt, dirty_cells, thread_count);
+
+    // Each cell in column B adds a new string to the pool.
+    assert(cxt.get_string_count() == string_count + row_size);
+    formula_result result;
+    assert(cxt.get_formula_cell(abs_address_t(0,0,1))->get_result_cache(result));
+    assert(result.get_type() == formula_result::rt_string);
+    assert(*cxt.get_string(result.get_string()) == "s0");
+    assert(cxt.get_numeric_value(abs_address_t(0,row_size-1,3)) == 4.0 + (row_size - 1) * 2);
+
+    std::ostringstream os;
+    os << logger.str();
+    for (size_t i = 0, n = cxt.get_string_count(); i < n; ++i)
+        os << "string pool " << i << ": " << *cxt.get_string(i) << endl;
+
+    for (size_t i = 0; i < row_size; ++i)
+    {
+        row_t row = i;
+        for (col_t col = 1; col <= 3; ++col)
+        {
+            formula_result res;
+            cxt.get_formula_cell(abs_address_t(0,row,col))->get_result_cache(res);
+            os << "cell " << row << ',' << col << ": " << res.str(cxt) << endl;
+        }
+    }
+
+    return os.str();
+}
+
+void test_deterministic_calculation()
+{
+    cout << "test deterministic calculation" << endl;
+
+    // The outcome must be the same regardless of the number of threads.
+    std::string expected = run_deterministic_model(0);
+    assert(!expected.empty());
+    for (size_t thread_count = 1; thread_count <= 8; thread_count *= 2)
+    {
+        for (size_t loop = 0; loop < 3; ++loop)
+            assert(run_deterministic_model(thread_count) == expected);
+    }
+}
+
+void test_long_dependency_chain()
+{
+    cout << "test long dependency chain" << endl;
+
+    model_context cxt;
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    assert(resolver);
+
+    const row_t row_size = 1000000;
+    cxt.append_sheet(IXION_ASCII("test"), row_size, 2);
+
+    // Column A keeps the running balance of the values in column B, which
+    // forms a single chain of dependencies spanning the entire column.
+    dirty_formula_cells_t dirty_cells;
+    cxt.set_numeric_cell(abs_address_t(0,0,0), 1.0);
+    for (row_t row = 0; row < row_size; ++row)
+        cxt.set_numeric_cell(abs_address_t(0,row,1), 1.0);
+
+    for (row_t row = 1; row < row_size; ++row)
+    {
+        std::ostringstream os;
+        os << "A" << row << "+B" << row + 1;
+        std::string formula = os.str();
+        abs_address_t pos(0,row,0);
+        insert_formula(cxt, pos, formula.c_str(), *resolver);
+        dirty_cells.insert(pos);
+    }
+
+    calculate_cells(cxt, dirty_cells, 0);
+    assert(cxt.get_numeric_value(abs_address_t(0,row_size-1,0)) == row_size);
+
+    // Modifying A1 should make the entire chain dirty.
+    cxt.set_numeric_cell(abs_address_t(0,0,0), 2.0);
+    modified_cells_t dirty_addrs;
+    dirty_addrs.push_back(abs_address_t(0,0,0));
+    dirty_cells.clear();
+    get_all_dirty_cells(cxt, dirty_addrs, dirty_cells);
+    assert(dirty_cells.size() == size_t(row_size - 1));
+
+    calculate_cells(cxt, dirty_cells, 2);
+    assert(cxt.get_numeric_value(abs_address_t(0,row_size-1,0)) == row_size + 1.0);
+}
+
+void test_persistent_dependency_graph()
+{
+    cout << "test persistent dependency graph" << endl;
+
+    model_context cxt;
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    assert(resolver);
+
+    cxt.append_sheet(IXION_ASCII("test"), 100, 5);
+    const cell_listener_tracker& tracker = cxt.get_cell_listener_tracker();
+
+    // A1:A3 store values.  B1 references the range, and C1 references B1.
+    for (row_t row = 0; row < 3; ++row)
+        cxt.set_numeric_cell(abs_address_t(0,row,0), row + 1.0);
+
+    abs_address_t B1(0,0,1), C1(0,0,2), D1(0,0,3);
+    insert_formula(cxt, B1, "SUM(A1:A3)", *resolver);
+    insert_formula(cxt, C1, "B1*2", *resolver);
+
+    const cell_listener_tracker::precedents_type* refs = tracker.get_precedents(B1);
+    assert(refs && refs->cells.empty() && refs->ranges.size() == 1);
+    refs = tracker.get_precedents(C1);
+    assert(refs && refs->cells.size() == 1 && refs->cells[0] == B1 && refs->ranges.empty());
+
+    dirty_formula_cells_t dirty_cells;
+    dirty_cells.insert(B1);
+    dirty_cells.insert(C1);
+    calculate_cells(cxt, dirty_cells, 0);
+    assert(cxt.get_numeric_value(C1) == 12.0);
+
+    // Modifying A2 should make both B1 and C1 dirty, via the range reference
+    // then the single cell reference.
+    modified_cells_t dirty_addrs;
+    dirty_addrs.push_back(abs_address_t(0,1,0));
+    cxt.set_numeric_cell(dirty_addrs[0], 10.0);
+    dirty_cells.clear();
+    get_all_dirty_cells(cxt, dirty_addrs, dirty_cells);
+    assert(dirty_cells.size() == 2 && dirty_cells.count(B1) && dirty_cells.count(C1));
+    calculate_cells(cxt, dirty_cells, 0);
+    assert(cxt.get_numeric_value(C1) == 28.0);
+
+    // Change C1 to reference A3 instead.  The stored references of C1 must
+    // follow the change.
+    unregister_formula_cell(cxt, C1);
+    assert(!tracker.get_precedents(C1));
+    insert_formula(cxt, C1, "A3+B1", *resolver);
+    refs = tracker.get_precedents(C1);
+    assert(refs && refs->cells.size() == 2);
+
+    // D1 is never registered, so its references get picked up from its
+    // tokens.
+    cxt.set_formula_cell(D1, IXION_ASCII("C1+1"), *resolver);
+
+    dirty_cells.clear();
+    dirty_cells.insert(B1);
+    dirty_cells.insert(C1);
+    dirty_cells.insert(D1);
+    calculate_cells(cxt, dirty_cells, 0);
+    assert(cxt.get_numeric_value(C1) == 17.0);
+    assert(cxt.get_numeric_value(D1) == 18.0);
+
+    // Unregistering B1 removes its range reference.
+    unregister_formula_cell(cxt, B1);
+    assert(!tracker.get_precedents(B1));
+    dirty_cells.clear();
+    dirty_addrs.clear();
+    dirty_addrs.push_back(abs_address_t(0,0,0));
+    get_all_dirty_cells(cxt, dirty_addrs, dirty_cells);
+    assert(dirty_cells.empty());
+
+    // Each cell of E11:E30 references the cell below, and gets registered
+    // before it.  They still get calculated from the bottom up.
+    dirty_cells.clear();
+    for (row_t row = 10; row < 30; ++row)
+    {
+        std::ostringstream os;
+        os << "E" << row + 2 << "+1";
+        std::string formula = os.str();
+        abs_address_t pos(0,row,4);
+        insert_formula(cxt, pos, formula.c_str(), *resolver);
+        dirty_cells.insert(pos);
+    }
+
+    calculate_cells(cxt, dirty_cells, 0);
+    assert(cxt.get_numeric_value(abs_address_t(0,10,4)) == 20.0);
+
+    // E31 gets added below the cells already calculated, which then need
+    // to be calculated after it.
+    abs_address_t E31(0,30,4), E32(0,31,4);
+    insert_formula(cxt, E31, "A1*10", *resolver);
+    dirty_addrs.clear();
+    dirty_addrs.push_back(E31);
+    dirty_cells.clear();
+    dirty_cells.insert(E31);
+    get_all_dirty_cells(cxt, dirty_addrs, dirty_cells);
+    assert(dirty_cells.size() == 21);
+    calculate_cells(cxt, dirty_cells, 2);
+    assert(cxt.get_numeric_value(abs_address_t(0,10,4)) == 30.0);
+
+    // E32 references all of them through a range.
+    insert_formula(cxt, E32, "SUM(E11:E31)", *resolver);
+    dirty_cells.clear();
+    dirty_cells.insert(E32);
+    dirty_addrs.clear();
+    dirty_addrs.push_back(E31);
+    get_all_dirty_cells(cxt, dirty_addrs, dirty_cells);
+    assert(dirty_cells.size() == 21);
+    calculate_cells(cxt, dirty_cells, 0);
+    assert(cxt.get_numeric_value(E32) == 420.0);
+}
+
+void test_range_listeners_per_sheet()
+{
+    cout << "test range listeners per sheet" << endl;
+
+    model_context cxt;
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    assert(resolver);
+
+    // Each sheet has the same formula referencing the same range on its own
+    // sheet.
+    const sheet_t sheet_size = 3;
+    for (sheet_t sheet = 0; sheet < sheet_size; ++sheet)
+    {
+        std::ostringstream os;
+        os << "Sheet" << sheet + 1;
+        std::string name = os.str();
+        cxt.append_sheet(name.data(), name.size(), 10, 2);
+
+        for (row_t row = 0; row < 3; ++row)
+            cxt.set_numeric_cell(abs_address_t(sheet,row,0), row + 1.0);
+
+        insert_formula(cxt, abs_address_t(sheet,0,1), "SUM(A1:A3)", *resolver);
+    }
+
+    const cell_listener_tracker& tracker = cxt.get_cell_listener_tracker();
+    for (sheet_t sheet = 0; sheet < sheet_size; ++sheet)
+    {
+        // Only the formula cell on the same sheet listens to the range.
+        dirty_formula_cells_t listeners;
+        tracker.get_all_range_listeners(abs_address_t(sheet,1,0), listeners);
+        assert(listeners.size() == 1);
+        assert(*listeners.begin() == abs_address_t(sheet,0,1));
+
+        // Cells outside the range have no listeners.
+        listeners.clear();
+        tracker.get_all_range_listeners(abs_address_t(sheet,3,0), listeners);
+        assert(listeners.empty());
+    }
+
+    // Unregistering the cell on the second sheet leaves the other sheets
+    // intact.
+    unregister_formula_cell(cxt, abs_address_t(1,0,1));
+    for (sheet_t sheet = 0; sheet < sheet_size; ++sheet)
+    {
+        dirty_formula_cells_t listeners;
+        tracker.get_all_range_listeners(abs_address_t(sheet,0,0), listeners);
+        assert(listeners.size() == (sheet == 1 ? 0u : 1u));
+    }
+
+    // Sheets without any ranges have no listeners either.
+    dirty_formula_cells_t listeners;
+    tracker.get_all_range_listeners(abs_address_t(sheet_size+1,0,0), listeners);
+    assert(listeners.empty());
+}
+
+void build_bulk_model(model_context& cxt, bool bulk)
+{
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    assert(resolver);
+
+    const row_t row_size = 50;
+    cxt.append_sheet(IXION_ASCII("test"), row_size, 4);
+    for (row_t row = 0; row < row_size; ++row)
+        cxt.set_numeric_cell(abs_address_t(0,row,0), row);
+
+    // Column B references single cells, including the same cell twice, and
+    // column C references ranges, many of which are shared.
+    for (row_t row = 0; row < row_size; ++row)
+    {
+        std::ostringstream os;
+        os << "A" << row + 1 << "*A" << row + 1 << "+A" << row / 10 + 1;
+        std::string formula = os.str();
+        cxt.set_formula_cell(abs_address_t(0,row,1), formula.data(), formula.size(), *resolver);
+
+        os.str(std::string());
+        os << "SUM(A" << row / 10 + 1 << ":A" << row / 10 + 10 << ")+B" << row + 1;
+        formula = os.str();
+        cxt.set_formula_cell(abs_address_t(0,row,2), formula.data(), formula.size(), *resolver);
+    }
+
+    if (bulk)
+    {
+        abs_range_t range;
+        range.first = abs_address_t(0,0,0);
+        range.last = abs_address_t(0,row_size-1,3);
+        register_formula_cells(cxt, range);
+        return;
+    }
+
+    for (row_t row = 0; row < row_size; ++row)
+    {
+        register_formula_cell(cxt, abs_address_t(0,row,1));
+        register_formula_cell(cxt, abs_address_t(0,row,2));
+    }
+}
+
+void test_bulk_registration()
+{
+    cout << "test bulk registration" << endl;
+
+    model_context cxt1, cxt2;
+    build_bulk_model(cxt1, false);
+    build_bulk_model(cxt2, true);
+
+    const cell_listener_tracker& tracker1 = cxt1.get_cell_listener_tracker();
+    const cell_listener_tracker& tracker2 = cxt2.get_cell_listener_tracker();
+
+    for (row_t row = 0; row < 50; ++row)
+    {
+        for (col_t col = 1; col <= 2; ++col)
+        {
+            abs_address_t pos(0,row,col);
+            const cell_listener_tracker::precedents_type* refs1 = tracker1.get_precedents(pos);
+            const cell_listener_tracker::precedents_type* refs2 = tracker2.get_precedents(pos);
+            if (cxt1.get_formula_cell(pos)->is_shared())
+            {
+                // The references of cells sharing a formula are only stored
+                // in their blocks.
+                assert(!refs1 && !refs2);
+                continue;
+            }
+
+            assert(refs1 && refs2);
+
+            std::set<abs_address_t> cells1(refs1->cells.begin(), refs1->cells.end());
+            std::set<abs_address_t> cells2(refs2->cells.begin(), refs2->cells.end());
+            assert(cells1 == cells2);
+            assert(cells1.size() == refs2->cells.size());
+
+            std::set<abs_range_t> ranges1(refs1->ranges.begin(), refs1->ranges.end());
+            std::set<abs_range_t> ranges2(refs2->ranges.begin(), refs2->ranges.end());
+            assert(ranges1 == ranges2);
+        }
+
+        // Both models must find the same dirty cells.
+        modified_cells_t addrs1, addrs2;
+        addrs1.push_back(abs_address_t(0,row,0));
+        addrs2.push_back(abs_address_t(0,row,0));
+        dirty_formula_cells_t dirty1, dirty2;
+        get_all_dirty_cells(cxt1, addrs1, dirty1);
+        get_all_dirty_cells(cxt2, addrs2, dirty2);
+        assert(!dirty1.empty());
+        assert(dirty1 == dirty2);
+    }
+
+    // Registering with a list skips the positions without formula cells.
+    model_context cxt3;
+    build_bulk_model(cxt3, false);
+    std::vector<abs_address_t> cells;
+    cells.push_back(abs_address_t(0,0,0));
+    cells.push_back(abs_address_t(0,0,3));
+    register_formula_cells(cxt3, cells);
+    assert(!cxt3.get_cell_listener_tracker().get_precedents(abs_address_t(0,0,0)));
+    assert(!cxt3.get_cell_listener_tracker().get_precedents(abs_address_t(0,0,3)));
+
+    // Unregistering a cell registered in bulk works the same.  A6 is
+    // referenced by B6, and by all cells in column C via their ranges, but
+    // C1 no longer listens.
+    unregister_formula_cell(cxt2, abs_address_t(0,0,2));
+    assert(!tracker2.get_precedents(abs_address_t(0,0,2)));
+    modified_cells_t addrs;
+    addrs.push_back(abs_address_t(0,5,0));
+    dirty_formula_cells_t dirty;
+    get_all_dirty_cells(cxt2, addrs, dirty);
+    assert(dirty.size() == 50);
+    assert(!dirty.count(abs_address_t(0,0,2)));
+}
+
+void test_listener_storage()
+{
+    cout << "test listener storage" << endl;
+
+    model_context cxt;
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    assert(resolver);
+
+    const row_t row_size = 20;
+    cxt.append_sheet(IXION_ASCII("test"), row_size, 2);
+    cxt.set_numeric_cell(abs_address_t(0,0,0), 1.0);
+
+    // Every cell in column B references A1, so A1 has many listeners.  Each
+    // cell uses a different formula so that the cells don't share one.
+    for (row_t row = 0; row < row_size; ++row)
+    {
+        std::ostringstream os;
+        os << "$A$1*" << row + 1;
+        std::string formula = os.str();
+        insert_formula(cxt, abs_address_t(0,row,1), formula.c_str(), *resolver);
+    }
+
+    const cell_listener_tracker& tracker = cxt.get_cell_listener_tracker();
+    size_t full_size = tracker.get_memory_size();
+    assert(full_size > 0);
+
+    dirty_formula_cells_t listeners;
+    tracker.get_all_cell_listeners(abs_address_t(0,0,0), listeners);
+    assert(listeners.size() == size_t(row_size));
+
+    // Unregister every other cell, in reverse order.
+    for (row_t row = row_size - 1; row >= 0; row -= 2)
+        unregister_formula_cell(cxt, abs_address_t(0,row,1));
+
+    listeners.clear();
+    tracker.get_all_cell_listeners(abs_address_t(0,0,0), listeners);
+    assert(listeners.size() == size_t(row_size / 2));
+    for (row_t row = 0; row < row_size; row += 2)
+        assert(listeners.count(abs_address_t(0,row,1)));
+
+    // Leave only one listener.
+    for (row_t row = 2; row < row_size; row += 2)
+        unregister_formula_cell(cxt, abs_address_t(0,row,1));
+
+    listeners.clear();
+    tracker.get_all_cell_listeners(abs_address_t(0,0,0), listeners);
+    assert(listeners.size() == 1);
+    assert(listeners.count(abs_address_t(0,0,1)));
+    assert(tracker.get_memory_size() < full_size);
+
+    // Register them all again.
+    for (row_t row = 1; row < row_size; ++row)
+        register_formula_cell(cxt, abs_address_t(0,row,1));
+
+    listeners.clear();
+    tracker.get_all_cell_listeners(abs_address_t(0,0,0), listeners);
+    assert(listeners.size() == size_t(row_size));
+}
+
+void build_shared_formula_model(model_context& cxt, row_t row_size)
+{
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    assert(resolver);
+
+    cxt.append_sheet(IXION_ASCII("test"), row_size, 3);
+    for (row_t row = 0; row < row_size; ++row)
+        cxt.set_numeric_cell(abs_address_t(0,row,0), row);
+
+    // Column B references single cells, and column C references ranges
+    // growing by one row each.  Each column shares one formula.
+    for (row_t row = 0; row < row_size; ++row)
+    {
+        std::ostringstream os;
+        os << "A" << row + 1 << "*2";
+        std::string formula = os.str();
+        cxt.set_formula_cell(abs_address_t(0,row,1), formula.data(), formula.size(), *resolver);
+
+        os.str(std::string());
+        os << "SUM($A$1:A" << row + 1 << ")";
+        formula = os.str();
+        cxt.set_formula_cell(abs_address_t(0,row,2), formula.data(), formula.size(), *resolver);
+    }
+
+    for (row_t row = 0; row < row_size; ++row)
+    {
+        register_formula_cell(cxt, abs_address_t(0,row,1));
+        register_formula_cell(cxt, abs_address_t(0,row,2));
+    }
+}
+
+void test_shared_formula_listeners()
+{
+    cout << "test shared formula listeners" << endl;
+
+    const row_t row_size = 1000;
+    model_context cxt;
+    build_shared_formula_model(cxt, row_size);
+    const cell_listener_tracker& tracker = cxt.get_cell_listener_tracker();
+
+    // The cells using shared formulas don't store their references.
+    assert(cxt.get_formula_cell(abs_address_t(0,10,1))->is_shared());
+    assert(!tracker.get_precedents(abs_address_t(0,10,1)));
+
+    dirty_formula_cells_t listeners;
+    tracker.get_all_cell_listeners(abs_address_t(0,9,0), listeners);
+    assert(listeners.size() == 1);
+    assert(listeners.count(abs_address_t(0,9,1)));
+
+    listeners.clear();
+    tracker.get_all_range_listeners(abs_address_t(0,9,0), listeners);
+    assert(listeners.size() == size_t(row_size - 9));
+    for (row_t row = 9; row < row_size; ++row)
+        assert(listeners.count(abs_address_t(0,row,2)));
+
+    // The memory used doesn't depend on the number of rows.
+    {
+        model_context cxt_small;
+        build_shared_formula_model(cxt_small, 10);
+        assert(cxt_small.get_cell_listener_tracker().get_memory_size() == tracker.get_memory_size());
+    }
+
+    // Unregistering cells splits the blocks around them.
+    unregister_formula_cell(cxt, abs_address_t(0,500,1));
+    unregister_formula_cell(cxt, abs_address_t(0,500,2));
+
+    listeners.clear();
+    tracker.get_all_cell_listeners(abs_address_t(0,500,0), listeners);
+    assert(listeners.empty());
+
+    listeners.clear();
+    tracker.get_all_cell_listeners(abs_address_t(0,501,0), listeners);
+    assert(listeners.size() == 1);
+    assert(listeners.count(abs_address_t(0,501,1)));
+
+    listeners.clear();
+    tracker.get_all_range_listeners(abs_address_t(0,0,0), listeners);
+    assert(listeners.size() == size_t(row_size - 1));
+    assert(!listeners.count(abs_address_t(0,500,2)));
+
+    // Register them again.
+    register_formula_cell(cxt, abs_address_t(0,500,1));
+    register_formula_cell(cxt, abs_address_t(0,500,2));
+
+    listeners.clear();
+    tracker.get_all_cell_listeners(abs_address_t(0,500,0), listeners);
+    assert(listeners.size() == 1);
+    assert(listeners.count(abs_address_t(0,500,1)));
+
+    listeners.clear();
+    tracker.get_all_range_listeners(abs_address_t(0,0,0), listeners);
+    assert(listeners.size() == size_t(row_size));
+
+    // Modify a cell and check the results.
+    cxt.set_numeric_cell(abs_address_t(0,0,0), 1000.0);
+    modified_cells_t modified;
+    modified.push_back(abs_address_t(0,0,0));
+    dirty_formula_cells_t dirty_cells;
+    get_all_dirty_cells(cxt, modified, dirty_cells);
+    assert(dirty_cells.size() == size_t(row_size + 1));
+    calculate_cells(cxt, dirty_cells, 0);
+
+    assert(cxt.get_numeric_value(abs_address_t(0,0,1)) == 2000.0);
+    double sum = 1000.0;
+    for (row_t row = 1; row < row_size; ++row)
+        sum += row;
+    assert(cxt.get_numeric_value(abs_address_t(0,row_size-1,2)) == sum);
+}
+
+void test_dirty_cell_cache()
+{
+    cout << "test dirty cell cache" << endl;
+
+    model_context cxt;
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    assert(resolver);
+
+    config cfg = cxt.get_config();
+    cfg.cache_dirty_cells = true;
+    cxt.set_config(cfg);
+
+    const row_t row_size = 20;
+    cxt.append_sheet(IXION_ASCII("test"), row_size, 3);
+    cxt.set_numeric_cell(abs_address_t(0,0,0), 1.0);
+    cxt.set_numeric_cell(abs_address_t(0,1,0), 2.0);
+
+    // Column B is a chain of cells starting from A1, and C1 sums A1:A2.
+    insert_formula(cxt, abs_address_t(0,0,1), "A1", *resolver);
+    for (row_t row = 1; row < row_size; ++row)
+    {
+        std::ostringstream os;
+        os << "B" << row << "+" << row;
+        std::string formula = os.str();
+        insert_formula(cxt, abs_address_t(0,row,1), formula.c_str(), *resolver);
+    }
+    insert_formula(cxt, abs_address_t(0,0,2), "SUM(A1:A2)", *resolver);
+
+    const cell_listener_tracker& tracker = cxt.get_cell_listener_tracker();
+    assert(tracker.get_cached_target_count() == 0);
+
+    modified_cells_t modified;
+    modified.push_back(abs_address_t(0,0,0));
+    dirty_formula_cells_t dirty_cells;
+    get_all_dirty_cells(cxt, modified, dirty_cells);
+    assert(dirty_cells.size() == size_t(row_size + 1));
+    assert(tracker.get_cached_target_count() == 1);
+
+    // The second lookup gives the same cells from the cache.
+    dirty_formula_cells_t cached_cells;
+    get_all_dirty_cells(cxt, modified, cached_cells);
+    assert(cached_cells == dirty_cells);
+    assert(tracker.get_cached_target_count() == 1);
+
+    calculate_cells(cxt, cached_cells, 0);
+    assert(cxt.get_numeric_value(abs_address_t(0,row_size-1,1)) == 1.0 + row_size * (row_size - 1) / 2);
+
+    // Registering a formula cell clears the cache.
+    insert_formula(cxt, abs_address_t(0,1,2), "A1*10", *resolver);
+    assert(tracker.get_cached_target_count() == 0);
+
+    dirty_cells.clear();
+    get_all_dirty_cells(cxt, modified, dirty_cells);
+    assert(dirty_cells.size() == size_t(row_size + 2));
+    assert(dirty_cells.count(abs_address_t(0,1,2)));
+
+    // So does unregistering one.
+    unregister_formula_cell(cxt, abs_address_t(0,0,2));
+    assert(tracker.get_cached_target_count() == 0);
+
+    dirty_cells.clear();
+    get_all_dirty_cells(cxt, modified, dirty_cells);
+    assert(dirty_cells.size() == size_t(row_size + 1));
+    assert(!dirty_cells.count(abs_address_t(0,0,2)));
+    assert(tracker.get_cached_target_count() == 1);
+
+    // The cache keeps no more targets than its size, dropping the least
+    // recently looked up one first.
+    cfg.dirty_cell_cache_size = 1;
+    cxt.set_config(cfg);
+
+    modified_cells_t modified2;
+    modified2.push_back(abs_address_t(0,1,0));
+    dirty_cells.clear();
+    get_all_dirty_cells(cxt, modified2, dirty_cells);
+    assert(dirty_cells.empty());
+    assert(tracker.get_cached_target_count() == 1);
+
+    dirty_cells.clear();
+    get_all_dirty_cells(cxt, modified, dirty_cells);
+    assert(dirty_cells.size() == size_t(row_size + 1));
+    assert(tracker.get_cached_target_count() == 1);
+}
+
+void test_parallel_dirty_cells()
+{
+    cout << "test parallel dirty cells" << endl;
+
+    const row_t row_size = 2000;
+    model_context cxt;
+    build_shared_formula_model(cxt, row_size);
+
+    // Modify every cell, every 7th cell, and a single cell of column A.
+    for (row_t step : { 1, 7, row_size })
+    {
+        modified_cells_t modified;
+        for (row_t row = step - 1; row < row_size; row += step)
+            modified.push_back(abs_address_t(0,row,0));
+
+        modified_cells_t addrs = modified;
+        dirty_formula_cells_t expected;
+        get_all_dirty_cells(cxt, addrs, expected);
+        assert(!expected.empty());
+        if (step == 1)
+            assert(expected.size() == size_t(row_size * 2));
+
+        // The threads give the same cells as the calling thread alone,
+        // including when there are more threads than modified cells.
+        for (size_t thread_count : { 2, 3, 8 })
+        {
+            addrs = modified;
+            dirty_formula_cells_t dirty_cells;
+            get_all_dirty_cells(cxt, addrs, dirty_cells, thread_count);
+            assert(dirty_cells == expected);
+        }
+    }
+}
+
+void test_circular_detection()
+{
+    cout << "test circular detection" << endl;
+
+    model_context cxt;
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    assert(resolver);
+
+    const row_t row_size = 1000;
+    cxt.append_sheet(IXION_ASCII("test"), row_size, 4);
+
+    dirty_formula_cells_t dirty_cells;
+    auto insert = [&](const abs_address_t& pos, const char* exp)
+    {
+        insert_formula(cxt, pos, exp, *resolver);
+        dirty_cells.insert(pos);
+    };
+
+    // A1, B1 and C1 form a cycle, which D1 depends on.  A2 references
+    // itself.
+    insert(abs_address_t(0,0,0), "B1+1");
+    insert(abs_address_t(0,0,1), "C1+1");
+    insert(abs_address_t(0,0,2), "A1+1");
+    insert(abs_address_t(0,0,3), "A1*2");
+    insert(abs_address_t(0,1,0), "A2");
+
+    // Column A from row 10 is a long chain, and each cell in column C from
+    // row 10 sums a large range of values in column D.
+    cxt.set_numeric_cell(abs_address_t(0,9,0), 1.0);
+    for (row_t row = 9; row < row_size; ++row)
+        cxt.set_numeric_cell(abs_address_t(0,row,3), 1.0);
+
+    for (row_t row = 10; row < row_size; ++row)
+    {
+        std::ostringstream os;
+        os << "A" << row << "+1";
+        std::string formula = os.str();
+        insert(abs_address_t(0,row,0), formula.c_str());
+
+        os.str(std::string());
+        os << "SUM($D$10:$D$" << row_size << ")+" << row;
+        formula = os.str();
+        insert(abs_address_t(0,row,2), formula.c_str());
+    }
+
+    calculate_cells(cxt, dirty_cells, 0);
+
+    // Only the cells in the cycles are marked, and the error propagates to
+    // the cells depending on them when they get interpreted.
+    const abs_address_t error_cells[] = {
+        abs_address_t(0,0,0), abs_address_t(0,0,1), abs_address_t(0,0,2),
+        abs_address_t(0,0,3), abs_address_t(0,1,0)
+    };
+    for (const abs_address_t& pos : error_cells)
+    {
+        formula_result res;
+        bool available = cxt.get_formula_cell(pos)->get_result_cache(res);
+        assert(available && res.get_type() == formula_result::rt_error);
+        assert(res.get_error() == fe_ref_result_not_available);
+    }
+
+    for (row_t row = 10; row < row_size; ++row)
+    {
+        assert(cxt.get_numeric_value(abs_address_t(0,row,0)) == row - 8);
+        assert(cxt.get_numeric_value(abs_address_t(0,row,2)) == row_size - 9 + row);
+    }
+
+    // Breaking the cycle clears the errors on the next calculation.
+    unregister_formula_cell(cxt, abs_address_t(0,0,2));
+    cxt.set_numeric_cell(abs_address_t(0,0,2), 5.0);
+    modified_cells_t modified;
+    modified.push_back(abs_address_t(0,0,2));
+    dirty_cells.clear();
+    get_all_dirty_cells(cxt, modified, dirty_cells);
+    calculate_cells(cxt, dirty_cells, 0);
+    assert(cxt.get_numeric_value(abs_address_t(0,0,1)) == 6.0);
+    assert(cxt.get_numeric_value(abs_address_t(0,0,0)) == 7.0);
+    assert(cxt.get_numeric_value(abs_address_t(0,0,3)) == 14.0);
+}
+
+void test_iterative_calc()
+{
+    cout << "test iterative calc" << endl;
+
+    model_context cxt;
+    config cfg = cxt.get_config();
+    cfg.iterative_calc = true;
+    cfg.max_iterations = 10;
+    cxt.set_config(cfg);
+
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    assert(resolver);
+    cxt.append_sheet(IXION_ASCII("test"), 10, 4);
+
+    // B1 is 10% interest on the average of the opening balance in A1 and
+    // the closing balance in C1, which includes the interest.  D1 depends
+    // on the closing balance.
+    cxt.set_numeric_cell(abs_address_t(0,0,0), 1000.0);
+    dirty_formula_cells_t dirty_cells;
+    insert_formula(cxt, abs_address_t(0,0,1), "(A1+C1)*0.05", *resolver);
+    insert_formula(cxt, abs_address_t(0,0,2), "A1+B1", *resolver);
+    insert_formula(cxt, abs_address_t(0,0,3), "C1*2", *resolver);
+
+    // A2 and B2 never converge, and A3 references itself.
+    insert_formula(cxt, abs_address_t(0,1,0), "B2+1", *resolver);
+    insert_formula(cxt, abs_address_t(0,1,1), "A2+1", *resolver);
+    insert_formula(cxt, abs_address_t(0,2,0), "A3+1", *resolver);
+
+    for (col_t col = 1; col <= 3; ++col)
+        dirty_cells.insert(abs_address_t(0,0,col));
+    dirty_cells.insert(abs_address_t(0,1,0));
+    dirty_cells.insert(abs_address_t(0,1,1));
+    dirty_cells.insert(abs_address_t(0,2,0));
+    calculate_cells(cxt, dirty_cells, 0);
+
+    // The closing balance converges to 1000 * 1.05 / 0.95.
+    double closing = 1000.0 * 1.05 / 0.95;
+    assert(std::fabs(cxt.get_numeric_value(abs_address_t(0,0,2)) - closing) < 0.01);
+    assert(std::fabs(cxt.get_numeric_value(abs_address_t(0,0,1)) - (closing - 1000.0)) < 0.01);
+    assert(std::fabs(cxt.get_numeric_value(abs_address_t(0,0,3)) - closing * 2.0) < 0.02);
+
+    // Each of the 10 iterations adds 2 to the larger value.
+    double v1 = cxt.get_numeric_value(abs_address_t(0,1,0));
+    double v2 = cxt.get_numeric_value(abs_address_t(0,1,1));
+    assert(std::max(v1, v2) == 20.0);
+    assert(std::fabs(v1 - v2) == 1.0);
+
+    formula_result res;
+    bool available = cxt.get_formula_cell(abs_address_t(0,2,0))->get_result_cache(res);
+    assert(available && res.get_type() == formula_result::rt_error);
+
+    // Changing the opening balance recalculates the cycle.
+    cxt.set_numeric_cell(abs_address_t(0,0,0), 2000.0);
+    modified_cells_t modified;
+    modified.push_back(abs_address_t(0,0,0));
+    dirty_cells.clear();
+    get_all_dirty_cells(cxt, modified, dirty_cells);
+    calculate_cells(cxt, dirty_cells, 0);
+    assert(std::fabs(cxt.get_numeric_value(abs_address_t(0,0,2)) - closing * 2.0) < 0.01);
+}
+
+void test_early_cutoff()
+{
+    cout << "test early cutoff" << endl;
+
+    const calc_mode_t modes[] = {
+        calc_mode_t::dependency_queue, calc_mode_t::wavefront, calc_mode_t::deterministic
+    };
+
+    for (calc_mode_t mode : modes)
+    {
+        for (size_t thread_count : { 0, 2 })
+        {
+            model_context cxt;
+            config cfg = cxt.get_config();
+            cfg.calc_mode = mode;
+            cxt.set_config(cfg);
+            if (thread_count)
+                cxt.set_thread_pool_size(thread_count);
+
+            auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+            assert(resolver);
+
+            const row_t chain_size = 100;
+            cxt.append_sheet(IXION_ASCII("test"), chain_size, 4);
+            cxt.set_numeric_cell(abs_address_t(0,0,0), 5.0);
+            cxt.set_numeric_cell(abs_address_t(0,1,0), 3.0);
+
+            // B1 picks the larger of A1 and A2, column C is a chain starting
+            // from B1, and D1 references A2 directly.
+            dirty_formula_cells_t dirty_cells;
+            insert_formula(cxt, abs_address_t(0,0,1), "MAX(A1,A2)", *resolver);
+            insert_formula(cxt, abs_address_t(0,0,2), "B1*2", *resolver);
+            insert_formula(cxt, abs_address_t(0,0,3), "A2*10", *resolver);
+            dirty_cells.insert(abs_address_t(0,0,1));
+            dirty_cells.insert(abs_address_t(0,0,2));
+            dirty_cells.insert(abs_address_t(0,0,3));
+            for (row_t row = 1; row < chain_size; ++row)
+            {
+                std::ostringstream os;
+                os << "C" << row << "+1";
+                std::string formula = os.str();
+                insert_formula(cxt, abs_address_t(0,row,2), formula.c_str(), *resolver);
+                dirty_cells.insert(abs_address_t(0,row,2));
+            }
+
+            // Cells without previous results are always interpreted.
+            modified_cells_t modified;
+            assert(calculate_cells(cxt, modified, dirty_cells, thread_count) == 0);
+            assert(cxt.get_numeric_value(abs_address_t(0,chain_size-1,2)) == 10.0 + chain_size - 1);
+
+            // A2 still doesn't change the maximum, so the chain keeps its
+            // results, but D1 references A2 directly.
+            cxt.set_numeric_cell(abs_address_t(0,1,0), 4.0);
+            modified.assign(1, abs_address_t(0,1,0));
+            dirty_cells.clear();
+            get_all_dirty_cells(cxt, modified, dirty_cells);
+            assert(dirty_cells.size() == size_t(chain_size + 2));
+            assert(calculate_cells(cxt, modified, dirty_cells, thread_count) == size_t(chain_size));
+            assert(cxt.get_numeric_value(abs_address_t(0,0,1)) == 5.0);
+            assert(cxt.get_numeric_value(abs_address_t(0,chain_size-1,2)) == 10.0 + chain_size - 1);
+            assert(cxt.get_numeric_value(abs_address_t(0,0,3)) == 40.0);
+
+            // A2 now changes the maximum, which goes down the chain.
+            cxt.set_numeric_cell(abs_address_t(0,1,0), 6.0);
+            dirty_cells.clear();
+            get_all_dirty_cells(cxt, modified, dirty_cells);
+            assert(calculate_cells(cxt, modified, dirty_cells, thread_count) == 0);
+            assert(cxt.get_numeric_value(abs_address_t(0,0,1)) == 6.0);
+            assert(cxt.get_numeric_value(abs_address_t(0,chain_size-1,2)) == 12.0 + chain_size - 1);
+            assert(cxt.get_numeric_value(abs_address_t(0,0,3)) == 60.0);
+
+            // Release the worker threads before the model goes away.
+            cxt.shutdown_thread_pool();
+        }
+    }
+}
+
+void test_lazy_calc()
+{
+    cout << "test lazy calculation" << endl;
+
+    model_context cxt;
+    config cfg = cxt.get_config();
+    cfg.lazy_calc = true;
+    cxt.set_config(cfg);
+
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    assert(resolver);
+
+    const row_t row_size = 50;
+    cxt.append_sheet(IXION_ASCII("test"), row_size, 4);
+    cxt.set_numeric_cell(abs_address_t(0,0,0), 2.0);
+    cxt.set_numeric_cell(abs_address_t(0,1,0), 3.0);
+
+    // Column B multiplies A1, C1 sums column B, and column D is a chain
+    // starting from A2.
+    dirty_formula_cells_t dirty_cells;
+    for (row_t row = 0; row < row_size; ++row)
+    {
+        std::ostringstream os;
+        os << "A1*" << (row + 1);
+        std::string formula = os.str();
+        insert_formula(cxt, abs_address_t(0,row,1), formula.c_str(), *resolver);
+        dirty_cells.insert(abs_address_t(0,row,1));
+
+        os.str(std::string());
+        if (row)
+            os << "D" << row << "+1";
+        else
+            os << "A2+1";
+        formula = os.str();
+        insert_formula(cxt, abs_address_t(0,row,3), formula.c_str(), *resolver);
+        dirty_cells.insert(abs_address_t(0,row,3));
+    }
+
+    std::ostringstream os;
+    os << "SUM(B1:B" << row_size << ")";
+    std::string formula = os.str();
+    insert_formula(cxt, abs_address_t(0,0,2), formula.c_str(), *resolver);
+    dirty_cells.insert(abs_address_t(0,0,2));
+
+    mark_cells_dirty(cxt, dirty_cells);
+    assert(cxt.get_pending_cells()->size() == dirty_cells.size());
+
+    // Reading C1 only calculates C1 and column B.
+    const double sum = 2.0 * row_size * (row_size + 1) / 2;
+    assert(cxt.get_numeric_value(abs_address_t(0,0,2)) == sum);
+    for (row_t row = 0; row < row_size; ++row)
+    {
+        assert(cxt.get_formula_cell(abs_address_t(0,row,1))->has_result());
+        assert(!cxt.get_formula_cell(abs_address_t(0,row,3))->has_result());
+    }
+    assert(cxt.get_pending_cells()->size() == size_t(row_size));
+
+    // Reading the middle of column D only calculates the chain up to it.
+    const formula_cell* p = cxt.get_formula_cell(abs_address_t(0,row_size/2,3));
+    assert(p->get_value(cxt, abs_address_t(0,row_size/2,3)) == 4.0 + row_size / 2);
+    assert(cxt.get_formula_cell(abs_address_t(0,0,3))->has_result());
+    assert(!cxt.get_formula_cell(abs_address_t(0,row_size/2+1,3))->has_result());
+    assert(cxt.get_pending_cells()->size() == size_t(row_size - row_size / 2 - 1));
+
+    // Reading an already calculated cell doesn't calculate anything.
+    assert(calculate_cell(cxt, abs_address_t(0,0,2)) == 0);
+
+    // Modify A1, which marks column B and C1 dirty again.
+    cxt.set_numeric_cell(abs_address_t(0,0,0), 3.0);
+    modified_cells_t modified(1, abs_address_t(0,0,0));
+    dirty_cells.clear();
+    get_all_dirty_cells(cxt, modified, dirty_cells);
+    assert(dirty_cells.size() == size_t(row_size + 1));
+    mark_cells_dirty(cxt, dirty_cells);
+    assert(!cxt.get_formula_cell(abs_address_t(0,0,2))->has_result());
+
+    assert(cxt.get_numeric_value(abs_address_t(0,row_size-1,1)) == 3.0 * row_size);
+    assert(!cxt.get_formula_cell(abs_address_t(0,0,2))->has_result());
+    assert(cxt.get_numeric_value(abs_address_t(0,0,2)) == sum * 1.5);
+    assert(cxt.get_numeric_value(abs_address_t(0,row_size-1,3)) == 3.0 + row_size);
+    assert(cxt.get_pending_cells()->empty());
+
+    // A pending cell doesn't block when read without the model, and gets
+    // dropped from the pending cells once calculated eagerly.
+    mark_cells_dirty(cxt, dirty_cells);
+    try
+    {
+        cxt.get_formula_cell(abs_address_t(0,0,2))->get_value();
+        assert(!"formula_error was not thrown");
+    }
+    catch (const formula_error& e)
+    {
+        assert(e.get_error() == fe_ref_result_not_available);
+    }
+
+    calculate_cells(cxt, dirty_cells, 0);
+    assert(cxt.get_pending_cells()->empty());
+    assert(cxt.get_formula_cell(abs_address_t(0,0,2))->get_value() == sum * 1.5);
+
+    // Each model serializes its own lazy calculations only.  Another model
+    // calculates its cells while the lazy calculation mutex of this model
+    // is held.
+    model_context cxt2;
+    cxt2.set_config(cfg);
+    cxt2.append_sheet(IXION_ASCII("test"), row_size, 4);
+    cxt2.set_numeric_cell(abs_address_t(0,0,0), 5.0);
+    auto resolver2 = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt2);
+    assert(resolver2);
+    insert_formula(cxt2, abs_address_t(0,0,1), "A1*2", *resolver2);
+    dirty_cells.clear();
+    dirty_cells.insert(abs_address_t(0,0,1));
+    mark_cells_dirty(cxt2, dirty_cells);
+
+    assert(cxt.get_lazy_calc_mutex() != cxt2.get_lazy_calc_mutex());
+    boost::recursive_mutex::scoped_lock lock(*cxt.get_lazy_calc_mutex());
+    double value = 0.0;
+    boost::thread t([&]() { value = cxt2.get_numeric_value(abs_address_t(0,0,1)); });
+    t.join();
+    assert(value == 10.0);
+}
+
+void test_lazy_calc_cancel()
+{
+    cout << "test lazy calculation after cancellation" << endl;
+
+    model_context cxt;
+    config cfg = cxt.get_config();
+    cfg.lazy_calc = true;
+    cxt.set_config(cfg);
+
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    assert(resolver);
+
+    // A1 takes a second to calculate, and A2:A10 each reference the cell
+    // above it.
+    const row_t row_size = 10;
+    cxt.append_sheet(IXION_ASCII("test"), row_size, 1);
+    dirty_formula_cells_t dirty_cells;
+    insert_formula(cxt, abs_address_t(0,0,0), "WAIT()", *resolver);
+    dirty_cells.insert(abs_address_t(0,0,0));
+    for (row_t row = 1; row < row_size; ++row)
+    {
+        std::ostringstream os;
+        os << "A" << row << "+1";
+        std::string formula = os.str();
+        insert_formula(cxt, abs_address_t(0,row,0), formula.c_str(), *resolver);
+        dirty_cells.insert(abs_address_t(0,row,0));
+    }
+
+    mark_cells_dirty(cxt, dirty_cells);
+
+    // Cancel the calculation while A1 is still being calculated.
+    std::unique_ptr<calc_handle> handle = calculate_cells_async(cxt, dirty_cells, 2);
+    handle->cancel();
+    handle->wait();
+
+    dirty_formula_cells_t pending_cells;
+    handle->get_pending_cells(pending_cells);
+    assert(pending_cells.count(abs_address_t(0,row_size-1,0)));
+
+    // The cells not reached stay pending, and get calculated when read.
+    assert(cxt.get_pending_cells()->count(abs_address_t(0,row_size-1,0)));
+    assert(cxt.get_numeric_value(abs_address_t(0,row_size-1,0)) == double(row_size));
+    assert(cxt.get_pending_cells()->empty());
+}
+
+void test_calc_epoch()
+{
+    cout << "test calc epoch" << endl;
+
+    model_context cxt;
+    auto resolver = formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt);
+    assert(resolver);
+
+    const row_t row_size = 20;
+    cxt.append_sheet(IXION_ASCII("test"), row_size, 4);
+    cxt.set_numeric_cell(abs_address_t(0,0,0), 1.0);
+
+    // B1 and B2 are volatile, column C depends on B1, and D1 on A1 only.
+    dirty_formula_cells_t dirty_cells;
+    insert_formula(cxt, abs_address_t(0,0,1), "NOW()", *resolver);
+    insert_formula(cxt, abs_address_t(0,1,1), "NOW()", *resolver);
+    insert_formula(cxt, abs_address_t(0,0,3), "A1*2", *resolver);
+    dirty_cells.insert(abs_address_t(0,0,1));
+    dirty_cells.insert(abs_address_t(0,1,1));
+    dirty_cells.insert(abs_address_t(0,0,3));
+    for (row_t row = 0; row < row_size; ++row)
+    {
+        std::ostringstream os;
+        os << "B1+" << row;
+        std::string formula = os.str();
+        insert_formula(cxt, abs_address_t(0,row,2), formula.c_str(), *resolver);
+        dirty_cells.insert(abs_address_t(0,row,2));
+    }
+
+    // The initial calculation starts the first epoch, and all volatile
+    // cells see its time.
+    calculate_cells(cxt, dirty_cells, 0);
+    const calc_epoch* epoch = cxt.get_calc_epoch();
+    assert(epoch->id == 1);
+    double t1 = cxt.get_numeric_value(abs_address_t(0,0,1));
+    assert(t1 == epoch->timestamp / 86400.0);
+    assert(cxt.get_numeric_value(abs_address_t(0,1,1)) == t1);
+
+    // The volatile cells haven't been dirty in this epoch yet.
+    cxt.set_numeric_cell(abs_address_t(0,0,0), 2.0);
+    modified_cells_t modified(1, abs_address_t(0,0,0));
+    dirty_cells.clear();
+    get_all_dirty_cells(cxt, modified, dirty_cells, 0, true);
+    assert(epoch->id == 1);
+    assert(dirty_cells.size() == size_t(row_size + 3));
+    calculate_cells(cxt, dirty_cells, 0);
+    assert(cxt.get_numeric_value(abs_address_t(0,0,1)) == t1);
+
+    // Now they are skipped, along with the cells depending on them.
+    cxt.set_numeric_cell(abs_address_t(0,0,0), 3.0);
+    modified.assign(1, abs_address_t(0,0,0));
+    dirty_cells.clear();
+    get_all_dirty_cells(cxt, modified, dirty_cells, 0, true);
+    assert(dirty_cells.size() == 1);
+    assert(dirty_cells.count(abs_address_t(0,0,3)));
+    calculate_cells(cxt, dirty_cells, 0);
+    assert(cxt.get_numeric_value(abs_address_t(0,0,3)) == 6.0);
+    assert(cxt.get_numeric_value(abs_address_t(0,row_size-1,2)) == t1 + row_size - 1);
+
+    // A full recalculation starts a new epoch.
+    global::sleep(10);
+    modified.clear();
+    dirty_cells.clear();
+    get_all_dirty_cells(cxt, modified, dirty_cells);
+    assert(epoch->id == 2);
+    assert(dirty_cells.size() == size_t(row_size + 2));
+    calculate_cells(cxt, dirty_cells, 0);
+    double t2 = cxt.get_numeric_value(abs_address_t(0,0,1));
+    assert(t2 > t1);
+    assert(cxt.get_numeric_value(abs_address_t(0,1,1)) == t2);
+    assert(cxt.get_numeric_value(abs_address_t(0,row_size-1,2)) == t2 + row_size - 1);
+
+    // So does an explicit start of an epoch.
+    start_calc_epoch(cxt);
+    assert(epoch->id == 3);
+    dirty_cells.clear();
+    get_all_dirty_cells(cxt, modified, dirty_cells, 0, true);
+    assert(dirty_cells.size() == size_t(row_size + 2));
+    modified.clear();
+    dirty_cells.clear();
+    get_all_dirty_cells(cxt, modified, dirty_cells, 0, true);
+    assert(dirty_cells.empty());
+
+    // The calculation following the lookup stays in its epoch, but each
+    // calculation without a lookup of dirty cells starts a new one, and the
+    // volatile cells see a new time every time.
+    dirty_cells.clear();
+    dirty_cells.insert(abs_address_t(0,0,1));
+    dirty_cells.insert(abs_address_t(0,1,1));
+    calculate_cells(cxt, dirty_cells, 0);
+    assert(epoch->id == 3);
+    double t3 = cxt.get_numeric_value(abs_address_t(0,0,1));
+    assert(t3 == epoch->timestamp / 86400.0);
+
+    global::sleep(10);
+    calculate_cells(cxt, dirty_cells, 0);
+    assert(epoch->id == 4);
+    double t4 = cxt.get_numeric_value(abs_address_t(0,0,1));
+    assert(t4 > t3);
+    assert(cxt.get_numeric_value(abs_address_t(0,1,1)) == t4);
+
+    global::sleep(10);
+    calculate_cells(cxt, dirty_cells, 0);
+    assert(epoch->id == 5);
+    assert(cxt.get_numeric_value(abs_address_t(0,0,1)) > t4);
+}
+
 int main()
 {
     test_size();
@@ -859,10 +2907,32 @@ int main()
     test_name_resolver_excel_r1c1();
     test_name_resolver_odff();
     test_address();
+    test_address_set();
     test_parse_and_print_expressions();
     test_function_name_resolution();
     test_model_context_storage();
     test_volatile_function();
+    test_thread_pool_reuse();
+    test_concurrent_models();
+    test_shared_formula_tasks();
+    test_task_homes();
+    test_task_priorities();
+    test_async_calculation();
+    test_deterministic_calculation();
+    test_long_dependency_chain();
+    test_persistent_dependency_graph();
+    test_range_listeners_per_sheet();
+    test_bulk_registration();
+    test_listener_storage();
+    test_shared_formula_listeners();
+    test_dirty_cell_cache();
+    test_parallel_dirty_cells();
+    test_circular_detection();
+    test_iterative_calc();
+    test_early_cutoff();
+    test_lazy_calc();
+    test_lazy_calc_cancel();
+    test_calc_epoch();
     return EXIT_SUCCESS;
 }
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
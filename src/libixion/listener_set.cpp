@@ -0,0 +1,154 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "listener_set.hpp"
+
+#include <algorithm>
+#include <new>
+
+namespace ixion {
+
+listener_set::listener_set() : m_size(0), m_capacity(0)
+{
+    for (size_t i = 0; i < inline_capacity; ++i)
+        new (&m_inline[i]) abs_address_t;
+}
+
+listener_set::listener_set(const listener_set& r) : m_size(0), m_capacity(0)
+{
+    for (size_t i = 0; i < inline_capacity; ++i)
+        new (&m_inline[i]) abs_address_t;
+
+    *this = r;
+}
+
+listener_set::~listener_set()
+{
+    if (m_capacity)
+        delete[] mp_array;
+}
+
+listener_set& listener_set::operator= (const listener_set& r)
+{
+    if (this == &r)
+        return *this;
+
+    m_size = 0;
+    reallocate(r.m_size);
+    std::copy(r.begin(), r.end(), data());
+    m_size = r.m_size;
+    return *this;
+}
+
+bool listener_set::insert(const abs_address_t& addr)
+{
+    abs_address_t* p = data();
+    abs_address_t* pos = std::lower_bound(p, p + m_size, addr);
+    if (pos != p + m_size && *pos == addr)
+        // Already exists.
+        return false;
+
+    size_t index = pos - p;
+    size_t capacity = m_capacity ? m_capacity : inline_capacity;
+    if (m_size == capacity)
+    {
+        reallocate(capacity * 2);
+        p = data();
+    }
+
+    std::copy_backward(p + index, p + m_size, p + m_size + 1);
+    p[index] = addr;
+    ++m_size;
+    return true;
+}
+
+bool listener_set::erase(const abs_address_t& addr)
+{
+    abs_address_t* p = data();
+    abs_address_t* pos = std::lower_bound(p, p + m_size, addr);
+    if (pos == p + m_size || *pos != addr)
+        // Doesn't exist.
+        return false;
+
+    std::copy(pos + 1, p + m_size, pos);
+    --m_size;
+
+    // Give back the heap array once it becomes mostly empty.
+    if (m_capacity && m_size <= m_capacity / 4)
+        reallocate(m_size);
+
+    return true;
+}
+
+listener_set::const_iterator listener_set::begin() const
+{
+    return data();
+}
+
+listener_set::const_iterator listener_set::end() const
+{
+    return data() + m_size;
+}
+
+size_t listener_set::size() const
+{
+    return m_size;
+}
+
+bool listener_set::empty() const
+{
+    return m_size == 0;
+}
+
+size_t listener_set::get_heap_size() const
+{
+    return m_capacity * sizeof(abs_address_t);
+}
+
+abs_address_t* listener_set::data()
+{
+    return m_capacity ? mp_array : m_inline;
+}
+
+const abs_address_t* listener_set::data() const
+{
+    return m_capacity ? mp_array : m_inline;
+}
+
+void listener_set::reallocate(size_t capacity)
+{
+    if (capacity <= inline_capacity)
+    {
+        if (!m_capacity)
+            // Already stored inline.
+            return;
+
+        // The inline storage shares its memory with the array pointer.
+        abs_address_t* array = mp_array;
+        for (size_t i = 0; i < inline_capacity; ++i)
+            new (&m_inline[i]) abs_address_t(i < m_size ? array[i] : abs_address_t());
+
+        delete[] array;
+        m_capacity = 0;
+        return;
+    }
+
+    if (capacity == m_capacity)
+        return;
+
+    abs_address_t* array = new abs_address_t[capacity];
+    std::copy(begin(), end(), array);
+    if (m_capacity)
+        delete[] mp_array;
+
+    mp_array = array;
+    m_capacity = capacity;
+}
+
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
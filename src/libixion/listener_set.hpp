@@ -0,0 +1,92 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef __IXION_LISTENER_SET_HPP__
+#define __IXION_LISTENER_SET_HPP__
+
+#include "ixion/address.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+
+namespace ixion {
+
+/**
+ * Sorted set of cell addresses, which stores the cells listening to a cell
+ * or a range.  Most cells and ranges are listened to by only one or two
+ * cells, which are stored inline without any heap allocation.  Any more
+ * cells spill over to a sorted array on the heap.
+ */
+class listener_set
+{
+public:
+    typedef const abs_address_t* const_iterator;
+
+    listener_set();
+    listener_set(const listener_set& r);
+    ~listener_set();
+
+    listener_set& operator= (const listener_set& r);
+
+    /**
+     * Insert a cell address.
+     *
+     * @param addr cell address to insert.
+     *
+     * @return true if the address has been inserted, or false if it already
+     *         exists.
+     */
+    bool insert(const abs_address_t& addr);
+
+    /**
+     * Erase a cell address.
+     *
+     * @param addr cell address to erase.
+     *
+     * @return true if the address has been erased, or false if it didn't
+     *         exist.
+     */
+    bool erase(const abs_address_t& addr);
+
+    const_iterator begin() const;
+    const_iterator end() const;
+
+    size_t size() const;
+    bool empty() const;
+
+    /**
+     * @return number of bytes allocated on the heap to store the addresses,
+     *         not including the instance itself.
+     */
+    size_t get_heap_size() const;
+
+private:
+    abs_address_t* data();
+    const abs_address_t* data() const;
+
+    /**
+     * Move all addresses into a heap array of the specified capacity, or
+     * back into the inline storage when the capacity is small enough.
+     */
+    void reallocate(size_t capacity);
+
+    static const size_t inline_capacity = 2;
+
+    uint32_t m_size;
+    uint32_t m_capacity; ///< capacity of the heap array, or 0 when stored inline.
+
+    union
+    {
+        abs_address_t m_inline[inline_capacity];
+        abs_address_t* mp_array;
+    };
+};
+
+}
+
+#endif
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -12,11 +12,18 @@
 #include "ixion/interface/session_handler.hpp"
 #include "ixion/interface/table_handler.hpp"
 #include "ixion/cell_listener_tracker.hpp"
+#include "ixion/cell_queue_manager.hpp"
 #include "ixion/formula_result.hpp"
 #include "ixion/formula.hpp"
 
+#include "dependency_graph.hpp"
 #include "workbook.hpp"
 
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+
+#include <algorithm>
+#include <cassert>
 #include <memory>
 #include <sstream>
 #include <unordered_map>
@@ -158,6 +165,9 @@ public:
 
     ~model_context_impl()
     {
+        // Terminate the worker threads before anything else gets destroyed.
+        mp_cell_queue_manager.reset();
+
         delete mp_config;
         delete mp_cell_listener_tracker;
 
@@ -170,6 +180,11 @@ public:
         return *mp_config;
     }
 
+    void set_config(const config& cfg)
+    {
+        *mp_config = cfg;
+    }
+
     cell_listener_tracker& get_cell_listener_tracker()
     {
         return *mp_cell_listener_tracker;
@@ -200,6 +215,51 @@ public:
         mp_table_handler = handler;
     }
 
+    std::shared_ptr<cell_queue_manager> get_cell_queue_manager(size_t thread_count) const
+    {
+        boost::mutex::scoped_lock lock(m_mtx_cell_queue_manager);
+        if (!mp_cell_queue_manager || mp_cell_queue_manager->get_thread_count() != thread_count ||
+            mp_cell_queue_manager->is_pinned() != mp_config->pin_threads)
+            return std::shared_ptr<cell_queue_manager>();
+
+        return mp_cell_queue_manager;
+    }
+
+    void set_thread_pool_size(size_t thread_count)
+    {
+        boost::mutex::scoped_lock lock(m_mtx_cell_queue_manager);
+        bool pin_threads = mp_config->pin_threads;
+        if (mp_cell_queue_manager && mp_cell_queue_manager->get_thread_count() == thread_count &&
+            mp_cell_queue_manager->is_pinned() == pin_threads)
+            return;
+
+        // Shut down the existing worker threads first, unless a calculation
+        // is still running on them.
+        mp_cell_queue_manager.reset();
+        if (thread_count)
+            mp_cell_queue_manager = std::make_shared<cell_queue_manager>(thread_count, pin_threads);
+    }
+
+    abs_address_set* get_pending_cells()
+    {
+        return &m_pending_cells;
+    }
+
+    boost::recursive_mutex* get_lazy_calc_mutex()
+    {
+        return &m_lazy_calc_mtx;
+    }
+
+    calc_epoch* get_calc_epoch()
+    {
+        return &m_calc_epoch;
+    }
+
+    dependency_graph* get_dependency_graph()
+    {
+        return &m_dep_graph;
+    }
+
     void erase_cell(const abs_address_t& addr);
     void set_numeric_cell(const abs_address_t& addr, double val);
     void set_boolean_cell(const abs_address_t& addr, bool val);
@@ -276,6 +336,12 @@ private:
     cell_listener_tracker* mp_cell_listener_tracker;
     iface::session_handler* mp_session_handler;
     iface::table_handler* mp_table_handler;
+    std::shared_ptr<cell_queue_manager> mp_cell_queue_manager;
+    mutable boost::mutex m_mtx_cell_queue_manager;
+    dirty_formula_cells_t m_pending_cells;
+    boost::recursive_mutex m_lazy_calc_mtx;
+    calc_epoch m_calc_epoch;
+    dependency_graph m_dep_graph;
     named_expressions_type m_named_expressions;
 
     formula_tokens_store_type m_tokens;
@@ -284,6 +350,14 @@ private:
     string_pool_type m_strings;
     string_map_type m_string_map;
     string m_empty_string;
+
+    /**
+     * Formula cells may add strings while being interpreted, possibly on
+     * multiple threads at once.
+     */
+    mutable boost::mutex m_mtx_strings;
+
+    string_id_t append_string_nolock(const char* p, size_t n);
 };
 
 void model_context_impl::set_named_expression(const char* p, size_t n, formula_cell* cell)
@@ -365,6 +439,12 @@ sheet_t model_context_impl::append_sheet(
 }
 
 string_id_t model_context_impl::append_string(const char* p, size_t n)
+{
+    boost::mutex::scoped_lock lock(m_mtx_strings);
+    return append_string_nolock(p, n);
+}
+
+string_id_t model_context_impl::append_string_nolock(const char* p, size_t n)
 {
     if (!p || !n)
         // Never add an empty or invalid string.
@@ -380,11 +460,12 @@ string_id_t model_context_impl::append_string(const char* p, size_t n)
 
 string_id_t model_context_impl::add_string(const char* p, size_t n)
 {
+    boost::mutex::scoped_lock lock(m_mtx_strings);
     string_map_type::iterator itr = m_string_map.find(mem_str_buf(p, n));
     if (itr != m_string_map.end())
         return itr->second;
 
-    return append_string(p, n);
+    return append_string_nolock(p, n);
 }
 
 const std::string* model_context_impl::get_string(string_id_t identifier) const
@@ -392,6 +473,7 @@ const std::string* model_context_impl::get_string(string_id_t identifier) const
     if (identifier == empty_string_id)
         return &m_empty_string;
 
+    boost::mutex::scoped_lock lock(m_mtx_strings);
     if (identifier >= m_strings.size())
         return nullptr;
 
@@ -400,6 +482,7 @@ const std::string* model_context_impl::get_string(string_id_t identifier) const
 
 size_t model_context_impl::get_string_count() const
 {
+    boost::mutex::scoped_lock lock(m_mtx_strings);
     return m_strings.size();
 }
 
@@ -608,11 +691,11 @@ double count_formula_block(
     for (; pp != pp_end; ++pp)
     {
         const formula_cell& fc = **pp;
-        const formula_result* res = fc.get_result_cache();
-        if (!res)
+        formula_result res;
+        if (!fc.get_result_cache(res))
             continue;
 
-        switch (res->get_type())
+        switch (res.get_type())
         {
             case formula_result::rt_value:
                 if (vt.is_numeric())
@@ -944,6 +1027,11 @@ double model_context_impl::get_numeric_value(const abs_address_t& addr) const
         case element_type_formula:
         {
             const formula_cell* p = col_store.get<formula_cell*>(addr.row);
+            if (mp_config->lazy_calc && !p->has_result())
+                // Calculate the cell now if it's been marked dirty.  It
+                // only updates the cached results of the formula cells.
+                calculate_cell(m_parent, addr);
+
             return p->get_value();
         }
         break;
@@ -995,11 +1083,14 @@ string_id_t model_context_impl::get_string_identifier_nowait(const abs_address_t
         case ixion::element_type_formula:
         {
             const formula_cell* p = col_store.get<formula_cell*>(addr.row);
-            const formula_result* res_cache = p->get_result_cache();
-            switch (res_cache->get_type())
+            formula_result res_cache;
+            if (!p->get_result_cache(res_cache))
+                break;
+
+            switch (res_cache.get_type())
             {
                 case formula_result::rt_string:
-                    return res_cache->get_string();
+                    return res_cache.get_string();
                 case formula_result::rt_error:
                     // TODO : perhaps we should return the error string here.
                 default:
@@ -1014,6 +1105,7 @@ string_id_t model_context_impl::get_string_identifier_nowait(const abs_address_t
 
 string_id_t model_context_impl::get_string_identifier(const char* p, size_t n) const
 {
+    boost::mutex::scoped_lock lock(m_mtx_strings);
     string_map_type::const_iterator it = m_string_map.find(mem_str_buf(p, n));
     return it == m_string_map.end() ? empty_string_id : it->second;
 }
@@ -1058,6 +1150,11 @@ const config& model_context::get_config() const
     return mp_impl->get_config();
 }
 
+void model_context::set_config(const config& cfg)
+{
+    mp_impl->set_config(cfg);
+}
+
 cell_listener_tracker& model_context::get_cell_listener_tracker()
 {
     return mp_impl->get_cell_listener_tracker();
@@ -1194,6 +1291,41 @@ const iface::table_handler* model_context::get_table_handler() const
     return mp_impl->get_table_handler();
 }
 
+std::shared_ptr<cell_queue_manager> model_context::get_cell_queue_manager(size_t thread_count)
+{
+    return mp_impl->get_cell_queue_manager(thread_count);
+}
+
+void model_context::set_thread_pool_size(size_t thread_count)
+{
+    mp_impl->set_thread_pool_size(thread_count);
+}
+
+void model_context::shutdown_thread_pool()
+{
+    mp_impl->set_thread_pool_size(0);
+}
+
+abs_address_set* model_context::get_pending_cells()
+{
+    return mp_impl->get_pending_cells();
+}
+
+boost::recursive_mutex* model_context::get_lazy_calc_mutex()
+{
+    return mp_impl->get_lazy_calc_mutex();
+}
+
+calc_epoch* model_context::get_calc_epoch()
+{
+    return mp_impl->get_calc_epoch();
+}
+
+dependency_graph* model_context::get_dependency_graph()
+{
+    return mp_impl->get_dependency_graph();
+}
+
 const formula_tokens_t* model_context::get_formula_tokens(sheet_t sheet, size_t identifier) const
 {
     return mp_impl->get_formula_tokens(sheet, identifier);
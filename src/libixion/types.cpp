@@ -16,5 +16,7 @@ const sheet_t invalid_sheet = -2;
 
 const string_id_t empty_string_id = std::numeric_limits<string_id_t>::max();
 
+calc_epoch::calc_epoch() : id(0), timestamp(0.0), volatile_id(0), keep(false) {}
+
 }
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -9,6 +9,8 @@
 
 #include "workbook.hpp"
 
+#include <algorithm>
+
 namespace ixion {
 
 worksheet::worksheet() {}
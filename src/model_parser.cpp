@@ -100,7 +100,7 @@ model_parser::check_error::check_error(const string& msg) :
 
 // ============================================================================
 
-model_parser::model_parser(const string& filepath, size_t thread_count) :
+model_parser::model_parser(const string& filepath, const config& cfg, size_t thread_count) :
     m_context(),
     m_session_handler(m_context),
     m_table_handler(),
@@ -110,9 +110,11 @@ model_parser::model_parser(const string& filepath, size_t thread_count) :
     m_thread_count(thread_count),
     m_print_separator(true)
 {
+    m_context.set_config(cfg);
     m_context.set_session_handler(&m_session_handler);
     m_context.set_table_handler(&m_table_handler);
     m_context.append_sheet(IXION_ASCII("sheet"), 1048576, 1024);
+    m_context.set_thread_pool_size(thread_count);
 }
 
 model_parser::~model_parser() {}
@@ -149,7 +151,8 @@ void model_parser::parse()
                     << "recalculating" << endl;
 
                 get_all_dirty_cells(m_context, m_dirty_cell_addrs, m_dirty_cells);
-                calculate_cells(m_context, m_dirty_cells, m_thread_count);
+                size_t skipped = calculate_cells(m_context, m_dirty_cell_addrs, m_dirty_cells, m_thread_count);
+                cout << "cells with unchanged precedents: " << skipped << endl;
             }
             else if (buf_com.equals("check"))
             {
@@ -548,14 +551,14 @@ void model_parser::check()
                     case celltype_t::formula:
                     {
                         const formula_cell* fcell = m_context.get_formula_cell(addr);
-                        const formula_result* res_cell = fcell->get_result_cache();
-                        if (!res_cell)
+                        formula_result res_cell;
+                        if (!fcell->get_result_cache(res_cell))
                             throw check_error("result is not cached");
 
-                        if (*res_cell != res)
+                        if (res_cell != res)
                         {
                             ostringstream os;
-                            os << "unexpected result: (expected: " << res.str(m_context) << "; actual: " << res_cell->str(m_context) << ")";
+                            os << "unexpected result: (expected: " << res.str(m_context) << "; actual: " << res_cell.str(m_context) << ")";
                             throw check_error(os.str());
                         }
                     }
@@ -595,14 +598,14 @@ void model_parser::check()
             case formula_name_type::named_expression:
             {
                 const formula_cell* fcell = m_context.get_named_expression(name);
-                const formula_result* res_cell = fcell->get_result_cache();
-                if (!res_cell)
+                formula_result res_cell;
+                if (!fcell->get_result_cache(res_cell))
                     throw check_error("result is not cached");
 
-                if (*res_cell != res)
+                if (res_cell != res)
                 {
                     ostringstream os;
-                    os << "unexpected result: (expected: " << res.str(m_context) << "; actual: " << res_cell->str(m_context) << ")";
+                    os << "unexpected result: (expected: " << res.str(m_context) << "; actual: " << res_cell.str(m_context) << ")";
                     throw check_error(os.str());
                 }
             }
@@ -52,7 +52,7 @@ public:
         ct_string
     };
 
-    model_parser(const ::std::string& filepath, size_t thread_count);
+    model_parser(const ::std::string& filepath, const config& cfg, size_t thread_count);
     ~model_parser();
 
     void parse();
@@ -13,6 +13,7 @@
 #include "ixion/model_context.hpp"
 #include "ixion/formula_name_resolver.hpp"
 #include "ixion/address.hpp"
+#include "ixion/address_set.hpp"
 
 namespace ixion { namespace python {
 
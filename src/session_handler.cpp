@@ -21,73 +21,111 @@ session_handler::session_handler(const model_context& cxt) :
     m_context(cxt),
     mp_resolver(formula_name_resolver::get(formula_name_resolver_t::excel_a1, &cxt)) {}
 
-session_handler::~session_handler() {}
+session_handler::~session_handler()
+{
+    // Output of a cell whose result never got set, on the destroying thread.
+    cell_output* p = mp_cell_output.get();
+    if (p)
+        flush_cell_output(*p);
+}
+
+session_handler::cell_output& session_handler::get_cell_output()
+{
+    cell_output* p = mp_cell_output.get();
+    if (!p)
+    {
+        p = new cell_output;
+        mp_cell_output.reset(p);
+    }
+    return *p;
+}
+
+void session_handler::flush_cell_output(cell_output& out)
+{
+    string s = out.buf.str();
+    out.buf.str(string());
+    if (s.empty())
+        return;
+
+    boost::mutex::scoped_lock lock(m_output_mtx);
+    cout << s << flush;
+}
 
 void session_handler::begin_cell_interpret(const abs_address_t& pos)
 {
+    cell_output& out = get_cell_output();
+    flush_cell_output(out);
+
     // Convert absolute to relative address, which looks better when printed.
     address_t pos_display(pos);
     pos_display.set_absolute(false);
-    m_cell_name = mp_resolver->get_name(pos_display, abs_address_t(), false);
+    out.name = mp_resolver->get_name(pos_display, abs_address_t(), false);
 
-    cout << get_formula_result_output_separator() << endl;
-    cout << m_cell_name << ": ";
+    out.buf << get_formula_result_output_separator() << endl;
+    out.buf << out.name << ": ";
 }
 
 void session_handler::set_result(const formula_result& result)
 {
-    cout << endl << m_cell_name << ": result = " << result.str(m_context) << endl;
+    cell_output& out = get_cell_output();
+    out.buf << endl << out.name << ": result = " << result.str(m_context) << endl;
+    flush_cell_output(out);
 }
 
 void session_handler::set_invalid_expression(const char* msg)
 {
-    cout << endl << m_cell_name << ": invalid expression: " << msg << endl;
+    cell_output& out = get_cell_output();
+    out.buf << endl << out.name << ": invalid expression: " << msg << endl;
+    flush_cell_output(out);
 }
 
 void session_handler::set_formula_error(const char* msg)
 {
-    cout << endl << m_cell_name << ": result = " << msg << endl;
+    cell_output& out = get_cell_output();
+    out.buf << endl << out.name << ": result = " << msg << endl;
+    flush_cell_output(out);
 }
 
 void session_handler::push_token(fopcode_t fop)
 {
-    cout << get_formula_opcode_string(fop);
+    get_cell_output().buf << get_formula_opcode_string(fop);
 }
 
 void session_handler::push_value(double val)
 {
-    cout << val;
+    get_cell_output().buf << val;
 }
 
 void session_handler::push_string(size_t sid)
 {
     const string* p = m_context.get_string(sid);
-    cout << '"';
+    ostringstream& os = get_cell_output().buf;
+    os << '"';
     if (p)
-        cout << *p;
+        os << *p;
     else
-        cout << "(null string)";
-    cout << '"';
+        os << "(null string)";
+    os << '"';
 }
 
 void session_handler::push_single_ref(const address_t& addr, const abs_address_t& pos)
 {
-    cout << mp_resolver->get_name(addr, pos, false);
+    get_cell_output().buf << mp_resolver->get_name(addr, pos, false);
 }
 
 void session_handler::push_range_ref(const range_t& range, const abs_address_t& pos)
 {
-    cout << mp_resolver->get_name(range, pos, false);
+    get_cell_output().buf << mp_resolver->get_name(range, pos, false);
 }
 
 void session_handler::push_table_ref(const table_t& table)
 {
-    cout << mp_resolver->get_name(table);
+    get_cell_output().buf << mp_resolver->get_name(table);
 }
 
 void session_handler::push_function(formula_function_t foc)
 {
-    cout << get_formula_function_name(foc);
+    get_cell_output().buf << get_formula_function_name(foc);
 }
 
 }
@@ -12,6 +12,10 @@
 #include "ixion/model_context.hpp"
 
 #include <string>
+#include <sstream>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
 
 namespace ixion {
 
@@ -35,9 +39,26 @@ public:
     virtual void push_function(formula_function_t foc);
 
 private:
+    /**
+     * Output of the cell currently being interpreted on the calling
+     * thread.  Threaded calculation calls this handler from several worker
+     * threads at once, so each thread buffers its own cell, and the buffer
+     * gets written to the standard output in one piece when the cell's
+     * result is set.
+     */
+    struct cell_output
+    {
+        std::string name;
+        std::ostringstream buf;
+    };
+
+    cell_output& get_cell_output();
+    void flush_cell_output(cell_output& out);
+
     const model_context& m_context;
     std::unique_ptr<formula_name_resolver> mp_resolver;
-    std::string m_cell_name;
+    boost::thread_specific_ptr<cell_output> mp_cell_output;
+    boost::mutex m_output_mtx;
 };
 
 }
@@ -124,7 +124,7 @@ void sort_input_parser::print()
     vector<mem_str_buf> sorted;
     sorted.reserve(m_all_cells.size());
     cell_handler handler(sorted);
-    dfs_type dfs(m_all_cells, m_set.get(), handler);
+    dfs_type dfs(m_all_cells, m_set, handler);
     dfs.run();
 
     // Print the result.
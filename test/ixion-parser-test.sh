@@ -5,5 +5,8 @@ SRCDIR=$PROGDIR/../src
 
 export PATH=$SRCDIR:$SRCDIR/.libs:$PATH
 
-ixion-parser $PROGDIR/*.txt
+ixion-parser $PROGDIR/*.txt || exit 1
+ixion-parser -t 4 $PROGDIR/*.txt || exit 1
+ixion-parser -t 4 -m wavefront $PROGDIR/*.txt || exit 1
+ixion-parser -t 4 -m deterministic $PROGDIR/*.txt
 